@@ -108,12 +108,15 @@ void ram_getsize(paddr_t *lo, paddr_t *hi);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct semaphore;
+
 struct tlbshootdown {
 	/*
 	 * Change this to what you need for your VM design.
 	 */
 	struct addrspace *ts_addrspace;
 	vaddr_t ts_vaddr;
+	struct semaphore *ts_done;	/* V'd when done, if not NULL */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -29,13 +29,26 @@
 
 /*
  * LAMEbus hard disk (lhd) driver.
+ *
+ * The hardware does one sector at a time. Requests are queued, and
+ * each sector is started by the interrupt handler as soon as the one
+ * before it finishes, so the disk never sits waiting for a thread to
+ * be scheduled. The queue is kept in C-LOOK order: upward from the
+ * request the elevator is on, then back around to the lowest one. A
+ * request for the sectors just after, or just before, a waiting one
+ * in the same direction is merged into it so the two go out back to
+ * back; so is one that continues the request being transferred.
+ *
+ * lh_lock protects the queue and the device registers. Completion
+ * callbacks are called from the interrupt handler without it.
  */
 
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -95,41 +108,199 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the next sector of the active request.
+ */
+static
+void
+lhd_startsector(struct lhd_softc *lh)
+{
+	struct devreq *dr = lh->lh_active;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(dr != NULL);
+	KASSERT(dr->dr_pos < dr->dr_nblocks);
+
+	if (dr->dr_write) {
+		memcpy(lh->lh_buf,
+		       (char *)dr->dr_data + dr->dr_pos * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+	lhd_wreg(lh, LHD_REG_SECT, dr->dr_block + dr->dr_pos);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Which sweep of the elevator a sector falls in: 0 if it will be
+ * reached on the way up from where the elevator is, 1 if the elevator
+ * must come back around for it.
+ */
+static
+unsigned
+lhd_sweep(struct lhd_softc *lh, uint32_t sector)
+{
+	return sector >= lh->lh_headpos ? 0 : 1;
+}
+
+/*
+ * Add a request to the queue, merging it with a waiting one if
+ * possible.
+ */
+static
+void
+lhd_enqueue(struct lhd_softc *lh, struct devreq *dr)
+{
+	struct devreq **pp, *q, *tail;
+	unsigned sweep, qsweep;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	/* Can it follow on from what the disk is doing right now? */
+	q = lh->lh_active;
+	KASSERT(q != NULL);
+	if (q->dr_write == dr->dr_write) {
+		for (tail = q; tail->dr_merged != NULL;
+		     tail = tail->dr_merged) {
+			/* nothing */
+		}
+		if (tail->dr_block + tail->dr_nblocks == dr->dr_block) {
+			tail->dr_merged = dr;
+			return;
+		}
+	}
+
+	sweep = lhd_sweep(lh, dr->dr_block);
+
+	for (pp = &lh->lh_queue; (q = *pp) != NULL; pp = &q->dr_next) {
+		if (q->dr_write != dr->dr_write) {
+			continue;
+		}
+
+		/* Does it pick up where Q leaves off? */
+		for (tail = q; tail->dr_merged != NULL;
+		     tail = tail->dr_merged) {
+			/* nothing */
+		}
+		if (tail->dr_block + tail->dr_nblocks == dr->dr_block) {
+			tail->dr_merged = dr;
+			return;
+		}
+
+		/* Does it end where Q begins? Then it goes in Q's place. */
+		if (dr->dr_block + dr->dr_nblocks == q->dr_block &&
+		    lhd_sweep(lh, q->dr_block) == sweep) {
+			dr->dr_merged = q;
+			dr->dr_next = q->dr_next;
+			q->dr_next = NULL;
+			*pp = dr;
+			return;
+		}
+	}
+
+	for (pp = &lh->lh_queue; (q = *pp) != NULL; pp = &q->dr_next) {
+		qsweep = lhd_sweep(lh, q->dr_block);
+		if (qsweep > sweep ||
+		    (qsweep == sweep && q->dr_block > dr->dr_block)) {
+			break;
+		}
+	}
+	dr->dr_next = q;
+	*pp = dr;
+}
+
+/*
+ * Make the next request in the queue the active one and start it.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_startnext(struct lhd_softc *lh)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct devreq *dr;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(lh->lh_active == NULL);
+
+	dr = lh->lh_queue;
+	if (dr == NULL) {
+		return;
+	}
+	lh->lh_queue = dr->dr_next;
+	dr->dr_next = NULL;
+
+	lh->lh_active = dr;
+	lh->lh_headpos = dr->dr_block;
+	lhd_startsector(lh);
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, finish off the sector, and start the next one. Then report
+ * any requests that are done.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct devreq *dr, *done;
 	uint32_t val;
+	int result;
 	
+	spinlock_acquire(&lh->lh_lock);
+
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
 	    case LHD_IDLE:
 	    case LHD_WORKING:
-		break;
+		spinlock_release(&lh->lh_lock);
+		return;
 	    case LHD_OK:
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
 	}
+	result = lhd_code_to_errno(lh, val);
+
+	dr = lh->lh_active;
+	if (dr == NULL) {
+		kprintf("lhd%d: Spurious completion\n", lh->lh_unit);
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	if (result == 0) {
+		if (!dr->dr_write) {
+			memcpy((char *)dr->dr_data + dr->dr_pos*LHD_SECTSIZE,
+			       lh->lh_buf, LHD_SECTSIZE);
+		}
+		dr->dr_pos++;
+	}
+
+	done = NULL;
+	if (result != 0 || dr->dr_pos == dr->dr_nblocks) {
+		/* This one's over; any request merged into it carries on. */
+		dr->dr_result = result;
+		lh->lh_active = dr->dr_merged;
+		dr->dr_merged = NULL;
+		dr->dr_next = NULL;
+		done = dr;
+	}
+
+	if (lh->lh_active != NULL) {
+		lhd_startsector(lh);
+	}
+	else {
+		lhd_startnext(lh);
+	}
+
+	spinlock_release(&lh->lh_lock);
+
+	if (done != NULL) {
+		done->dr_done(done, done->dr_result);
+	}
 }
 
 /*
@@ -193,21 +364,125 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Queue a request (d_start).
+ */
+static
+int
+lhd_start(struct device *d, struct devreq *dr)
+{
+	struct lhd_softc *lh = d->d_data;
+
+	/* Don't allow I/O past the end of the disk. */
+	if (dr->dr_nblocks == 0 || dr->dr_block >= lh->lh_dev.d_blocks ||
+	    dr->dr_nblocks > lh->lh_dev.d_blocks - dr->dr_block) {
+		return EINVAL;
+	}
+
+	dr->dr_next = NULL;
+	dr->dr_merged = NULL;
+	dr->dr_pos = 0;
+	dr->dr_result = 0;
+
+	spinlock_acquire(&lh->lh_lock);
+	if (lh->lh_active == NULL) {
+		KASSERT(lh->lh_queue == NULL);
+		lh->lh_active = dr;
+		lh->lh_headpos = dr->dr_block;
+		lhd_startsector(lh);
+	}
+	else {
+		lhd_enqueue(lh, dr);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return 0;
+}
+
+/*
+ * A request that lhd_io is waiting for.
+ */
+struct lhd_wait {
+	struct devreq lw_req;
+	struct lhd_softc *lw_lh;
+	bool lw_done;
+};
+
+static
+void
+lhd_waitdone(struct devreq *dr, int result)
+{
+	struct lhd_wait *lw = dr->dr_arg;
+	struct lhd_softc *lh = lw->lw_lh;
+
+	(void)result;
+
+	spinlock_acquire(&lh->lh_lock);
+	lw->lw_done = true;
+	wchan_wakeall(lh->lh_wchan);
+	spinlock_release(&lh->lh_lock);
+}
+
+/*
+ * Transfer NSECT sectors starting at SECTOR to or from the kernel
+ * buffer DATA, and wait for it.
+ */
+static
+int
+lhd_rw(struct lhd_softc *lh, uint32_t sector, uint32_t nsect, void *data,
+       bool write)
+{
+	struct lhd_wait lw;
+	int result;
+
+	lw.lw_req.dr_block = sector;
+	lw.lw_req.dr_nblocks = nsect;
+	lw.lw_req.dr_data = data;
+	lw.lw_req.dr_write = write;
+	lw.lw_req.dr_done = lhd_waitdone;
+	lw.lw_req.dr_arg = &lw;
+	lw.lw_lh = lh;
+	lw.lw_done = false;
+
+	result = lhd_start(&lh->lh_dev, &lw.lw_req);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&lh->lh_lock);
+	while (!lw.lw_done) {
+		wchan_lock(lh->lh_wchan);
+		spinlock_release(&lh->lh_lock);
+		wchan_sleep(lh->lh_wchan);
+		spinlock_acquire(&lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return lw.lw_req.dr_result;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * A single kernel buffer is transferred directly, all in one request.
+ * Anything else goes through a bounce buffer a sector at a time. The
+ * bounce buffer comes from the heap; this is under the file system,
+ * where the stack is too short to spare a sector.
  */
 static
 int
 lhd_io(struct device *d, struct uio *uio)
 {
 	struct lhd_softc *lh = d->d_data;
+	struct iovec *iov;
+	char *bounce;
 
 	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
 	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	bool write = (uio->uio_rw == UIO_WRITE);
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -220,59 +495,56 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1) {
+		iov = uio->uio_iov;
+		KASSERT(iov->iov_len == uio->uio_resid);
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			if (result) {
-				V(lh->lh_clear);
-				return result;
-			}
+		result = lhd_rw(lh, sector, len, iov->iov_kbase, write);
+		if (result) {
+			return result;
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
+		/* Account for it the way uiomove would have */
+		iov->iov_kbase = (char *)iov->iov_kbase + uio->uio_resid;
+		iov->iov_len = 0;
+		uio->uio_offset += uio->uio_resid;
+		uio->uio_resid = 0;
+		return 0;
+	}
 
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
+	bounce = kmalloc(LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
 
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+	result = 0;
+	for (i=0; i<len; i++) {
+		if (write) {
+			result = uiomove(bounce, LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		result = lhd_rw(lh, sector+i, 1, bounce, write);
 		if (result) {
-			return result;
+			break;
+		}
+
+		if (!write) {
+			result = uiomove(bounce, LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
 		}
 	}
 
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 /*
@@ -289,15 +561,14 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_active = NULL;
+	lh->lh_queue = NULL;
+	lh->lh_headpos = 0;
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
 
@@ -306,6 +577,7 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	lh->lh_dev.d_close = lhd_close;
 	lh->lh_dev.d_io = lhd_io;
 	lh->lh_dev.d_ioctl = lhd_ioctl;
+	lh->lh_dev.d_start = lhd_start;
 	lh->lh_dev.d_blocks = bus_read_register(lh->lh_busdata, lh->lh_buspos,
 						LHD_REG_NSECT);
 	lh->lh_dev.d_blocksize = LHD_SECTSIZE;
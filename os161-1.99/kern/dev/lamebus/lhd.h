@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -51,9 +52,11 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the queue and registers */
+	struct devreq *lh_active;	/* Request being transferred */
+	struct devreq *lh_queue;	/* Requests waiting, in C-LOOK order */
+	uint32_t lh_headpos;		/* Where the elevator is */
+	struct wchan *lh_wchan;		/* For lhd_io to wait on */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -36,11 +36,12 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
-#include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* Shortcuts for the size macros in kern/sfs.h */
@@ -101,6 +102,48 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 	return 0;
 }
 
+/*
+ * Set up the allocator's count of free blocks in each group, and the
+ * record of which groups' freemap blocks need writing. There is one
+ * group per block of the freemap.
+ */
+static
+int
+sfs_countfree(struct sfs_fs *sfs)
+{
+	unsigned group, j, block;
+
+	sfs->sfs_ngroups = SFS_FS_BITBLOCKS(sfs);
+	sfs->sfs_groupfree = kmalloc(sfs->sfs_ngroups * sizeof(uint32_t));
+	if (sfs->sfs_groupfree == NULL) {
+		return ENOMEM;
+	}
+	sfs->sfs_groupdirty = kmalloc(sfs->sfs_ngroups * sizeof(bool));
+	if (sfs->sfs_groupdirty == NULL) {
+		kfree(sfs->sfs_groupfree);
+		return ENOMEM;
+	}
+	sfs->sfs_dirtygroups = kmalloc(sfs->sfs_ngroups * sizeof(uint32_t));
+	if (sfs->sfs_dirtygroups == NULL) {
+		kfree(sfs->sfs_groupdirty);
+		kfree(sfs->sfs_groupfree);
+		return ENOMEM;
+	}
+	sfs->sfs_ndirtygroups = 0;
+
+	for (group=0; group<sfs->sfs_ngroups; group++) {
+		sfs->sfs_groupdirty[group] = false;
+		sfs->sfs_groupfree[group] = 0;
+		for (j=0; j<SFS_GROUPSIZE; j++) {
+			block = group * SFS_GROUPSIZE + j;
+			if (!bitmap_isset(sfs->sfs_freemap, block)) {
+				sfs->sfs_groupfree[group]++;
+			}
+		}
+	}
+	return 0;
+}
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
@@ -111,11 +154,11 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
+	struct sfs_vnode *sv;
 	unsigned i, num;
+	uint32_t group;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -148,35 +191,78 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/*
+	 * With a journal, every change to metadata is already in the
+	 * running transaction, inodes included. Committing it is the
+	 * sync. This is also how the syncer thread's timer ends up
+	 * committing the transaction every few seconds.
+	 */
+	if (sfs->sfs_jmax > 0) {
+		result = sfs_jcommit(sfs);
+		if (result) {
+			return result;
+		}
+		return buf_sync(sfs->sfs_device);
+	}
+
+	/*
+	 * Sync the vnodes with dirty inodes. Their locks come before
+	 * sfs_vnlock, so take them off the dirty list one at a time
+	 * with the table locked, and sync each after letting go of it.
+	 * Only go through as many as were dirty when we started, so a
+	 * busy filesystem can't keep us here forever; anything dirtied
+	 * since is for the next sync.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	num = sfs->sfs_ndirty;
+	lock_release(sfs->sfs_vnlock);
+
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		lock_acquire(sfs->sfs_vnlock);
+		sv = sfs_dirtylist_pop(sfs);
+		if (sv != NULL) {
+			VOP_INCREF(&sv->sv_v);
+		}
+		lock_release(sfs->sfs_vnlock);
+		if (sv == NULL) {
+			break;
+		}
+		VOP_FSYNC(&sv->sv_v);
+		VOP_DECREF(&sv->sv_v);
 	}
 
-	/* If the free block map needs to be written, write it. */
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_mapio(sfs, UIO_WRITE);
+	lock_acquire(sfs->sfs_freemaplock);
+
+	/* Write the freemap blocks that have changed. */
+	while (sfs->sfs_ndirtygroups > 0) {
+		group = sfs->sfs_dirtygroups[sfs->sfs_ndirtygroups - 1];
+		KASSERT(sfs->sfs_groupdirty[group]);
+		result = sfs_wblock(sfs,
+				    (char *)bitmap_getdata(sfs->sfs_freemap)
+				    + group*SFS_BLOCKSIZE,
+				    SFS_MAP_LOCATION + group);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
-		sfs->sfs_freemapdirty = false;
+		sfs->sfs_groupdirty[group] = false;
+		sfs->sfs_ndirtygroups--;
 	}
 
 	/* If the superblock needs to be written, write it. */
 	if (sfs->sfs_superdirty) {
 		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
 
-	vfs_biglock_release();
-	return 0;
+	lock_release(sfs->sfs_freemaplock);
+
+	/* Everything above only went as far as the buffer cache. */
+	return buf_sync(sfs->sfs_device);
 }
 
 /*
@@ -189,13 +275,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
 
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
-
-	return ret;
+	/* The name never changes once mounted, so no locking is needed */
+	return sfs->sfs_super.sp_volname;
 }
 
 /*
@@ -208,23 +290,47 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
-	
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount. This only
+	 * holds sfs_vnlock for the check. Nothing can load a vnode
+	 * after it, because getting at this volume means starting from
+	 * a vnode we already have, or from its root or device name.
+	 * vfs_unmount holds vfs_biglock, and vfs_lookup and
+	 * vfs_getroot need that lock to look up names in the mount
+	 * list. The name cache was purged before we were called.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
-	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs->sfs_ndirtygroups == 0);
+
+	/* Leave the journal empty */
+	result = sfs_jshutdown(sfs);
+	if (result) {
+		return result;
+	}
 
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_jcleanup(sfs);
+	kfree(sfs->sfs_dirtygroups);
+	kfree(sfs->sfs_groupdirty);
+	kfree(sfs->sfs_groupfree);
 	bitmap_destroy(sfs->sfs_freemap);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
+	spinlock_cleanup(&sfs->sfs_dirtylock);
 	
+	/* Drop our blocks from the buffer cache. */
+	buf_purge(sfs->sfs_device);
+
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
 
@@ -232,7 +338,6 @@ sfs_unmount(struct fs *fs)
 	kfree(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -256,8 +361,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
 	int result;
 	struct sfs_fs *sfs;
-
-	vfs_biglock_acquire();
+	unsigned i;
 
 	/* We don't pass any options through mount */
 	(void)options;
@@ -268,6 +372,8 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	KASSERT(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	KASSERT(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
 	KASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	KASSERT(sizeof(struct sfs_jdesc)==SFS_BLOCKSIZE);
+	KASSERT(sizeof(struct sfs_jcommit)==SFS_BLOCKSIZE);
 
 	/*
 	 * We can't mount on devices with the wrong sector size.
@@ -278,22 +384,33 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		return ENXIO;
 	}
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	/* No vnodes loaded yet */
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_nvnodes = 0;
+
+	/* No journal until sfs_jinit */
+	sfs->sfs_jmax = 0;
+
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
+		kfree(sfs);
+		return ENOMEM;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		lock_destroy(sfs->sfs_vnlock);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -303,10 +420,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load superblock */
 	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
-		return result;
+		goto fail;
 	}
 
 	/* Make some simple sanity checks */
@@ -316,10 +430,22 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
-		return EINVAL;
+		result = EINVAL;
+		goto fail;
+	}
+
+	if (sfs->sfs_super.sp_version != SFS_VERSION) {
+		kprintf("sfs: Unsupported format version %u (should be %u)\n",
+			sfs->sfs_super.sp_version, SFS_VERSION);
+		result = EINVAL;
+		goto fail;
+	}
+
+	if (sfs->sfs_super.sp_features & ~SFS_FEATURES_KNOWN) {
+		kprintf("sfs: Unsupported features 0x%x\n",
+			sfs->sfs_super.sp_features & ~SFS_FEATURES_KNOWN);
+		result = EINVAL;
+		goto fail;
 	}
 	
 	if (sfs->sfs_super.sp_nblocks > dev->d_blocks) {
@@ -330,21 +456,48 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Ensure null termination of the volume name */
 	sfs->sfs_super.sp_volname[sizeof(sfs->sfs_super.sp_volname)-1] = 0;
 
+	/*
+	 * Finish off any transaction the journal holds before loading
+	 * anything else, since it can change anything - including the
+	 * superblock, so load that again.
+	 */
+	if (sfs->sfs_super.sp_features & SFS_FEATURE_JOURNAL) {
+		result = sfs_jreplay(sfs);
+		if (result == 0) {
+			result = sfs_rblock(sfs, &sfs->sfs_super,
+					    SFS_SB_LOCATION);
+		}
+		if (result) {
+			goto fail;
+		}
+		sfs->sfs_super.sp_volname[sizeof(sfs->sfs_super.sp_volname)-1]
+			= 0;
+	}
+
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
-		return ENOMEM;
+		result = ENOMEM;
+		goto fail;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
-		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
-		return result;
+		goto fail_freemap;
+	}
+	result = sfs_countfree(sfs);
+	if (result) {
+		goto fail_freemap;
+	}
+
+	/* Start the journal */
+	if (sfs->sfs_super.sp_features & SFS_FEATURE_JOURNAL) {
+		result = sfs_jinit(sfs);
+		if (result) {
+			kfree(sfs->sfs_dirtygroups);
+			kfree(sfs->sfs_groupdirty);
+			kfree(sfs->sfs_groupfree);
+			goto fail_freemap;
+		}
 	}
 
 	/* Set up abstract fs calls */
@@ -356,13 +509,30 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	/* the other fields */
 	sfs->sfs_superdirty = false;
-	sfs->sfs_freemapdirty = false;
+	spinlock_init(&sfs->sfs_dirtylock);
+	sfs->sfs_dirtyinodes = NULL;
+	sfs->sfs_ndirty = 0;
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
+
+ fail_freemap:
+	bitmap_destroy(sfs->sfs_freemap);
+ fail:
+	/*
+	 * Replaying the journal may have left dirty blocks behind. Try
+	 * to write them; if that fails the journal still has them for
+	 * next time, so drop them. Then drop the rest.
+	 */
+	(void)buf_sync(dev);
+	buf_discard(dev);
+	buf_purge(dev);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
+	kfree(sfs);
+	return result;
 }
 
 /*
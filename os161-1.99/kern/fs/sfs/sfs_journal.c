@@ -0,0 +1,789 @@
+/*
+ * SFS metadata journal.
+ *
+ * On a volume with SFS_FEATURE_JOURNAL, every change to metadata
+ * (inodes, indirect blocks, directories and their indexes, the
+ * freemap and the superblock) goes into the running transaction
+ * instead of being written where it belongs. Every so often, or on
+ * fsync, the whole transaction is committed: written to the journal
+ * (see kern/sfs.h) in one sequential burst, and only then to its home
+ * blocks. After a crash, sfs_jreplay finishes the job for a
+ * transaction that made it into the journal, so the volume is always
+ * as of some commit and doesn't need sfsck. File contents aren't
+ * journaled, but they are written before the transaction that makes
+ * them part of the file is committed.
+ *
+ * Operations that change metadata are bracketed with sfs_jbegin and
+ * sfs_jend. sfs_jbegin promises the operation a number of blocks
+ * ("credits") in the running transaction, committing it first if it
+ * hasn't room; the operation marks each metadata buffer it changes
+ * with sfs_jdirty, which pins it in the buffer cache so it can't be
+ * written early. Credits it didn't use go back at sfs_jend. A commit
+ * waits for the operations in progress to finish and keeps new ones
+ * from starting, so a transaction never holds half an operation.
+ *
+ * A block freed by the running transaction can't be reused until the
+ * transaction commits, or a crash could leave the committed metadata
+ * pointing at somebody else's data. So sfs_bfree just notes it in
+ * sfs_jfreed, and the commit frees it for real.
+ *
+ * Each thread's handle is found by looking through sfs_jhandles, so
+ * that an operation that sets off another (as VOP_DECREF can set off
+ * sfs_reclaim) joins the handle it already has rather than waiting
+ * for a commit that is waiting for it.
+ *
+ * sfs_jlock protects the journal fields in struct sfs_fs. It comes
+ * after sfs_freemaplock and before the buffer cache's lock; but
+ * sfs_jbegin and sfs_jcommit sleep, so they must be called with no
+ * SFS locks held.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <synch.h>
+#include <current.h>
+#include <vfs.h>
+#include <device.h>
+#include <buf.h>
+#include <sfs.h>
+
+/* Blocks of slack for inodes found dirty at commit time */
+#define SFS_JSLACK	8
+
+/*
+ * Checksum for commit blocks: 32-bit FNV-1a, continued from SUM.
+ */
+static
+uint32_t
+sfs_jsum(uint32_t sum, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		sum ^= p[i];
+		sum *= 16777619U;
+	}
+	return sum;
+}
+
+#define SFS_JSUM_INIT	2166136261U
+
+/*
+ * Find the current thread's handle, if it has one.
+ */
+static
+struct sfs_jhandle *
+sfs_jfind(struct sfs_fs *sfs)
+{
+	struct sfs_jhandle *jh;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_jlock));
+
+	for (jh = sfs->sfs_jhandles; jh != NULL; jh = jh->jh_next) {
+		if (jh->jh_thread == curthread) {
+			return jh;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Copy block FROM to block TO through the buffer cache, continuing
+ * the checksum in *SUM if SUM isn't NULL. This and the journal's own
+ * records work on the cache's buffers directly; these functions run
+ * on deep call chains, and blocks are too big for kernel stacks.
+ */
+static
+int
+sfs_jcopy(struct sfs_fs *sfs, uint32_t from, uint32_t to, uint32_t *sum)
+{
+	struct buf *fb, *tb;
+	int result;
+
+	result = buf_read(sfs->sfs_device, from, &fb);
+	if (result) {
+		return result;
+	}
+	result = buf_get(sfs->sfs_device, to, &tb);
+	if (result) {
+		buf_release(fb);
+		return result;
+	}
+	memcpy(buf_data(tb), buf_data(fb), SFS_BLOCKSIZE);
+	if (sum != NULL) {
+		*sum = sfs_jsum(*sum, buf_data(fb), SFS_BLOCKSIZE);
+	}
+	buf_markdirty(tb);
+	buf_release(tb);
+	buf_release(fb);
+	return 0;
+}
+
+/*
+ * Write an empty descriptor, so there is nothing to replay.
+ */
+static
+int
+sfs_jclear(struct sfs_fs *sfs, uint32_t seq)
+{
+	struct sfs_jdesc *jd;
+	struct buf *b;
+	int result;
+
+	result = buf_get(sfs->sfs_device, sfs->sfs_super.sp_journalstart, &b);
+	if (result) {
+		return result;
+	}
+	/* buf_get zeroes blocks it doesn't have, but it might have this */
+	jd = buf_data(b);
+	bzero(jd, sizeof(*jd));
+	jd->sjd_magic = SFS_JDESC_MAGIC;
+	jd->sjd_seq = seq;
+	jd->sjd_nblocks = 0;
+	buf_markdirty(b);
+	buf_release(b);
+
+	return buf_sync(sfs->sfs_device);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Mount and unmount
+
+/*
+ * Replay the transaction in the journal, if there is a complete one.
+ * Called during mount, after the superblock is loaded and before
+ * anything else is, since the transaction can change anything.
+ */
+int
+sfs_jreplay(struct sfs_fs *sfs)
+{
+	struct sfs_super *sp = &sfs->sfs_super;
+	struct sfs_jdesc *jd;
+	struct sfs_jcommit *jc;
+	struct buf *db, *b;
+	uint32_t jstart, sum, seq, nblocks, i, block;
+	bool valid;
+	int result;
+
+	jstart = sp->sp_journalstart;
+	if (sp->sp_journalblocks < 3 ||
+	    jstart < SFS_MAP_LOCATION + SFS_BITBLOCKS(sp->sp_nblocks) ||
+	    jstart + sp->sp_journalblocks > sp->sp_nblocks) {
+		kprintf("sfs: %s: Invalid journal location\n",
+			sp->sp_volname);
+		return EINVAL;
+	}
+
+	/* Transaction numbers carry on from the last one */
+	sfs->sfs_jseq = 1;
+
+	/* Keep the descriptor's buffer until we're done with the list */
+	result = buf_read(sfs->sfs_device, jstart, &db);
+	if (result) {
+		return result;
+	}
+	jd = buf_data(db);
+	if (jd->sjd_magic != SFS_JDESC_MAGIC) {
+		/* Never used */
+		buf_release(db);
+		return 0;
+	}
+	seq = jd->sjd_seq;
+	nblocks = jd->sjd_nblocks;
+	sfs->sfs_jseq = seq + 1;
+	if (nblocks == 0) {
+		/* Empty */
+		buf_release(db);
+		return 0;
+	}
+	if (nblocks > SFS_JMAXBLOCKS || nblocks + 2 > sp->sp_journalblocks) {
+		kprintf("sfs: %s: Invalid journal descriptor\n",
+			sp->sp_volname);
+		buf_release(db);
+		return EINVAL;
+	}
+
+	/*
+	 * If the commit block doesn't match, the crash came while the
+	 * transaction was being written, and the one before it was
+	 * already where it belongs.
+	 */
+	sum = sfs_jsum(SFS_JSUM_INIT, jd, sizeof(*jd));
+	for (i=0; i<nblocks; i++) {
+		result = buf_read(sfs->sfs_device, jstart + 1 + i, &b);
+		if (result) {
+			buf_release(db);
+			return result;
+		}
+		sum = sfs_jsum(sum, buf_data(b), SFS_BLOCKSIZE);
+		buf_release(b);
+	}
+	result = buf_read(sfs->sfs_device, jstart + 1 + nblocks, &b);
+	if (result) {
+		buf_release(db);
+		return result;
+	}
+	jc = buf_data(b);
+	valid = jc->sjc_magic == SFS_JCOMMIT_MAGIC && jc->sjc_seq == seq &&
+		jc->sjc_nblocks == nblocks && jc->sjc_sum == sum;
+	buf_release(b);
+	if (!valid) {
+		buf_release(db);
+		return 0;
+	}
+
+	for (i=0; i<nblocks; i++) {
+		block = jd->sjd_blocks[i];
+		if (block >= sp->sp_nblocks ||
+		    (block >= jstart && block < jstart + sp->sp_journalblocks)) {
+			kprintf("sfs: %s: Journal has invalid block %u\n",
+				sp->sp_volname, block);
+			buf_release(db);
+			return EINVAL;
+		}
+		result = sfs_jcopy(sfs, jstart + 1 + i, block, NULL);
+		if (result) {
+			buf_release(db);
+			return result;
+		}
+	}
+	buf_release(db);
+	result = buf_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
+	kprintf("sfs: %s: Replayed transaction %u (%u blocks) from the "
+		"journal\n", sp->sp_volname, seq, nblocks);
+
+	return sfs_jclear(sfs, seq);
+}
+
+/*
+ * Set up the journal for a volume being mounted, after sfs_jreplay
+ * and after the freemap is loaded.
+ */
+int
+sfs_jinit(struct sfs_fs *sfs)
+{
+	struct sfs_super *sp = &sfs->sfs_super;
+	unsigned max, overhead;
+	int result;
+
+	/* Leave pins for another journaled volume */
+	max = sp->sp_journalblocks - 2;
+	if (max > SFS_JMAXBLOCKS) {
+		max = SFS_JMAXBLOCKS;
+	}
+	if (max > BUF_MAXPINNED / 2) {
+		max = BUF_MAXPINNED / 2;
+	}
+
+	/* Leave room for the whole freemap, the superblock, and slack */
+	overhead = SFS_BITBLOCKS(sp->sp_nblocks) + 1 + SFS_JSLACK;
+	if (max < overhead + SFS_JCREDITS_RENAME) {
+		kprintf("sfs: %s: Journal too small for this volume\n",
+			sp->sp_volname);
+		return EINVAL;
+	}
+
+	result = buf_reservepins(max);
+	if (result) {
+		kprintf("sfs: %s: Too many journaled volumes mounted\n",
+			sp->sp_volname);
+		return result;
+	}
+
+	sfs->sfs_jlock = lock_create("sfs_jlock");
+	if (sfs->sfs_jlock == NULL) {
+		buf_unreservepins(max);
+		return ENOMEM;
+	}
+	sfs->sfs_jcv = cv_create("sfs_jcv");
+	if (sfs->sfs_jcv == NULL) {
+		lock_destroy(sfs->sfs_jlock);
+		buf_unreservepins(max);
+		return ENOMEM;
+	}
+	sfs->sfs_jfreed = bitmap_create(SFS_BITMAPSIZE(sp->sp_nblocks));
+	if (sfs->sfs_jfreed == NULL) {
+		cv_destroy(sfs->sfs_jcv);
+		lock_destroy(sfs->sfs_jlock);
+		buf_unreservepins(max);
+		return ENOMEM;
+	}
+
+	sfs->sfs_jhandles = NULL;
+	sfs->sfs_jactive = 0;
+	sfs->sfs_jreserved = 0;
+	sfs->sfs_jcommitting = false;
+	sfs->sfs_jcommitter = NULL;
+	sfs->sfs_jerror = 0;
+	sfs->sfs_jnblocks = 0;
+	sfs->sfs_jmax = max - overhead;
+	return 0;
+}
+
+/*
+ * Shut the journal down at unmount, after the final commit. Leaves
+ * it empty, so nothing is replayed next time.
+ */
+int
+sfs_jshutdown(struct sfs_fs *sfs)
+{
+	int result;
+
+	if (sfs->sfs_jmax == 0) {
+		return 0;
+	}
+	KASSERT(sfs->sfs_jactive == 0);
+
+	if (sfs->sfs_jnblocks > 0) {
+		/* The last commit failed */
+		return EIO;
+	}
+	result = buf_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+	return sfs_jclear(sfs, sfs->sfs_jseq - 1);
+}
+
+/*
+ * Free the journal's memory. Called after sfs_jshutdown, or when a
+ * mount fails after sfs_jinit.
+ */
+void
+sfs_jcleanup(struct sfs_fs *sfs)
+{
+	if (sfs->sfs_jmax == 0) {
+		return;
+	}
+	buf_unreservepins(sfs->sfs_jmax +
+			  SFS_BITBLOCKS(sfs->sfs_super.sp_nblocks) + 1 +
+			  SFS_JSLACK);
+	bitmap_destroy(sfs->sfs_jfreed);
+	cv_destroy(sfs->sfs_jcv);
+	lock_destroy(sfs->sfs_jlock);
+	sfs->sfs_jmax = 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Operations
+
+/*
+ * Start an operation that will add up to CREDITS blocks to the
+ * running transaction. JH is the handle, which must stay put until
+ * sfs_jend.
+ */
+int
+sfs_jbegin(struct sfs_fs *sfs, struct sfs_jhandle *jh, unsigned credits)
+{
+	struct sfs_jhandle *mine;
+	int result;
+
+	if (sfs->sfs_jmax == 0) {
+		return 0;
+	}
+	KASSERT(credits <= sfs->sfs_jmax);
+
+	lock_acquire(sfs->sfs_jlock);
+
+	mine = sfs_jfind(sfs);
+	if (mine != NULL) {
+		/* Part of an operation already under way */
+		mine->jh_depth++;
+		lock_release(sfs->sfs_jlock);
+		return 0;
+	}
+
+	while (sfs->sfs_jcommitting ||
+	       sfs->sfs_jreserved + credits > sfs->sfs_jmax) {
+		if (!sfs->sfs_jcommitting && sfs->sfs_jactive == 0) {
+			/* Full; commit it to make room */
+			lock_release(sfs->sfs_jlock);
+			result = sfs_jcommit(sfs);
+			if (result) {
+				return result;
+			}
+			lock_acquire(sfs->sfs_jlock);
+			continue;
+		}
+		cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+
+	jh->jh_thread = curthread;
+	jh->jh_depth = 1;
+	jh->jh_credits = credits;
+	jh->jh_next = sfs->sfs_jhandles;
+	sfs->sfs_jhandles = jh;
+	sfs->sfs_jactive++;
+	sfs->sfs_jreserved += credits;
+
+	lock_release(sfs->sfs_jlock);
+	return 0;
+}
+
+/*
+ * Finish the current thread's operation.
+ */
+void
+sfs_jend(struct sfs_fs *sfs)
+{
+	struct sfs_jhandle *jh, **pp;
+
+	if (sfs->sfs_jmax == 0) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	jh = sfs_jfind(sfs);
+	KASSERT(jh != NULL);
+
+	if (--jh->jh_depth > 0) {
+		lock_release(sfs->sfs_jlock);
+		return;
+	}
+
+	for (pp = &sfs->sfs_jhandles; *pp != jh; pp = &(*pp)->jh_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = jh->jh_next;
+
+	/* Give back what it didn't use */
+	KASSERT(sfs->sfs_jreserved >= jh->jh_credits);
+	sfs->sfs_jreserved -= jh->jh_credits;
+	sfs->sfs_jactive--;
+	cv_broadcast(sfs->sfs_jcv, sfs->sfs_jlock);
+
+	lock_release(sfs->sfs_jlock);
+}
+
+/*
+ * Get CREDITS more blocks for the current thread's operation, if the
+ * transaction has room; fails with ENOSPC if not. For operations
+ * that can't tell how much they'll change until they're under way,
+ * and can do without if need be.
+ */
+int
+sfs_jextend(struct sfs_fs *sfs, unsigned credits)
+{
+	struct sfs_jhandle *jh;
+	int result;
+
+	if (sfs->sfs_jmax == 0) {
+		return 0;
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	jh = sfs_jfind(sfs);
+	KASSERT(jh != NULL);
+	if (sfs->sfs_jreserved + credits <= sfs->sfs_jmax) {
+		sfs->sfs_jreserved += credits;
+		jh->jh_credits += credits;
+		result = 0;
+	}
+	else {
+		result = ENOSPC;
+	}
+	lock_release(sfs->sfs_jlock);
+	return result;
+}
+
+/*
+ * Mark buffer B, which holds metadata block BLOCK, dirty. With a
+ * journal, it goes in the running transaction.
+ */
+void
+sfs_jdirty(struct sfs_fs *sfs, struct buf *b, uint32_t block)
+{
+	struct sfs_jhandle *jh;
+
+	if (sfs->sfs_jmax == 0) {
+		buf_markdirty(b);
+		return;
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	if (!buf_pin(b)) {
+		/* Already in the transaction */
+		lock_release(sfs->sfs_jlock);
+		return;
+	}
+
+	if (sfs->sfs_jcommitter != curthread) {
+		jh = sfs_jfind(sfs);
+		if (jh != NULL && jh->jh_credits > 0) {
+			jh->jh_credits--;
+		}
+		else if (sfs->sfs_jreserved < sfs->sfs_jmax + SFS_JSLACK) {
+			/* Underestimated; take it from the slack */
+			sfs->sfs_jreserved++;
+		}
+		else {
+			panic("sfs: %s: Journal transaction overflow\n",
+			      sfs->sfs_super.sp_volname);
+		}
+	}
+
+	KASSERT(sfs->sfs_jnblocks < SFS_JMAXBLOCKS);
+	sfs->sfs_jblocks[sfs->sfs_jnblocks++] = block;
+	lock_release(sfs->sfs_jlock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Commit
+
+/*
+ * Put inodes that are still dirty, the freemap and the superblock in
+ * the transaction. The freemap goes in as it will be once the blocks
+ * freed by the transaction really are free.
+ */
+static
+int
+sfs_jgather(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+	struct buf *b;
+	uint32_t *map, *freed, *data;
+	unsigned j, group, offset;
+	int result;
+
+	/* Nobody is changing inodes; see sfs_jcommit */
+	lock_acquire(sfs->sfs_vnlock);
+	while ((sv = sfs_dirtylist_pop(sfs)) != NULL) {
+		if (!sv->sv_dirty) {
+			continue;
+		}
+		result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
+		if (result) {
+			lock_release(sfs->sfs_vnlock);
+			return result;
+		}
+		sv->sv_dirty = false;
+	}
+	lock_release(sfs->sfs_vnlock);
+
+	/* Only the freemap blocks that changed */
+	lock_acquire(sfs->sfs_freemaplock);
+	while (sfs->sfs_ndirtygroups > 0) {
+		group = sfs->sfs_dirtygroups[sfs->sfs_ndirtygroups - 1];
+		KASSERT(sfs->sfs_groupdirty[group]);
+		offset = group * (SFS_BLOCKSIZE/sizeof(uint32_t));
+		map = (uint32_t *)bitmap_getdata(sfs->sfs_freemap) + offset;
+		freed = (uint32_t *)bitmap_getdata(sfs->sfs_jfreed) + offset;
+		result = buf_get(sfs->sfs_device, SFS_MAP_LOCATION+group, &b);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		data = buf_data(b);
+		for (j=0; j<SFS_BLOCKSIZE/sizeof(uint32_t); j++) {
+			data[j] = map[j] & ~freed[j];
+		}
+		sfs_jdirty(sfs, b, SFS_MAP_LOCATION+group);
+		buf_release(b);
+		sfs->sfs_groupdirty[group] = false;
+		sfs->sfs_ndirtygroups--;
+	}
+	if (sfs->sfs_superdirty) {
+		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		sfs->sfs_superdirty = false;
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	return 0;
+}
+
+/*
+ * Write the transaction to the journal and wait for it.
+ */
+static
+int
+sfs_jwrite(struct sfs_fs *sfs)
+{
+	struct sfs_jdesc *jd;
+	struct sfs_jcommit *jc;
+	struct buf *b;
+	uint32_t jstart = sfs->sfs_super.sp_journalstart;
+	uint32_t sum;
+	unsigned i;
+	int result;
+
+	result = buf_get(sfs->sfs_device, jstart, &b);
+	if (result) {
+		return result;
+	}
+	jd = buf_data(b);
+	bzero(jd, sizeof(*jd));
+	jd->sjd_magic = SFS_JDESC_MAGIC;
+	jd->sjd_seq = sfs->sfs_jseq;
+	jd->sjd_nblocks = sfs->sfs_jnblocks;
+	for (i=0; i<sfs->sfs_jnblocks; i++) {
+		jd->sjd_blocks[i] = sfs->sfs_jblocks[i];
+	}
+	sum = sfs_jsum(SFS_JSUM_INIT, jd, sizeof(*jd));
+	buf_markdirty(b);
+	buf_release(b);
+
+	/* The pinned buffers are still cached, so this doesn't read */
+	for (i=0; i<sfs->sfs_jnblocks; i++) {
+		result = sfs_jcopy(sfs, sfs->sfs_jblocks[i], jstart + 1 + i,
+				   &sum);
+		if (result) {
+			return result;
+		}
+	}
+
+	/*
+	 * The checksum lets the commit block go with the rest rather
+	 * than after it.
+	 */
+	result = buf_get(sfs->sfs_device, jstart + 1 + sfs->sfs_jnblocks, &b);
+	if (result) {
+		return result;
+	}
+	jc = buf_data(b);
+	bzero(jc, sizeof(*jc));
+	jc->sjc_magic = SFS_JCOMMIT_MAGIC;
+	jc->sjc_seq = sfs->sfs_jseq;
+	jc->sjc_nblocks = sfs->sfs_jnblocks;
+	jc->sjc_sum = sum;
+	buf_markdirty(b);
+	buf_release(b);
+
+	return buf_sync(sfs->sfs_device);
+}
+
+/*
+ * Now the transaction is safe: let its blocks go home, and free the
+ * blocks it freed.
+ */
+static
+int
+sfs_jcheckpoint(struct sfs_fs *sfs)
+{
+	struct buf *b;
+	unsigned i, block;
+	int result, ret = 0;
+
+	for (i=0; i<sfs->sfs_jnblocks; i++) {
+		result = buf_read(sfs->sfs_device, sfs->sfs_jblocks[i], &b);
+		if (result) {
+			/* Can't happen: it's pinned, so it's cached */
+			panic("sfs: journal: lost pinned block %u\n",
+			      sfs->sfs_jblocks[i]);
+		}
+		buf_unpin(b);
+		buf_release(b);
+	}
+	sfs->sfs_jnblocks = 0;
+	sfs->sfs_jseq++;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	for (block=0; block < sfs->sfs_super.sp_nblocks; block++) {
+		if (bitmap_isset(sfs->sfs_jfreed, block)) {
+			bitmap_unmark(sfs->sfs_jfreed, block);
+			bitmap_unmark(sfs->sfs_freemap, block);
+			sfs->sfs_groupfree[block / SFS_GROUPSIZE]++;
+		}
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	/*
+	 * If this fails, the blocks are still dirty, and the next
+	 * commit won't touch the journal until they've been written.
+	 */
+	result = buf_sync(sfs->sfs_device);
+	if (result) {
+		ret = result;
+	}
+	return ret;
+}
+
+static
+int
+sfs_jdocommit(struct sfs_fs *sfs)
+{
+	int result;
+
+	result = sfs_jgather(sfs);
+	if (result) {
+		return result;
+	}
+	if (sfs->sfs_jnblocks == 0) {
+		return 0;
+	}
+
+	/*
+	 * Write out everything else first: file contents the
+	 * transaction points at, and what's left from the last
+	 * checkpoint, which has to be home before the journal can be
+	 * reused.
+	 */
+	result = buf_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
+	result = sfs_jwrite(sfs);
+	if (result) {
+		return result;
+	}
+
+	return sfs_jcheckpoint(sfs);
+}
+
+/*
+ * Commit the running transaction. If a commit is already under way,
+ * wait for that one instead; it has everything ours would have.
+ */
+int
+sfs_jcommit(struct sfs_fs *sfs)
+{
+	int result;
+
+	KASSERT(sfs->sfs_jmax > 0);
+
+	lock_acquire(sfs->sfs_jlock);
+	KASSERT(sfs_jfind(sfs) == NULL);
+
+	if (sfs->sfs_jcommitting) {
+		while (sfs->sfs_jcommitting) {
+			cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+		}
+		result = sfs->sfs_jerror;
+		lock_release(sfs->sfs_jlock);
+		return result;
+	}
+
+	/* Keep new operations out, and wait for the ones under way */
+	sfs->sfs_jcommitting = true;
+	while (sfs->sfs_jactive > 0) {
+		cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	sfs->sfs_jcommitter = curthread;
+	lock_release(sfs->sfs_jlock);
+
+	result = sfs_jdocommit(sfs);
+
+	lock_acquire(sfs->sfs_jlock);
+	sfs->sfs_jcommitter = NULL;
+	sfs->sfs_jcommitting = false;
+	sfs->sfs_jerror = result;
+	sfs->sfs_jreserved = sfs->sfs_jnblocks;
+	cv_broadcast(sfs->sfs_jcv, sfs->sfs_jlock);
+	lock_release(sfs->sfs_jlock);
+
+	return result;
+}
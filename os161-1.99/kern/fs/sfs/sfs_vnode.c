@@ -37,18 +37,26 @@
 #include <kern/fcntl.h>
 #include <stat.h>
 #include <lib.h>
-#include <array.h>
 #include <bitmap.h>
 #include <uio.h>
 #include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
+#include <dcache.h>
 #include <sfs.h>
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* With the vnode ops */
+static int sfs_dotruncate(struct sfs_vnode *sv, off_t len);
+
+/* With object creation */
+static int sfs_makeobj(struct sfs_fs *sfs, int type, uint32_t goal,
+		       struct sfs_vnode **ret);
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -58,9 +66,17 @@ static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct buf *b;
+	int result;
+
+	result = buf_get(sfs->sfs_device, block, &b);
+	if (result) {
+		return result;
+	}
+	bzero(buf_data(b), SFS_BLOCKSIZE);
+	buf_markdirty(b);
+	buf_release(b);
+	return 0;
 }
 
 /* Write an on-disk inode structure back out to disk. */
@@ -79,28 +95,262 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	return 0;
 }
 
+/*
+ * On a journaled volume, put a changed inode in the transaction
+ * before the operation that changed it ends, so it's paid for out of
+ * the operation's credits.
+ */
+static
+int
+sfs_jsync_inode(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	if (sfs->sfs_jmax == 0) {
+		return 0;
+	}
+	return sfs_sync_inode(sv);
+}
+
+/*
+ * Mark a buffer holding part of a file dirty. Directories and their
+ * indexes are metadata, and go in the journal; file contents don't.
+ */
+static
+void
+sfs_dirtyfileblock(struct sfs_vnode *sv, struct buf *b, uint32_t block)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	if (sv->sv_i.sfi_type == SFS_TYPE_FILE) {
+		buf_markdirty(b);
+	}
+	else {
+		sfs_jdirty(sfs, b, block);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Table of loaded vnodes
+//
+// Loaded vnodes are kept in a hash table keyed by inode number, so
+// that sfs_loadvnode can find an inode that's already in memory
+// without looking at all of them.
+//
+// Handing a vnode out races with reclaiming it: VOP_DECREF decides to
+// reclaim when the refcount is 1, but sfs_loadvnode may find the
+// vnode and take a new reference before sfs_reclaim gets going. So
+// sfs_reclaim checks the refcount again with sfs_vnlock held, and
+// keeps holding it until the vnode is out of the table; if somebody
+// did pick the vnode up, it backs off with EBUSY and the new user
+// carries on with the vnode.
+
+static
+struct sfs_vnode *
+sfs_vnhash_lookup(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_vnhash[SFS_VNHASH(ino)]; sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_vnhash_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned h = SFS_VNHASH(sv->sv_ino);
+
+	KASSERT(sfs_vnhash_lookup(sfs, sv->sv_ino) == NULL);
+	sv->sv_hashnext = sfs->sfs_vnhash[h];
+	sfs->sfs_vnhash[h] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **pp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (pp = &sfs->sfs_vnhash[SFS_VNHASH(sv->sv_ino)]; *pp != NULL;
+	     pp = &(*pp)->sv_hashnext) {
+		if (*pp == sv) {
+			*pp = sv->sv_hashnext;
+			sv->sv_hashnext = NULL;
+			KASSERT(sfs->sfs_nvnodes > 0);
+			sfs->sfs_nvnodes--;
+			return;
+		}
+	}
+	panic("sfs: reclaim vnode %u not in vnode pool\n", sv->sv_ino);
+}
+
+/*
+ * The dirty inode list. An inode goes on it when it's changed, so
+ * sfs_sync can find the inodes it needs to write without looking at
+ * every loaded vnode. Writing an inode doesn't take it off, since that
+ * would mean taking sfs_vnlock; sfs_sync skips the ones that turn out
+ * to be clean.
+ */
+static
+void
+sfs_dirtylist_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	if (!sv->sv_ondirtylist) {
+		sv->sv_ondirtylist = true;
+		sv->sv_dirtynext = sfs->sfs_dirtyinodes;
+		sfs->sfs_dirtyinodes = sv;
+		sfs->sfs_ndirty++;
+	}
+	spinlock_release(&sfs->sfs_dirtylock);
+}
+
+static
+void
+sfs_dirtylist_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **pp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	if (sv->sv_ondirtylist) {
+		for (pp = &sfs->sfs_dirtyinodes; *pp != sv;
+		     pp = &(*pp)->sv_dirtynext) {
+			KASSERT(*pp != NULL);
+		}
+		*pp = sv->sv_dirtynext;
+		sv->sv_dirtynext = NULL;
+		sv->sv_ondirtylist = false;
+		sfs->sfs_ndirty--;
+	}
+	spinlock_release(&sfs->sfs_dirtylock);
+}
+
+struct sfs_vnode *
+sfs_dirtylist_pop(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	sv = sfs->sfs_dirtyinodes;
+	if (sv != NULL) {
+		sfs->sfs_dirtyinodes = sv->sv_dirtynext;
+		sv->sv_dirtynext = NULL;
+		sv->sv_ondirtylist = false;
+		sfs->sfs_ndirty--;
+	}
+	spinlock_release(&sfs->sfs_dirtylock);
+	return sv;
+}
+
+/*
+ * Note that an inode was changed.
+ */
+static
+void
+sfs_dirty_inode(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	sv->sv_dirty = true;
+	sfs_dirtylist_add(sfs, sv);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Space allocation
 
 /*
- * Allocate a block.
+ * Note that the freemap block covering DISKBLOCK was changed, so
+ * that syncing writes only the freemap blocks that need it.
+ */
+static
+void
+sfs_freemap_dirty(struct sfs_fs *sfs, uint32_t diskblock)
+{
+	unsigned group = diskblock / SFS_GROUPSIZE;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (!sfs->sfs_groupdirty[group]) {
+		sfs->sfs_groupdirty[group] = true;
+		KASSERT(sfs->sfs_ndirtygroups < sfs->sfs_ngroups);
+		sfs->sfs_dirtygroups[sfs->sfs_ndirtygroups++] = group;
+	}
+}
+
+/*
+ * Allocate a block, as close after GOAL as possible: the first free
+ * block at or after it in its group, else anywhere in its group, else
+ * in the next group that has any free blocks. Allocating one block
+ * after another this way lays them out contiguously.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *diskblock)
 {
+	struct bitmap *map = sfs->sfs_freemap;
+	unsigned group, groupstart, groupend, i;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	if (goal >= sfs->sfs_super.sp_nblocks) {
+		goal = 0;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	result = ENOSPC;
+	group = goal / SFS_GROUPSIZE;
+	for (i=0; i<sfs->sfs_ngroups; i++) {
+		if (sfs->sfs_groupfree[group] > 0) {
+			groupstart = group * SFS_GROUPSIZE;
+			groupend = groupstart + SFS_GROUPSIZE;
+			if (i == 0) {
+				result = bitmap_alloc_range(map, goal,
+							    groupend,
+							    diskblock);
+				if (result) {
+					result = bitmap_alloc_range(map,
+							groupstart, goal,
+							diskblock);
+				}
+			}
+			else {
+				result = bitmap_alloc_range(map, groupstart,
+							    groupend,
+							    diskblock);
+			}
+			/* The count says there's a free block here */
+			KASSERT(result == 0);
+			break;
+		}
+		group = (group + 1) % sfs->sfs_ngroups;
+	}
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	sfs->sfs_groupfree[group]--;
+	sfs_freemap_dirty(sfs, *diskblock);
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
 	}
+	lock_release(sfs->sfs_freemaplock);
 
 	/* Clear block before returning it */
 	return sfs_clearblock(sfs, *diskblock);
@@ -113,8 +363,17 @@ static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs->sfs_jmax > 0) {
+		/* Not free until the transaction commits */
+		bitmap_mark(sfs->sfs_jfreed, diskblock);
+	}
+	else {
+		bitmap_unmark(sfs->sfs_freemap, diskblock);
+		sfs->sfs_groupfree[diskblock / SFS_GROUPSIZE]++;
+	}
+	sfs_freemap_dirty(sfs, diskblock);
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -124,17 +383,117 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
 //
 // Block mapping/inode maintenance
 
+/*
+ * Number of file blocks under one entry of an indirect block with
+ * HEIGHT more levels of indirect blocks below it.
+ */
+static
+uint32_t
+sfs_idspan(unsigned height)
+{
+	uint32_t span = 1;
+
+	while (height-- > 0) {
+		span *= SFS_DBPERIDB;
+	}
+	return span;
+}
+
+/*
+ * Find the indirect block tree in the inode that holds FILEBLOCK,
+ * which must be past the direct blocks. Returns a pointer to the
+ * inode's entry for the top of the tree, and sets *HEIGHT to the
+ * number of levels of indirect blocks in it. *FILEBLOCK is changed to
+ * the offset within the tree. Returns NULL if the file can't be that
+ * big.
+ */
+static
+uint32_t *
+sfs_indirslot(struct sfs_vnode *sv, uint32_t *fileblock, unsigned *height)
+{
+	uint32_t *slots[3] = {
+		&sv->sv_i.sfi_indirect,
+		&sv->sv_i.sfi_dindirect,
+		&sv->sv_i.sfi_tindirect,
+	};
+	uint32_t span;
+	unsigned i;
+
+	KASSERT(*fileblock >= SFS_NDIRECT);
+	*fileblock -= SFS_NDIRECT;
+
+	for (i=0; i<3; i++) {
+		span = sfs_idspan(i+1);
+		if (*fileblock < span) {
+			*height = i+1;
+			return slots[i];
+		}
+		*fileblock -= span;
+	}
+	return NULL;
+}
+
+/*
+ * Move a small file's contents out of its inode (see kern/sfs.h) into
+ * a block of its own, because it's growing past SFS_INLINESIZE. An
+ * empty file doesn't need the block yet.
+ */
+static
+int
+sfs_uninline(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *b;
+	uint32_t block;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(sv->sv_i.sfi_flags & SFS_IFLAG_INLINE);
+
+	if (sv->sv_i.sfi_size > 0) {
+		result = sfs_balloc(sfs, sv->sv_goal, &block);
+		if (result) {
+			return result;
+		}
+		sv->sv_goal = block + 1;
+
+		/* sfs_balloc just cleared it, so this doesn't read */
+		result = buf_read(sfs->sfs_device, block, &b);
+		if (result) {
+			sfs_bfree(sfs, block);
+			return result;
+		}
+		memcpy(buf_data(b), sv->sv_i.sfi_inline, sv->sv_i.sfi_size);
+		buf_markdirty(b);
+		buf_release(b);
+
+		sv->sv_i.sfi_direct[0] = block;
+	}
+
+	bzero(sv->sv_i.sfi_inline, sizeof(sv->sv_i.sfi_inline));
+	sv->sv_i.sfi_flags &= ~SFS_IFLAG_INLINE;
+	sfs_dirty_inode(sv);
+	return 0;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
@@ -146,22 +505,26 @@ int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t block;
-	uint32_t idblock;
-	uint32_t idnum, idoff;
+	struct buf *slotbuf;
+	uint32_t *idptrs, *slot;
+	uint32_t block, treeblock, slotblock;
+	unsigned height;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/*
+	 * A file kept in its inode has no blocks. Reads never get
+	 * here (see sfs_io), so this is a write that won't fit.
+	 */
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		KASSERT(doalloc);
+		result = sfs_uninline(sv);
+		if (result) {
+			return result;
+		}
+	}
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,14 +539,15 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_balloc(sfs, sv->sv_goal, &block);
 			if (result) {
 				return result;
 			}
+			sv->sv_goal = block + 1;
 
 			/* Remember what we allocated; mark inode dirty */
 			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
+			sfs_dirty_inode(sv);
 		}
 
 		/*
@@ -198,86 +562,58 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * It's not a direct block. Find the indirect block tree it's in
+	 * and walk down it, allocating as we go if asked to.
 	 */
-	if (idnum > 0) {
+	treeblock = fileblock;
+	slot = sfs_indirslot(sv, &treeblock, &height);
+	if (slot == NULL) {
 		return EFBIG;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
-	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
-		if (result) {
-			return result;
+	/*
+	 * SLOT points at the number of a block with HEIGHT levels of
+	 * indirect blocks below it, or at the data block if HEIGHT is 0.
+	 * It's either in the inode or in SLOTBUF.
+	 */
+	slotbuf = NULL;
+	slotblock = 0;
+	for (;;) {
+		block = *slot;
+		if (block==0 && doalloc) {
+			/* sfs_balloc clears it, so a new indirect block is empty */
+			result = sfs_balloc(sfs, sv->sv_goal, &block);
+			if (result) {
+				if (slotbuf != NULL) {
+					buf_release(slotbuf);
+				}
+				return result;
+			}
+			sv->sv_goal = block + 1;
+			*slot = block;
+			if (slotbuf != NULL) {
+				sfs_jdirty(sfs, slotbuf, slotblock);
+			}
+			else {
+				sfs_dirty_inode(sv);
+			}
 		}
-
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
-
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
+		if (slotbuf != NULL) {
+			buf_release(slotbuf);
 		}
-	}
-
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
-
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
-		if (result) {
-			return result;
+		if (block == 0 || height == 0) {
+			/* Found it, or a hole, which reads as zeros */
+			break;
 		}
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
+		result = buf_read(sfs->sfs_device, block, &slotbuf);
 		if (result) {
 			return result;
 		}
+		slotblock = block;
+		height--;
+		idptrs = buf_data(slotbuf);
+		slot = &idptrs[(treeblock / sfs_idspan(height)) % SFS_DBPERIDB];
 	}
 
 	/* Hand back the result and return. */
@@ -308,16 +644,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -339,40 +667,34 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Hand back zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = buf_read(sfs->sfs_device, diskblock, &iobuf);
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
 	 */
-	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+	result = uiomove((char *)buf_data(iobuf)+skipstart, len, uio);
+
+	/*
+	 * If it was a write, the buffer is now dirty.
+	 */
+	if (result == 0 && uio->uio_rw == UIO_WRITE) {
+		sfs_dirtyfileblock(sv, iobuf, diskblock);
 	}
+	buf_release(iobuf);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -383,14 +705,11 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
 	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -413,50 +732,97 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
+	 * Get the buffer. If we're overwriting the whole block there
+	 * is no point reading it first.
 	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+	if (uio->uio_rw == UIO_READ) {
+		result = buf_read(sfs->sfs_device, diskblock, &iobuf);
+	}
+	else {
+		result = buf_get(sfs->sfs_device, diskblock, &iobuf);
+	}
+	if (result) {
+		return result;
+	}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	result = uiomove(buf_data(iobuf), SFS_BLOCKSIZE, uio);
+	if (uio->uio_rw == UIO_WRITE) {
+		/* Even a failed move may have changed part of it. */
+		sfs_dirtyfileblock(sv, iobuf, diskblock);
+	}
+	buf_release(iobuf);
 
 	return result;
 }
 
 /*
- * Do I/O of a whole region of data, whether or not it's block-aligned.
+ * Start reading the blocks a read is going to need, so the disk can
+ * do them all in one go rather than one per trip through sfs_blockio.
+ * If the file is being read sequentially, also read ahead the next
+ * SFS_RAWINDOW blocks. Only blocks past what was already started are
+ * asked for; the buffer cache does nothing for blocks it has.
  */
 static
-int
-sfs_io(struct sfs_vnode *sv, struct uio *uio)
+void
+sfs_readahead(struct sfs_vnode *sv, struct uio *uio)
 {
-	uint32_t blkoff;
-	uint32_t nblocks, i;
-	int result = 0;
-	uint32_t extraresid = 0;
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t first, last, eof, fileblock, diskblock;
 
-	/*
-	 * If reading, check for EOF. If we can read a partial area,
-	 * remember how much extra there was in EXTRARESID so we can
-	 * add it back to uio_resid at the end.
-	 */
+	KASSERT(uio->uio_rw == UIO_READ);
+
+	first = uio->uio_offset / SFS_BLOCKSIZE;
+	last = DIVROUNDUP(uio->uio_offset + uio->uio_resid, SFS_BLOCKSIZE);
+	eof = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+
+	if (first == sv->sv_nextread) {
+		last += SFS_RAWINDOW;
+		if (first < sv->sv_raend) {
+			first = sv->sv_raend;
+		}
+	}
+	if (last > eof) {
+		last = eof;
+	}
+	if (last > first + SFS_RAMAX) {
+		last = first + SFS_RAMAX;
+	}
+	if (first + 1 >= last) {
+		/* One block, or none; just read it normally */
+		return;
+	}
+
+	for (fileblock = first; fileblock < last; fileblock++) {
+		if (sfs_bmap(sv, fileblock, 0, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			buf_readahead(sfs->sfs_device, diskblock);
+		}
+	}
+	sv->sv_raend = fileblock;
+}
+
+/*
+ * Do I/O of a whole region of data, whether or not it's block-aligned.
+ */
+static
+int
+sfs_io(struct sfs_vnode *sv, struct uio *uio)
+{
+	uint32_t blkoff;
+	uint32_t nblocks, i;
+	int result = 0;
+	uint32_t extraresid = 0;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/*
+	 * If reading, check for EOF. If we can read a partial area,
+	 * remember how much extra there was in EXTRARESID so we can
+	 * add it back to uio_resid at the end.
+	 */
 	if (uio->uio_rw == UIO_READ) {
 		off_t size = sv->sv_i.sfi_size;
 		off_t endpos = uio->uio_offset + uio->uio_resid;
@@ -471,6 +837,25 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
 		}
+
+		if ((sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) == 0) {
+			sfs_readahead(sv, uio);
+		}
+	}
+
+	/*
+	 * A small file's contents are in its inode, and stay there as
+	 * long as they fit. Otherwise sfs_bmap moves them out.
+	 */
+	if ((sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) &&
+	    uio->uio_offset + uio->uio_resid <= SFS_INLINESIZE) {
+		result = uiomove(sv->sv_i.sfi_inline + uio->uio_offset,
+				 uio->uio_resid, uio);
+		if (uio->uio_rw == UIO_WRITE) {
+			/* Even a failed move may have changed part of it. */
+			sfs_dirty_inode(sv);
+		}
+		goto out;
 	}
 
 	/*
@@ -531,7 +916,18 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	if (uio->uio_rw == UIO_WRITE && 
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
 		sv->sv_i.sfi_size = uio->uio_offset;
-		sv->sv_dirty = true;
+		sfs_dirty_inode(sv);
+	}
+	if (uio->uio_rw == UIO_WRITE) {
+		int result2 = sfs_jsync_inode(sv);
+		if (result == 0) {
+			result = result2;
+		}
+	}
+
+	/* Remember where the next read would be if this is sequential */
+	if (uio->uio_rw == UIO_READ) {
+		sv->sv_nextread = uio->uio_offset / SFS_BLOCKSIZE;
 	}
 
 	/* Add in any extra amount we couldn't read because of EOF */
@@ -636,6 +1032,513 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_dir);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Directory hash index
+//
+// On a volume with SFS_FEATURE_DIRHASH, a directory that grows to
+// SFS_DIRINDEX_MIN slots gets a hash index (see kern/sfs.h), kept in
+// an inode of its own. Looking a name up then reads a bucket or two
+// and the one directory entry they point at, instead of every entry
+// in the directory. The index's vnode is loaded the first time it's
+// needed and held by the directory's vnode (sv_index) from then on.
+//
+// The index is only ever a shortcut: if updating it fails, it is
+// thrown away and the directory is searched the slow way until it
+// grows enough to get a new one.
+//
+// All of this is done with the directory's sv_lock held; the index's
+// sv_lock is taken after it.
+
+/*
+ * Hash a name (32-bit FNV-1a).
+ */
+static
+uint32_t
+sfs_dirhash(const char *name)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * Read or write LEN bytes at POS in the index ISV.
+ */
+static
+int
+sfs_dirindex_rw(struct sfs_vnode *isv, void *data, size_t len, off_t pos,
+		enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(lock_do_i_hold(isv->sv_lock));
+
+	uio_kinit(&iov, &ku, data, len, pos, rw);
+	result = sfs_io(isv, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid > 0) {
+		panic("sfs: dirindex: Short %s (ino %u)\n",
+		      rw == UIO_READ ? "read" : "write", isv->sv_ino);
+	}
+	return 0;
+}
+
+static
+int
+sfs_dirindex_getbucket(struct sfs_vnode *isv, uint32_t bucket,
+		       struct sfs_dirindex_entry *e)
+{
+	return sfs_dirindex_rw(isv, e, sizeof(*e),
+			       SFS_BLOCKSIZE + (off_t)bucket * sizeof(*e),
+			       UIO_READ);
+}
+
+static
+int
+sfs_dirindex_putbucket(struct sfs_vnode *isv, uint32_t bucket,
+		       struct sfs_dirindex_entry *e)
+{
+	return sfs_dirindex_rw(isv, e, sizeof(*e),
+			       SFS_BLOCKSIZE + (off_t)bucket * sizeof(*e),
+			       UIO_WRITE);
+}
+
+/*
+ * Get the index of directory SV, loading it if need be. Hands back
+ * NULL if the directory doesn't have one.
+ */
+static
+int
+sfs_dirindex_get(struct sfs_vnode *sv, struct sfs_vnode **ret)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_index == NULL && sv->sv_i.sfi_dirindex != 0) {
+		result = sfs_loadvnode(sfs, sv->sv_i.sfi_dirindex,
+				       SFS_TYPE_INVAL, &sv->sv_index);
+		if (result) {
+			return result;
+		}
+		if (sv->sv_index->sv_i.sfi_type != SFS_TYPE_DIRINDEX) {
+			panic("sfs: directory %u: Index %u has type %u\n",
+			      sv->sv_ino, sv->sv_index->sv_ino,
+			      sv->sv_index->sv_i.sfi_type);
+		}
+	}
+	*ret = sv->sv_index;
+	return 0;
+}
+
+/*
+ * Throw away the index of directory SV. Its inode is freed when the
+ * vnode is reclaimed.
+ */
+static
+void
+sfs_dirindex_drop(struct sfs_vnode *sv)
+{
+	struct sfs_vnode *isv = sv->sv_index;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(isv != NULL);
+
+	lock_acquire(isv->sv_lock);
+	isv->sv_i.sfi_linkcount = 0;
+	sfs_dirty_inode(isv);
+	(void)sfs_jsync_inode(isv);
+	lock_release(isv->sv_lock);
+
+	sv->sv_index = NULL;
+	sv->sv_i.sfi_dirindex = 0;
+	sfs_dirty_inode(sv);
+
+	VOP_DECREF(&isv->sv_v);
+}
+
+/*
+ * Put (HASH, SLOT) in the first free bucket of its probe sequence.
+ */
+static
+int
+sfs_dirindex_insert(struct sfs_vnode *isv, struct sfs_dirindex_header *hdr,
+		    uint32_t hash, int slot)
+{
+	struct sfs_dirindex_entry e;
+	uint32_t mask = hdr->sdh_nbuckets - 1;
+	uint32_t b, i;
+	int result;
+
+	KASSERT(hdr->sdh_nused < hdr->sdh_nbuckets);
+
+	for (i=0, b = hash & mask; i < hdr->sdh_nbuckets; i++, b = (b+1) & mask) {
+		result = sfs_dirindex_getbucket(isv, b, &e);
+		if (result) {
+			return result;
+		}
+		if (e.sde_slot == 0) {
+			e.sde_hash = hash;
+			e.sde_slot = slot + 1;
+			hdr->sdh_nused++;
+			return sfs_dirindex_putbucket(isv, b, &e);
+		}
+	}
+	panic("sfs: dirindex %u: No free bucket\n", isv->sv_ino);
+	return 0;
+}
+
+/*
+ * Take (HASH, SLOT) out of the index. Rather than leave a marker in
+ * its bucket, move later entries of the same cluster back into the
+ * hole whenever that doesn't put them before their home bucket, so
+ * that probing can always stop at the first empty bucket.
+ */
+static
+int
+sfs_dirindex_delete(struct sfs_vnode *isv, struct sfs_dirindex_header *hdr,
+		    uint32_t hash, int slot)
+{
+	struct sfs_dirindex_entry e;
+	uint32_t mask = hdr->sdh_nbuckets - 1;
+	uint32_t hole, b, home, i;
+	int result;
+
+	for (i=0, b = hash & mask; i < hdr->sdh_nbuckets; i++, b = (b+1) & mask) {
+		result = sfs_dirindex_getbucket(isv, b, &e);
+		if (result) {
+			return result;
+		}
+		if (e.sde_slot == 0) {
+			break;
+		}
+		if (e.sde_hash == hash && e.sde_slot == (uint32_t)slot + 1) {
+			break;
+		}
+	}
+	if (i == hdr->sdh_nbuckets || e.sde_slot == 0) {
+		panic("sfs: dirindex %u: Slot %d not indexed\n",
+		      isv->sv_ino, slot);
+	}
+
+	hole = b;
+	for (b = (hole+1) & mask; b != hole; b = (b+1) & mask) {
+		result = sfs_dirindex_getbucket(isv, b, &e);
+		if (result) {
+			return result;
+		}
+		if (e.sde_slot == 0) {
+			break;
+		}
+		/* Can it move back? Only if HOLE is cyclically in [home, b). */
+		home = e.sde_hash & mask;
+		if (((b - home) & mask) >= ((b - hole) & mask)) {
+			result = sfs_dirindex_putbucket(isv, hole, &e);
+			if (result) {
+				return result;
+			}
+			hole = b;
+		}
+	}
+
+	bzero(&e, sizeof(e));
+	hdr->sdh_nused--;
+	return sfs_dirindex_putbucket(isv, hole, &e);
+}
+
+/*
+ * Build the index of directory SV afresh, with NBUCKETS buckets,
+ * creating the index inode if the directory doesn't have one yet.
+ */
+static
+int
+sfs_dirindex_build(struct sfs_vnode *sv, uint32_t nbuckets)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dirindex_header *hdr;
+	struct sfs_vnode *isv;
+	struct sfs_dir sd;
+	int nentries, i, result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(nbuckets > 0 && (nbuckets & (nbuckets-1)) == 0);
+
+	/*
+	 * On a journaled volume the whole table goes in the
+	 * transaction, plus the two inodes and an indirect block or
+	 * two. If it won't fit, do without the index.
+	 */
+	result = sfs_jextend(sfs, 1 + nbuckets *
+			     sizeof(struct sfs_dirindex_entry) / SFS_BLOCKSIZE
+			     + 4);
+	if (result) {
+		return result;
+	}
+
+	result = sfs_dirindex_get(sv, &isv);
+	if (result) {
+		return result;
+	}
+	if (isv == NULL) {
+		result = sfs_makeobj(sfs, SFS_TYPE_DIRINDEX, sv->sv_ino, &isv);
+		if (result) {
+			return result;
+		}
+		isv->sv_i.sfi_linkcount = 1;
+		sfs_dirty_inode(isv);
+		sv->sv_index = isv;
+		sv->sv_i.sfi_dirindex = isv->sv_ino;
+		sfs_dirty_inode(sv);
+	}
+
+	hdr = kmalloc(sizeof(*hdr));
+	if (hdr == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(isv->sv_lock);
+
+	/* Empty the table; the buckets read as zeros until written. */
+	result = sfs_dotruncate(isv, 0);
+	if (result) {
+		goto out;
+	}
+	result = sfs_dotruncate(isv, SFS_BLOCKSIZE +
+			(off_t)nbuckets * sizeof(struct sfs_dirindex_entry));
+	if (result) {
+		goto out;
+	}
+
+	bzero(hdr, sizeof(*hdr));
+	hdr->sdh_nbuckets = nbuckets;
+
+	nentries = sfs_dir_nentries(sv);
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, &sd, i);
+		if (result) {
+			goto out;
+		}
+		if (sd.sfd_ino == SFS_NOINO) {
+			if (hdr->sdh_nfree < SFS_DIRINDEX_NFREE) {
+				hdr->sdh_free[hdr->sdh_nfree++] = i;
+			}
+			continue;
+		}
+		sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+		result = sfs_dirindex_insert(isv, hdr,
+					     sfs_dirhash(sd.sfd_name), i);
+		if (result) {
+			goto out;
+		}
+	}
+
+	result = sfs_dirindex_rw(isv, hdr, sizeof(*hdr), 0, UIO_WRITE);
+ out:
+	lock_release(isv->sv_lock);
+	kfree(hdr);
+	return result;
+}
+
+/*
+ * Look NAME up in the index ISV of directory SV, as for
+ * sfs_dir_findname. The empty slot handed back, if asked for, is the
+ * one sfs_dirindex_add will take off the free list.
+ */
+static
+int
+sfs_dirindex_lookup(struct sfs_vnode *sv, struct sfs_vnode *isv,
+		    const char *name, uint32_t *ino, int *slot,
+		    int *emptyslot)
+{
+	struct sfs_dirindex_header *hdr;
+	struct sfs_dirindex_entry e;
+	struct sfs_dir sd;
+	uint32_t hash, mask, nbuckets, b, i;
+	int nentries, result;
+
+	nentries = sfs_dir_nentries(sv);
+	hash = sfs_dirhash(name);
+
+	/* Too big for the stack; only needed until we have the counts */
+	hdr = kmalloc(sizeof(*hdr));
+	if (hdr == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(isv->sv_lock);
+
+	result = sfs_dirindex_rw(isv, hdr, sizeof(*hdr), 0, UIO_READ);
+	if (result) {
+		lock_release(isv->sv_lock);
+		kfree(hdr);
+		return result;
+	}
+	if (emptyslot != NULL && hdr->sdh_nfree > 0) {
+		*emptyslot = hdr->sdh_free[hdr->sdh_nfree-1];
+	}
+	nbuckets = hdr->sdh_nbuckets;
+	kfree(hdr);
+
+	mask = nbuckets - 1;
+	for (i=0, b = hash & mask; i < nbuckets; i++, b = (b+1) & mask) {
+		result = sfs_dirindex_getbucket(isv, b, &e);
+		if (result) {
+			lock_release(isv->sv_lock);
+			return result;
+		}
+		if (e.sde_slot == 0) {
+			break;
+		}
+		if (e.sde_hash != hash) {
+			continue;
+		}
+		if (e.sde_slot > (uint32_t)nentries) {
+			panic("sfs: directory %u: Index points past the end\n",
+			      sv->sv_ino);
+		}
+		result = sfs_readdir(sv, &sd, e.sde_slot - 1);
+		if (result) {
+			lock_release(isv->sv_lock);
+			return result;
+		}
+		sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+		if (sd.sfd_ino != SFS_NOINO && !strcmp(sd.sfd_name, name)) {
+			lock_release(isv->sv_lock);
+			if (slot != NULL) {
+				*slot = e.sde_slot - 1;
+			}
+			if (ino != NULL) {
+				*ino = sd.sfd_ino;
+			}
+			return 0;
+		}
+	}
+
+	lock_release(isv->sv_lock);
+	return ENOENT;
+}
+
+/*
+ * NAME has just been written into SLOT of directory SV; index it.
+ * Builds the index if the directory has got big enough to need one,
+ * and rebuilds it bigger if it's getting full.
+ */
+static
+void
+sfs_dirindex_add(struct sfs_vnode *sv, const char *name, int slot)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dirindex_header *hdr;
+	struct sfs_vnode *isv;
+	uint32_t nbuckets;
+	int nentries, result;
+
+	/* sfs_dir_findname has already loaded it, if there is one */
+	isv = sv->sv_index;
+
+	if (isv == NULL) {
+		if ((sfs->sfs_super.sp_features & SFS_FEATURE_DIRHASH) == 0) {
+			return;
+		}
+		nentries = sfs_dir_nentries(sv);
+		if (nentries < SFS_DIRINDEX_MIN) {
+			return;
+		}
+		nbuckets = SFS_DIRINDEX_MINBUCKETS;
+		while (nbuckets < 4 * (uint32_t)nentries) {
+			nbuckets *= 2;
+		}
+		result = sfs_dirindex_build(sv, nbuckets);
+		goto done;
+	}
+
+	hdr = kmalloc(sizeof(*hdr));
+	if (hdr == NULL) {
+		result = ENOMEM;
+		goto done;
+	}
+
+	lock_acquire(isv->sv_lock);
+	result = sfs_dirindex_rw(isv, hdr, sizeof(*hdr), 0, UIO_READ);
+	if (result) {
+		lock_release(isv->sv_lock);
+		kfree(hdr);
+		goto done;
+	}
+	if (hdr->sdh_nfree > 0 &&
+	    hdr->sdh_free[hdr->sdh_nfree-1] == (uint32_t)slot) {
+		hdr->sdh_nfree--;
+	}
+	if ((hdr->sdh_nused + 1) * 2 > hdr->sdh_nbuckets) {
+		/* Let go of ours first; the rebuild makes its own */
+		lock_release(isv->sv_lock);
+		nbuckets = hdr->sdh_nbuckets * 2;
+		kfree(hdr);
+		result = sfs_dirindex_build(sv, nbuckets);
+		goto done;
+	}
+	result = sfs_dirindex_insert(isv, hdr, sfs_dirhash(name), slot);
+	if (result == 0) {
+		result = sfs_dirindex_rw(isv, hdr, sizeof(*hdr), 0, UIO_WRITE);
+	}
+	lock_release(isv->sv_lock);
+	kfree(hdr);
+
+ done:
+	if (result && sv->sv_index != NULL) {
+		sfs_dirindex_drop(sv);
+	}
+}
+
+/*
+ * NAME is about to be removed from SLOT of directory SV, whose index
+ * is ISV; take it out of the index. The slot goes on the free list if
+ * there's room; if not, it's found again when the index is rebuilt.
+ */
+static
+void
+sfs_dirindex_remove(struct sfs_vnode *sv, struct sfs_vnode *isv,
+		    const char *name, int slot)
+{
+	struct sfs_dirindex_header *hdr;
+	int result;
+
+	hdr = kmalloc(sizeof(*hdr));
+	if (hdr == NULL) {
+		sfs_dirindex_drop(sv);
+		return;
+	}
+
+	lock_acquire(isv->sv_lock);
+	result = sfs_dirindex_rw(isv, hdr, sizeof(*hdr), 0, UIO_READ);
+	if (result == 0) {
+		result = sfs_dirindex_delete(isv, hdr, sfs_dirhash(name),
+					     slot);
+	}
+	if (result == 0) {
+		if (hdr->sdh_nfree < SFS_DIRINDEX_NFREE) {
+			hdr->sdh_free[hdr->sdh_nfree++] = slot;
+		}
+		result = sfs_dirindex_rw(isv, hdr, sizeof(*hdr), 0, UIO_WRITE);
+	}
+	lock_release(isv->sv_lock);
+	kfree(hdr);
+
+	if (result) {
+		sfs_dirindex_drop(sv);
+	}
+}
+
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
@@ -647,11 +1550,25 @@ int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		    uint32_t *ino, int *slot, int *emptyslot)
 {
+	struct sfs_vnode *isv;
 	struct sfs_dir tsd;
 	int found = 0;
-	int nentries = sfs_dir_nentries(sv);
+	int nentries;
 	int i, result;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	result = sfs_dirindex_get(sv, &isv);
+	if (result) {
+		return result;
+	}
+	if (isv != NULL) {
+		return sfs_dirindex_lookup(sv, isv, name, ino, slot,
+					   emptyslot);
+	}
+
+	nentries = sfs_dir_nentries(sv);
+
 	/* For each slot... */
 	for (i=0; i<nentries; i++) {
 
@@ -729,8 +1646,13 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, &sd, emptyslot);
-	
+	result = sfs_writedir(sv, &sd, emptyslot);
+	if (result) {
+		return result;
+	}
+
+	sfs_dirindex_add(sv, name, emptyslot);
+	return 0;
 }
 
 /*
@@ -740,14 +1662,39 @@ static
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
+	struct sfs_vnode *isv;
 	struct sfs_dir sd;
+	char name[SFS_NAMELEN];
+	int result;
+
+	/* If there's an index, it needs the name */
+	result = sfs_dirindex_get(sv, &isv);
+	if (result) {
+		return result;
+	}
+	if (isv != NULL) {
+		result = sfs_readdir(sv, &sd, slot);
+		if (result) {
+			return result;
+		}
+		sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+		strcpy(name, sd.sfd_name);
+	}
 
 	/* Initialize a suitable directory entry... */ 
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, &sd, slot);
+	result = sfs_writedir(sv, &sd, slot);
+	if (result) {
+		return result;
+	}
+
+	if (isv != NULL) {
+		sfs_dirindex_remove(sv, isv, name, slot);
+	}
+	return 0;
 }
 
 /*
@@ -787,11 +1734,13 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 // Object creation
 
 /*
- * Create a new filesystem object and hand back its vnode.
+ * Create a new filesystem object and hand back its vnode. It goes as
+ * near block GOAL (normally the directory it's in) as there's room.
  */
 static
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, int type, uint32_t goal,
+	    struct sfs_vnode **ret)
 {
 	uint32_t ino;
 	int result;
@@ -801,7 +1750,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, goal, &ino);
 	if (result) {
 		return result;
 	}
@@ -875,6 +1824,18 @@ static
 int
 sfs_close(struct vnode *v)
 {
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+
+	/*
+	 * With a journal, syncing means committing the transaction,
+	 * which would put a commit on every last close. What the file
+	 * changed is already in the transaction; leave it for fsync,
+	 * the syncer, or the transaction filling up.
+	 */
+	if (sfs->sfs_jmax > 0) {
+		return 0;
+	}
+
 	/* Sync it. */
 	return VOP_FSYNC(v);
 }
@@ -890,31 +1851,67 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
+	struct sfs_vnode *isv;
+	struct sfs_jhandle jh;
+	bool journaled = false;
 	int result;
 
-	vfs_biglock_acquire();
+ again:
+	lock_acquire(sv->sv_lock);
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. With sfs_vnlock held,
+	 * nobody else can.
 	 */
+	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
 		/* consume the reference VOP_DECREF gave us */
 		KASSERT(v->vn_refcount>1);
 		v->vn_refcount--;
 
-		vfs_biglock_release();
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		if (journaled) {
+			sfs_jend(sfs);
+		}
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
+
+	/*
+	 * Erasing the file, or writing its inode, has to be part of a
+	 * transaction. Most reclaims do neither, which is as well:
+	 * sfs_jbegin can't be called with locks held, and the name
+	 * cache drops references under the directory's lock. So only
+	 * start one if needed, and start over once we have it. The
+	 * reference VOP_DECREF gave us keeps anyone else from
+	 * reclaiming the vnode meanwhile.
+	 */
+	if (sfs->sfs_jmax > 0 && !journaled &&
+	    (sv->sv_i.sfi_linkcount == 0 || sv->sv_dirty)) {
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		result = sfs_jbegin(sfs, &jh, SFS_JCREDITS_TRUNC);
+		if (result) {
+			return result;
+		}
+		journaled = true;
+		goto again;
+	}
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
+		result = sfs_dotruncate(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_vnlock);
+			lock_release(sv->sv_lock);
+			if (journaled) {
+				sfs_jend(sfs);
+			}
 			return result;
 		}
 	}
@@ -922,36 +1919,45 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		if (journaled) {
+			sfs_jend(sfs);
+		}
 		return result;
 	}
 
+	/* Remove the vnode structure from the table in the struct sfs_fs. */
+	sfs_vnhash_remove(sfs, sv);
+	sfs_dirtylist_remove(sfs, sv);
+
 	/* If there are no on-disk references, discard the inode */
 	if (sv->sv_i.sfi_linkcount==0) {
 		sfs_bfree(sfs, sv->sv_ino);
 	}
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
+	lock_release(sfs->sfs_vnlock);
+	lock_release(sv->sv_lock);
+
+	/* Let go of the directory's index, which goes too if it did */
+	isv = sv->sv_index;
+	if (isv != NULL) {
+		if (sv->sv_i.sfi_linkcount==0) {
+			lock_acquire(isv->sv_lock);
+			isv->sv_i.sfi_linkcount = 0;
+			sfs_dirty_inode(isv);
+			(void)sfs_jsync_inode(isv);
+			lock_release(isv->sv_lock);
 		}
+		VOP_DECREF(&isv->sv_v);
 	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
+	if (journaled) {
+		sfs_jend(sfs);
 	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
 
+	lock_destroy(sv->sv_lock);
 	VOP_CLEANUP(&sv->sv_v);
 
-	vfs_biglock_release();
-
 	/* Release the storage for the vnode structure itself. */
 	kfree(sv);
 
@@ -971,9 +1977,9 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -986,13 +1992,49 @@ int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	struct sfs_jhandle jh;
+	size_t resid, chunk;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	if (sfs->sfs_jmax == 0) {
+		lock_acquire(sv->sv_lock);
+		result = sfs_io(sv, uio);
+		lock_release(sv->sv_lock);
+		return result;
+	}
+
+	/*
+	 * On a journaled volume, go SFS_JWRITECHUNK blocks at a time,
+	 * so the indirect blocks a big write changes needn't all fit
+	 * in one transaction. Hide the rest of the write from sfs_io
+	 * by shortening uio_resid.
+	 */
+	result = 0;
+	while (uio->uio_resid > 0) {
+		resid = uio->uio_resid;
+		chunk = SFS_JWRITECHUNK * SFS_BLOCKSIZE -
+			uio->uio_offset % SFS_BLOCKSIZE;
+		if (chunk > resid) {
+			chunk = resid;
+		}
+
+		result = sfs_jbegin(sfs, &jh, SFS_JCREDITS_WRITE);
+		if (result) {
+			break;
+		}
+		uio->uio_resid = chunk;
+		lock_acquire(sv->sv_lock);
+		result = sfs_io(sv, uio);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+		uio->uio_resid += resid - chunk;
+		if (result) {
+			break;
+		}
+	}
 
 	return result;
 }
@@ -1033,7 +2075,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1053,16 +2097,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes, so no locking is needed */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1100,11 +2141,20 @@ int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
+	if (sfs->sfs_jmax > 0) {
+		/*
+		 * The inode went in the transaction with whatever
+		 * changed it; committing it writes the lot.
+		 */
+		return sfs_jcommit(sfs);
+	}
+
+	lock_acquire(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -1121,35 +2171,121 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Discard everything at or past file block BLOCKLEN in the tree of
+ * indirect blocks whose top is *IDBLOCKP. HEIGHT is the number of
+ * levels of indirect blocks in the tree and BASEBLOCK the first file
+ * block it covers. If the top block ends up empty it is freed and
+ * *IDBLOCKP zeroed; *CHANGED says whether that happened.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_truncate_indirect(struct sfs_fs *sfs, uint32_t *idblockp, unsigned height,
+		      uint32_t baseblock, uint32_t blocklen, bool *changed)
 {
+	struct buf *idbuf;
+	uint32_t *idptrs;
+	uint32_t span, j;
+	bool hasnonzero, iddirty, subchanged;
+	int result;
+
+	*changed = false;
+
+	span = sfs_idspan(height-1);
+	if (*idblockp == 0 || baseblock + span*SFS_DBPERIDB <= blocklen) {
+		/* Nothing here, or nothing past the new EOF */
+		return 0;
+	}
+
+	result = buf_read(sfs->sfs_device, *idblockp, &idbuf);
+	if (result) {
+		return result;
+	}
+	idptrs = buf_data(idbuf);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		if (height > 1) {
+			result = sfs_truncate_indirect(sfs, &idptrs[j],
+						       height-1,
+						       baseblock + j*span,
+						       blocklen, &subchanged);
+			if (result) {
+				buf_release(idbuf);
+				return result;
+			}
+			if (subchanged) {
+				iddirty = true;
+			}
+		}
+		else if (blocklen <= baseblock+j && idptrs[j] != 0) {
+			/* Discard any blocks that are past the new EOF */
+			sfs_bfree(sfs, idptrs[j]);
+			idptrs[j] = 0;
+			iddirty = true;
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idptrs[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
 	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
+	 * If it's about to be freed, nobody needs the change. (That
+	 * also keeps a journaled truncate from touching more than one
+	 * indirect block per level.)
 	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	if (iddirty && hasnonzero) {
+		sfs_jdirty(sfs, idbuf, *idblockp);
+	}
+	buf_release(idbuf);
 
-	struct sfs_vnode *sv = v->vn_data;
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		sfs_bfree(sfs, *idblockp);
+		*idblockp = 0;
+		*changed = true;
+	}
+	return 0;
+}
+
+/*
+ * Truncate a file. Used by sfs_truncate and sfs_reclaim; the caller
+ * holds sv_lock.
+ */
+static
+int
+sfs_dotruncate(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
+	uint32_t i, block, baseblock;
+	uint32_t *slot;
+	unsigned height;
+	bool changed;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	vfs_biglock_acquire();
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		if (len <= SFS_INLINESIZE) {
+			/* Keep the bytes past EOF zero */
+			if (len < sv->sv_i.sfi_size) {
+				bzero(sv->sv_i.sfi_inline + len,
+				      sv->sv_i.sfi_size - len);
+			}
+			sv->sv_i.sfi_size = len;
+			sfs_dirty_inode(sv);
+			return 0;
+		}
+		result = sfs_uninline(sv);
+		if (result) {
+			return result;
+		}
+	}
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -1160,70 +2296,65 @@ sfs_truncate(struct vnode *v, off_t len)
 		if (i >= blocklen && block != 0) {
 			sfs_bfree(sfs, block);
 			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
+			sfs_dirty_inode(sv);
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
+	/* Then each of the indirect block trees. */
 	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
+	for (height=1; height<=3; height++) {
+		switch (height) {
+		    case 1: slot = &sv->sv_i.sfi_indirect; break;
+		    case 2: slot = &sv->sv_i.sfi_dindirect; break;
+		    default: slot = &sv->sv_i.sfi_tindirect; break;
+		}
+		result = sfs_truncate_indirect(sfs, slot, height, baseblock,
+					       blocklen, &changed);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
+		if (changed) {
+			sfs_dirty_inode(sv);
 		}
+		baseblock += sfs_idspan(height);
 	}
 
 	/* Set the file size */
 	sv->sv_i.sfi_size = len;
 
 	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+	sfs_dirty_inode(sv);
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Called for ftruncate().
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	struct sfs_jhandle jh;
+	int result;
+
+	result = sfs_jbegin(sfs, &jh, SFS_JCREDITS_TRUNC);
+	if (result) {
+		return result;
+	}
+	lock_acquire(sv->sv_lock);
+	result = sfs_dotruncate(sv, len);
+	if (result == 0) {
+		result = sfs_jsync_inode(sv);
+	}
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1250,8 +2381,8 @@ sfs_namefile(struct vnode *vv, struct uio *uio)
  */
 static
 int
-sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
-	  struct vnode **ret)
+sfs_docreat(struct vnode *v, const char *name, bool excl, mode_t mode,
+	    struct vnode **ret)
 {
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	struct sfs_vnode *sv = v->vn_data;
@@ -1259,18 +2390,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return EEXIST;
 	}
 
@@ -1278,18 +2409,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	result = sfs_makeobj(sfs, SFS_TYPE_FILE, sv->sv_ino, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1300,19 +2431,31 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
-	newguy->sv_dirty = true;
+	sfs_dirty_inode(newguy);
+	result = sfs_jsync_inode(newguy);
+	lock_release(newguy->sv_lock);
+	if (result) {
+		/* It's linked, so it can't just be thrown away */
+		VOP_DECREF(&newguy->sv_v);
+		lock_release(sv->sv_lock);
+		return result;
+	}
+
+	/* The name cache may remember that it didn't exist. */
+	dcache_remove(v, name);
 
 	*ret = &newguy->sv_v;
 	
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1323,7 +2466,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
  */
 static
 int
-sfs_link(struct vnode *dir, const char *name, struct vnode *file)
+sfs_dolink(struct vnode *dir, const char *name, struct vnode *file)
 {
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *f = file->vn_data;
@@ -1331,21 +2474,31 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	/* Hard links to directories aren't allowed. */
+	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
+		return EINVAL;
+	}
+
+	lock_acquire(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
-	f->sv_dirty = true;
+	sfs_dirty_inode(f);
+	result = sfs_jsync_inode(f);
+	lock_release(f->sv_lock);
 
-	vfs_biglock_release();
-	return 0;
+	dcache_remove(dir, name);
+
+	lock_release(sv->sv_lock);
+	return result;
 }
 
 /*
@@ -1353,19 +2506,19 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
  */
 static
 int
-sfs_remove(struct vnode *dir, const char *name)
+sfs_doremove(struct vnode *dir, const char *name)
 {
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *victim;
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1373,15 +2526,21 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
-		victim->sv_dirty = true;
+		sfs_dirty_inode(victim);
+		result = sfs_jsync_inode(victim);
+		lock_release(victim->sv_lock);
+
+		dcache_remove(dir, name);
 	}
 
+	lock_release(sv->sv_lock);
+
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1393,15 +2552,15 @@ sfs_remove(struct vnode *dir, const char *name)
  */
 static
 int
-sfs_rename(struct vnode *d1, const char *n1, 
-	   struct vnode *d2, const char *n2)
+sfs_dorename(struct vnode *d1, const char *n1,
+	     struct vnode *d2, const char *n2)
 {
 	struct sfs_vnode *sv = d1->vn_data;
 	struct sfs_vnode *g1;
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
@@ -1409,7 +2568,7 @@ sfs_rename(struct vnode *d1, const char *n1,
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1430,8 +2589,11 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
-	g1->sv_dirty = true;
+	sfs_dirty_inode(g1);
+	(void)sfs_jsync_inode(g1);
+	lock_release(g1->sv_lock);
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -1443,15 +2605,22 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
-	g1->sv_dirty = true;
+	sfs_dirty_inode(g1);
+	result = sfs_jsync_inode(g1);
+	lock_release(g1->sv_lock);
+
+	dcache_remove(d1, n1);
+	dcache_remove(d2, n2);
+
+	lock_release(sv->sv_lock);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
-	return 0;
+	return result;
 
  puke_harder:
 	/*
@@ -1464,14 +2633,123 @@ sfs_rename(struct vnode *d1, const char *n1,
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	lock_release(g1->sv_lock);
  puke:
+	lock_release(sv->sv_lock);
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
 	return result;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Directory operations, as transactions
+//
+// Each of these changes several blocks that must change together,
+// so on a journaled volume it runs as one operation of the running
+// transaction (see sfs_journal.c). The directory's inode goes in at
+// the end, since sfs_dir_link and friends may change it more than
+// once.
+
+/*
+ * Finish an operation on directory SV.
+ */
+static
+int
+sfs_jdirdone(struct sfs_vnode *sv, int result)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	int result2;
+
+	lock_acquire(sv->sv_lock);
+	result2 = sfs_jsync_inode(sv);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
+	return result ? result : result2;
+}
+
+/*
+ * Called for creat(). sfs_docreat() does the work.
+ */
+static
+int
+sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
+	  struct vnode **ret)
+{
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	struct sfs_jhandle jh;
+	int result;
+
+	result = sfs_jbegin(sfs, &jh, SFS_JCREDITS_DIROP);
+	if (result) {
+		return result;
+	}
+	result = sfs_docreat(v, name, excl, mode, ret);
+	return sfs_jdirdone(v->vn_data, result);
+}
+
+/*
+ * Called for link(). sfs_dolink() does the work.
+ */
+static
+int
+sfs_link(struct vnode *dir, const char *name, struct vnode *file)
+{
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
+	struct sfs_jhandle jh;
+	int result;
+
+	result = sfs_jbegin(sfs, &jh, SFS_JCREDITS_DIROP);
+	if (result) {
+		return result;
+	}
+	result = sfs_dolink(dir, name, file);
+	return sfs_jdirdone(dir->vn_data, result);
+}
+
+/*
+ * Called for remove(). sfs_doremove() does the work; erasing the
+ * file, if that was its last link, is part of the same operation.
+ */
+static
+int
+sfs_remove(struct vnode *dir, const char *name)
+{
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
+	struct sfs_jhandle jh;
+	int result;
+
+	result = sfs_jbegin(sfs, &jh, SFS_JCREDITS_DIROP);
+	if (result) {
+		return result;
+	}
+	result = sfs_doremove(dir, name);
+	return sfs_jdirdone(dir->vn_data, result);
+}
+
+/*
+ * Called for rename(). sfs_dorename() does the work.
+ */
+static
+int
+sfs_rename(struct vnode *d1, const char *n1,
+	   struct vnode *d2, const char *n2)
+{
+	struct sfs_fs *sfs = d1->vn_fs->fs_data;
+	struct sfs_jhandle jh;
+	int result;
+
+	result = sfs_jbegin(sfs, &jh, SFS_JCREDITS_RENAME);
+	if (result) {
+		return result;
+	}
+	result = sfs_dorename(d1, n1, d2, n2);
+	return sfs_jdirdone(d1->vn_data, result);
+}
+
 /*
  * lookparent returns the last path component as a string and the
  * directory it's in as a vnode.
@@ -1486,15 +2764,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +2776,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1510,7 +2783,9 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
  * Lookup gets a vnode for a pathname.
  *
  * Since we don't support subdirectories, it's easy - just look up the
- * name.
+ * name. The name cache is asked first, and told what we find. Asking
+ * doesn't need the directory locked: everything that changes the
+ * directory removes the name from the cache before unlocking it.
  */
 static
 int
@@ -1518,24 +2793,36 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_vnode *final;
+	struct vnode *vn;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
-	
+
+	if (dcache_lookup(v, path, &vn)) {
+		if (vn == NULL) {
+			return ENOENT;
+		}
+		*ret = vn;
+		return 0;
+	}
+
+	lock_acquire(sv->sv_lock);
+
 	result = sfs_lookonce(sv, path, &final, NULL);
+	if (result == ENOENT) {
+		dcache_enter(v, path, NULL);
+	}
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
+	dcache_enter(v, path, &final->sv_v);
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1651,42 +2938,35 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: Found inode %u in unallocated block\n",
-			      sv->sv_ino);
-		}
-
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* May only be set when creating new objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+	lock_acquire(sfs->sfs_vnlock);
 
-			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
-		}
+	/* Look in the vnodes table */
+	sv = sfs_vnhash_lookup(sfs, ino);
+	if (sv != NULL) {
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
+
+		VOP_INCREF(&sv->sv_v);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1699,13 +2979,29 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* Keep the file's blocks together, starting just after the inode */
+	sv->sv_goal = ino + 1;
+
+	/* Nothing read yet */
+	sv->sv_nextread = 0;
+	sv->sv_raend = 0;
+
+	/* Directory index not loaded */
+	sv->sv_index = NULL;
+
+	/* Not on the dirty list */
+	sv->sv_ondirtylist = false;
+	sv->sv_dirtynext = NULL;
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out and thus the type
@@ -1715,6 +3011,12 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
 		sv->sv_dirty = true;
+
+		/* New files start out kept in the inode, if allowed */
+		if (forcetype == SFS_TYPE_FILE &&
+		    (sfs->sfs_super.sp_features & SFS_FEATURE_INLINE)) {
+			sv->sv_i.sfi_flags = SFS_IFLAG_INLINE;
+		}
 	}
 
 	/*
@@ -1722,6 +3024,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	 */
 	switch (sv->sv_i.sfi_type) {
 	    case SFS_TYPE_FILE:
+	    case SFS_TYPE_DIRINDEX:
 		ops = &sfs_fileops;
 		break;
 	    case SFS_TYPE_DIR:
@@ -1736,21 +3039,26 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
 
-	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
+	/*
+	 * Add it to our table. Nobody can have loaded it while we were
+	 * reading, since we've held sfs_vnlock throughout.
+	 */
+	sfs_vnhash_add(sfs, sv);
+	if (sv->sv_dirty) {
+		sfs_dirtylist_add(sfs, sv);
 	}
 
+	lock_release(sfs->sfs_vnlock);
+
 	/* Hand it back */
 	*ret = sv;
 	return 0;
@@ -1767,14 +3075,10 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
@@ -37,8 +37,11 @@
 
 #include <vm.h>
 #include "opt-A3.h"
+#include "opt-dumbvm.h"
 
 struct vnode;
+struct lock;
+struct pagetable;
 
 
 /* 
@@ -48,6 +51,7 @@ struct vnode;
  * You write this.
  */
 
+#if OPT_DUMBVM
 struct addrspace {
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
@@ -61,6 +65,64 @@ struct addrspace {
   bool is_loaded;
   #endif
 };
+#else
+
+/* Most regions an ELF image may define (text, rodata, data). */
+#define AS_MAXREGIONS	3
+
+/* Size of the user stack. Pages are only allocated when touched. */
+#define VM_STACKPAGES	256
+
+/*
+ * A contiguous region of the address space. The bytes from
+ * seg_filevaddr up to seg_filevaddr+seg_filesize are backed by the
+ * executable at seg_fileoffset; every other page of the region is
+ * zero-filled the first time it is touched.
+ */
+struct segment {
+	vaddr_t seg_vbase;		/* page-aligned start of region */
+	size_t seg_npages;		/* length in pages */
+	bool seg_writeable;		/* map pages writeable in the TLB */
+	vaddr_t seg_filevaddr;		/* first file-backed address */
+	off_t seg_fileoffset;		/* its offset in the executable */
+	size_t seg_filesize;		/* number of file-backed bytes */
+};
+
+struct addrspace {
+	struct segment as_regions[AS_MAXREGIONS];
+	unsigned as_nregions;
+	struct segment as_stack;
+	struct pagetable *as_pt;	/* resident and swapped pages */
+	struct vnode *as_vnode;		/* executable backing the regions */
+	struct lock *as_lock;		/* protects as_pt */
+	uint32_t as_asid;		/* TLB tag; see as_activate */
+	uint32_t as_asidgen;		/* generation as_asid belongs to */
+};
+
+/* Find the region (or stack) containing VADDR; NULL if none does. */
+struct segment *as_findsegment(struct addrspace *as, vaddr_t vaddr);
+
+/*
+ * Record that the bytes at VADDR..VADDR+FILESIZE come from offset
+ * OFFSET of the executable V. Called by load_elf instead of reading
+ * the segment in; vm_fault fetches the pages when they are touched.
+ */
+int as_map_segment(struct addrspace *as, struct vnode *v, off_t offset,
+		   vaddr_t vaddr, size_t filesize);
+
+/*
+ * Make sure no TLB entry for AS survives on any CPU, by giving AS a new
+ * ASID. Cheaper than a shootdown when everything has to go.
+ */
+void as_flushtlb(struct addrspace *as);
+
+/*
+ * Held while evicting a page, and while tearing down an address space
+ * so that the evictor never picks a victim that is going away. Taken
+ * before any as_lock.
+ */
+extern struct lock *vm_evictlock;
+#endif /* OPT_DUMBVM */
 
 /*
  * Functions in addrspace.c:
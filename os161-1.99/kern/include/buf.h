@@ -0,0 +1,82 @@
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * Caches 512-byte blocks of block devices, keyed by device and block
+ * number. A buffer handed out by buf_read or buf_get belongs to the
+ * caller until buf_release; anyone else asking for the same block
+ * waits. Changes are written back later: by the syncer thread, which
+ * calls vfs_sync every few seconds, by buf_sync, or when the buffer
+ * is reused for another block.
+ *
+ * buf_bootstrap - set up the cache and start the syncer.
+ *
+ * buf_read - return the buffer for BLOCK of DEV, reading it from the
+ *         device if it isn't cached.
+ *
+ * buf_get - same, for a caller that is going to overwrite the whole
+ *         block: nothing is read, and if the block wasn't cached its
+ *         contents are zeros.
+ *
+ * buf_readahead - start reading BLOCK of DEV into the cache, if it
+ *         isn't there already, without waiting for it. Does nothing if
+ *         no buffer is free to hold it.
+ *
+ * buf_data - the block's contents.
+ *
+ * buf_markdirty - note that the caller changed the contents.
+ *
+ * buf_release - give a buffer back.
+ *
+ * buf_pin - keep a buffer the caller has from being written to disk,
+ *         or reused, until buf_unpin; it is marked dirty. This is for
+ *         a journal, which has to write a copy somewhere else first.
+ *         Returns false if the buffer was already pinned. Only
+ *         pins set aside with buf_reservepins may be used.
+ *
+ * buf_unpin - let a pinned buffer the caller has be written again.
+ *
+ * buf_reservepins - set aside N of the BUF_MAXPINNED pins. Fails with
+ *         ENOSPC if there aren't that many left.
+ *
+ * buf_unreservepins - give back N pins set aside earlier.
+ *
+ * buf_sync - write every dirty buffer of DEV (of every device, if
+ *         DEV is NULL) to disk, except pinned ones. A block whose
+ *         write-back fails stays cached and dirty, and isn't reused
+ *         for other blocks while there is anything else to use; this
+ *         is where its error gets reported, each time it's retried.
+ *
+ * buf_discard - throw away any changes to buffers of DEV that haven't
+ *         been written, so they can be purged. None may be in use.
+ *
+ * buf_purge - forget every buffer of DEV, which must have been synced
+ *         (or discarded) and not be in use. Used at unmount.
+ */
+
+#define BUF_SIZE	512
+#define BUF_MAXPINNED	96
+
+struct buf;
+struct device;
+
+void buf_bootstrap(void);
+
+int buf_read(struct device *dev, daddr_t block, struct buf **ret);
+int buf_get(struct device *dev, daddr_t block, struct buf **ret);
+void buf_readahead(struct device *dev, daddr_t block);
+void *buf_data(struct buf *b);
+void buf_markdirty(struct buf *b);
+void buf_release(struct buf *b);
+bool buf_pin(struct buf *b);
+void buf_unpin(struct buf *b);
+int buf_reservepins(unsigned n);
+void buf_unreservepins(unsigned n);
+
+int buf_sync(struct device *dev);
+void buf_discard(struct device *dev);
+void buf_purge(struct device *dev);
+
+#endif /* _BUF_H_ */
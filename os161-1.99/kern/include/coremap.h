@@ -0,0 +1,71 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical memory management.
+ *
+ * coremap_bootstrap - take over the memory ram_getsize reports. Until
+ *         this is called, allocations are satisfied with ram_stealmem
+ *         and can never be freed.
+ *
+ * getppages - allocate NPAGES physically contiguous frames. Returns 0
+ *         if there is no run long enough.
+ *
+ * freeppages - release a run previously returned by getppages.
+ *
+ * alloc_upage - allocate one frame to hold a user page. Its reference
+ *         count starts at 1. Fails once free memory is down to a
+ *         reserve kept for the kernel. The page has no owner, and so
+ *         can't be evicted, until upage_access is called on it.
+ *
+ * free_upage - drop a reference to a user page, releasing the frame
+ *         when the count reaches 0.
+ *
+ * upage_incref - add a reference to a user page that is being shared
+ *         copy-on-write.
+ *
+ * upage_refcount - return the number of references to a user page.
+ *         If it is 1, the caller's page table holds the only one.
+ *
+ * upage_access - note that AS touched the page at VADDR, which lives
+ *         in frame PADDR. WRITE marks the page dirty. If AS holds the
+ *         only reference it becomes the owner. Returns whether the
+ *         page is dirty.
+ *
+ * upage_isdirty - return whether the page in PADDR is dirty.
+ *
+ * coremap_pickvictim - choose a page to evict with the clock
+ *         algorithm. Its owner and address are returned through AS
+ *         and VADDR. With CLEANONLY, dirty pages are passed over.
+ *         Returns 0 if there is no candidate. The choice
+ *         is only a hint until the caller has locked the owner and
+ *         checked that its page table still maps the frame. Eviction
+ *         must be serialized against address space teardown so the
+ *         owner can't disappear in the meantime (see vm_evictlock).
+ *
+ * upage_reuse - PADDR has been evicted; reset it as if it had just
+ *         come from alloc_upage.
+ */
+
+#include <vm.h>
+
+struct addrspace;
+
+void coremap_bootstrap(void);
+
+paddr_t getppages(unsigned long npages);
+void freeppages(paddr_t paddr);
+
+paddr_t alloc_upage(void);
+void free_upage(paddr_t paddr);
+void upage_incref(paddr_t paddr);
+unsigned upage_refcount(paddr_t paddr);
+bool upage_access(paddr_t paddr, struct addrspace *as, vaddr_t vaddr,
+		  bool write);
+bool upage_isdirty(paddr_t paddr);
+
+paddr_t coremap_pickvictim(struct addrspace **as, vaddr_t *vaddr,
+			   bool cleanonly);
+void upage_reuse(paddr_t paddr);
+
+#endif /* _COREMAP_H_ */
@@ -35,6 +35,16 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+#include "opt-mlfq.h"
+
+
+/* Size of each cpu's free page cache (see vm/coremap.c) */
+#define CPU_PAGECACHE_MAX 16
+
+#if OPT_MLFQ
+/* Number of priority levels of the scheduler (see thread.c) */
+#define MLFQ_NLEVELS 4
+#endif
 
 /*
  * Per-cpu structure
@@ -61,12 +71,33 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * Free physical pages held back from the coremap so that
+	 * single-page allocations rarely need its lock.
+	 */
+	paddr_t c_pagecache[CPU_PAGECACHE_MAX];
+	unsigned c_npagecache;
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * ASID of the running address space, and the ASID generation
+	 * this cpu's TLB was last flushed for.
+	 */
+	uint32_t c_asid;
+	uint32_t c_asidgen;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
+#if OPT_MLFQ
+	struct threadlist c_runqueue[MLFQ_NLEVELS]; /* One per priority */
+	unsigned c_runcount;		/* Threads on all of them */
+#else
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
+#endif
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -109,6 +140,13 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Return how many free frames are sitting in all the cpus' page
+ * caches. The other cpus don't stop to be counted, so this is only
+ * a snapshot.
+ */
+unsigned cpu_pagecache_count(void);
+
 /*
  * Return a string describing the CPU type.
  */
@@ -152,6 +190,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_broadcast sends it to all CPUs except the current
+ * one, and returns how many that was.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +206,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
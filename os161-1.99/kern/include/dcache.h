@@ -0,0 +1,45 @@
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+/*
+ * Name cache.
+ *
+ * Remembers the results of looking up one pathname component in a
+ * directory: either the vnode found, or that the name doesn't exist
+ * (a negative entry). A filesystem that uses it asks the cache before
+ * searching a directory, enters what it finds, and removes entries
+ * when it changes a directory. Nothing else keeps the cache in step
+ * with the directories, so a filesystem must remove an entry whenever
+ * it creates, links, unlinks or renames that name.
+ *
+ * An entry holds a reference to its directory and to the vnode it
+ * names, so neither can be reclaimed while it is cached. The cache is
+ * small, and the least recently used entry is dropped to make room.
+ * Names too long to fit in an entry are never cached.
+ *
+ * dcache_bootstrap - set up the cache.
+ *
+ * dcache_lookup - look up NAME in DIR. Returns true if the answer is
+ *         cached, in which case *RET is the vnode, with a reference
+ *         added, or NULL if the name doesn't exist.
+ *
+ * dcache_enter - record that NAME in DIR is VN, or, if VN is NULL,
+ *         that it doesn't exist.
+ *
+ * dcache_remove - forget whatever is cached for NAME in DIR.
+ *
+ * dcache_purgefs - forget everything cached for FS, releasing its
+ *         vnodes. Must be done before FS can be unmounted.
+ */
+
+struct fs;
+struct vnode;
+
+void dcache_bootstrap(void);
+
+bool dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret);
+void dcache_enter(struct vnode *dir, const char *name, struct vnode *vn);
+void dcache_remove(struct vnode *dir, const char *name);
+void dcache_purgefs(struct fs *fs);
+
+#endif /* _DCACHE_H_ */
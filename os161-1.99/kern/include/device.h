@@ -36,16 +36,20 @@
 
 
 struct uio;  /* in <uio.h> */
+struct devreq;
 
 /*
  * Filesystem-namespace-accessible device.
  * d_io is for both reads and writes; the uio indicates the direction.
+ * d_start, if not NULL, queues a transfer and returns without waiting
+ * for it; see struct devreq.
  */
 struct device {
 	int (*d_open)(struct device *, int flags_from_open);
 	int (*d_close)(struct device *);
 	int (*d_io)(struct device *, struct uio *);
 	int (*d_ioctl)(struct device *, int op, userptr_t data);
+	int (*d_start)(struct device *, struct devreq *);
 
 	blkcnt_t d_blocks;
 	blksize_t d_blocksize;
@@ -55,9 +59,38 @@ struct device {
 	void *d_data;		/* device-specific data */
 };
 
+/*
+ * A transfer of whole blocks between a device and a kernel buffer,
+ * for d_start. The caller fills in the first group of fields and must
+ * leave the request alone until dr_done has been called. dr_done gets
+ * 0 or an error, and may be called from an interrupt handler, so it
+ * must not sleep.
+ */
+struct devreq {
+	daddr_t dr_block;		/* first block */
+	unsigned dr_nblocks;		/* how many blocks */
+	void *dr_data;			/* kernel buffer */
+	bool dr_write;			/* true to write, false to read */
+	void (*dr_done)(struct devreq *, int result);
+	void *dr_arg;			/* for dr_done's use */
+
+	/* For the driver */
+	struct devreq *dr_next;		/* next in queue */
+	struct devreq *dr_merged;	/* next blocks, merged into this */
+	unsigned dr_pos;		/* blocks done so far */
+	int dr_result;			/* result, once done */
+};
+
 /* Create vnode for a vfs-level device. */
 struct vnode *dev_create_vnode(struct device *dev);
 
+/*
+ * Start a transfer. Devices with no d_start do it on the spot and
+ * call dr_done before returning. Fails without calling dr_done if the
+ * request can't be started.
+ */
+int dev_start(struct device *dev, struct devreq *dr);
+
 
 /* Initialization functions for builtin vfs-level devices. */
 void devnull_create(void);
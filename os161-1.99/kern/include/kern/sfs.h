@@ -37,6 +37,7 @@
  */
 
 #define SFS_MAGIC         0xabadf001    /* magic number identifying us */
+#define SFS_VERSION       1             /* on-disk format version */
 #define SFS_BLOCKSIZE     512           /* size of our blocks */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
@@ -47,6 +48,15 @@
 #define SFS_MAP_LOCATION   2            /* 1st block of the freemap */
 #define SFS_NOINO          0            /* inode # for free dir entry */
 
+/*
+ * Format versions: volumes made before sp_version existed read as
+ * version 0 and have no double or triple indirect blocks.
+ */
+
+/* The inode has one double and one triple indirect block (for sfsck) */
+#define HAS_DIDIRECT
+#define HAS_TIDIRECT
+
 /* Number of bits in a block */
 #define SFS_BLOCKBITS (SFS_BLOCKSIZE * CHAR_BIT)
 
@@ -63,6 +73,26 @@
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
 #define SFS_TYPE_FILE     1
 #define SFS_TYPE_DIR      2
+#define SFS_TYPE_DIRINDEX 3       /* Hash index of a directory */
+
+/* Feature flags for sp_features */
+#define SFS_FEATURE_DIRHASH  0x1  /* Big directories get hash indexes */
+#define SFS_FEATURE_JOURNAL  0x2  /* Metadata changes are journaled */
+#define SFS_FEATURE_INLINE   0x4  /* Small files live in their inodes */
+#define SFS_FEATURES_KNOWN   (SFS_FEATURE_DIRHASH | SFS_FEATURE_JOURNAL | \
+			      SFS_FEATURE_INLINE)
+
+/*
+ * Flags for sfi_flags.
+ *
+ * On volumes with SFS_FEATURE_INLINE, regular files start out with
+ * SFS_IFLAG_INLINE set: their contents are kept in sfi_inline, and
+ * they have no blocks. Once a file grows past SFS_INLINESIZE bytes its
+ * contents move to a block and the flag is cleared for good. The
+ * bytes of sfi_inline past the end of the file are always zero.
+ */
+#define SFS_IFLAG_INLINE  0x1     /* Contents are in sfi_inline */
+#define SFS_INLINESIZE    ((128-7-SFS_NDIRECT)*4)
 
 /*
  * On-disk superblock
@@ -71,7 +101,11 @@ struct sfs_super {
 	uint32_t sp_magic;		/* Magic number, should be SFS_MAGIC */
 	uint32_t sp_nblocks;			/* Number of blocks in fs */
 	char sp_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];
+	uint32_t sp_version;			/* Should be SFS_VERSION */
+	uint32_t sp_features;			/* SFS_FEATURE_* flags */
+	uint32_t sp_journalstart;		/* First block of the journal */
+	uint32_t sp_journalblocks;		/* Size of the journal */
+	uint32_t reserved[114];
 };
 
 /*
@@ -83,7 +117,11 @@ struct sfs_inode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_dirindex;			/* Dirs: index inode, or 0 */
+	uint32_t sfi_flags;			/* SFS_IFLAG_* flags */
+	char sfi_inline[SFS_INLINESIZE];	/* Contents, if inline */
 };
 
 /*
@@ -94,5 +132,67 @@ struct sfs_dir {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * On-disk directory hash index, the contents of an inode of type
+ * SFS_TYPE_DIRINDEX. Only directories on volumes with
+ * SFS_FEATURE_DIRHASH have them, and the directory itself is still
+ * complete without one: anything that doesn't understand the index
+ * can read the directory as usual.
+ *
+ * The first block is the header. After it is a table of sdh_nbuckets
+ * buckets. A name is found by linear probing from bucket
+ * (hash & (sdh_nbuckets-1)), where the hash is the 32-bit FNV-1a hash
+ * of the name; a bucket with sde_slot 0 is empty. The header also
+ * remembers some of the directory's empty slots, for reuse.
+ */
+#define SFS_DIRINDEX_NFREE 124
+
+struct sfs_dirindex_header {
+	uint32_t sdh_nbuckets;			/* Buckets, a power of 2 */
+	uint32_t sdh_nused;			/* Buckets in use */
+	uint32_t sdh_nfree;			/* Entries in sdh_free */
+	uint32_t sdh_reserved;			/* set to 0 */
+	uint32_t sdh_free[SFS_DIRINDEX_NFREE];	/* Empty directory slots */
+};
+
+struct sfs_dirindex_entry {
+	uint32_t sde_hash;			/* Hash of the name */
+	uint32_t sde_slot;			/* Directory slot plus 1 */
+};
+
+/*
+ * On-disk journal, on volumes with SFS_FEATURE_JOURNAL: the
+ * sp_journalblocks blocks starting at sp_journalstart, which are
+ * marked in use in the freemap.
+ *
+ * The journal holds at most one transaction, a set of metadata
+ * blocks that must reach the disk all together or not at all. Its
+ * first block is a descriptor listing where each block goes; the
+ * blocks follow, in that order, and then a commit block. The
+ * transaction is valid if both carry the same sequence number and
+ * block count and sjc_sum is the 32-bit FNV-1a hash of the descriptor
+ * and the blocks. Mounting a volume with a valid transaction in the
+ * journal copies the blocks to where they go. A descriptor with
+ * sjd_nblocks 0 means the journal is empty.
+ */
+#define SFS_JDESC_MAGIC    0x4a444553	/* "JDES" */
+#define SFS_JCOMMIT_MAGIC  0x4a434d54	/* "JCMT" */
+#define SFS_JMAXBLOCKS     125		/* most blocks in a transaction */
+
+struct sfs_jdesc {
+	uint32_t sjd_magic;			/* SFS_JDESC_MAGIC */
+	uint32_t sjd_seq;			/* Transaction number */
+	uint32_t sjd_nblocks;			/* Blocks in it */
+	uint32_t sjd_blocks[SFS_JMAXBLOCKS];	/* Where each one goes */
+};
+
+struct sfs_jcommit {
+	uint32_t sjc_magic;			/* SFS_JCOMMIT_MAGIC */
+	uint32_t sjc_seq;			/* Same as sjd_seq */
+	uint32_t sjc_nblocks;			/* Same as sjd_nblocks */
+	uint32_t sjc_sum;			/* Checksum */
+	uint32_t reserved[124];
+};
+
 
 #endif /* _KERN_SFS_H_ */
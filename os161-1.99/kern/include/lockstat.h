@@ -0,0 +1,78 @@
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Lock contention statistics, for finding the locks that keep the
+ * system from scaling. Only with the lockstat option.
+ *
+ * Each spinlock, lock, and CV has a struct lockstat, which counts how
+ * often it was acquired (for a CV, waited on), how often that meant
+ * waiting, how many times the waiter went around its spin loop, and
+ * the total time spent waiting for it and holding it. Times come from
+ * the clock, so they're only counted after lockstat_bootstrap, and
+ * reading the clock on every acquire and release slows everything
+ * down noticeably; this is a diagnostic option.
+ *
+ * The counters are only changed by the holder of the lock itself, so
+ * they need no locking of their own. The lockstat menu command adds
+ * them up for all the locks with the same name, including ones that
+ * have since been destroyed, and prints them by total wait time.
+ *
+ * lockstat_bootstrap - start counting. Call once the clock is there.
+ *
+ * lockstat_init - set up LS for a lock called NAME, which must stay
+ *         valid until lockstat_cleanup.
+ *
+ * lockstat_cleanup - the lock is going away; keep its counts under
+ *         its name.
+ *
+ * lockstat_now - the time, for lockstat_acquired and lockstat_waited.
+ *         0 if not counting yet.
+ *
+ * lockstat_acquired - the lock was just acquired. CONTENDED is true if
+ *         it had to wait, for SPINS times around the loop, starting at
+ *         time WAITSTART.
+ *
+ * lockstat_released - the lock is about to be released.
+ *
+ * lockstat_waited - a CV was waited on, starting at time WAITSTART.
+ *
+ * lockstat_check - return true if the list of locks is sound: linked
+ *         both ways, no loops, no lock on it twice, and as long as it
+ *         should be. For testing.
+ *
+ * lockstat_print - print the statistics.
+ *
+ * lockstat_reset - start the statistics over.
+ */
+
+struct lockstat {
+	const char *ls_name;		/* Name of the lock */
+	bool ls_registered;		/* On the list of all of them */
+	uint32_t ls_acquires;		/* Times acquired or waited on */
+	uint32_t ls_contended;		/* Times that meant waiting */
+	uint64_t ls_spins;		/* Times around spin loops */
+	uint64_t ls_waitns;		/* Time spent waiting */
+	uint64_t ls_holdns;		/* Time spent holding */
+	uint64_t ls_since;		/* When last acquired, or 0 */
+	struct lockstat *ls_prev;	/* List of all of them */
+	struct lockstat *ls_next;
+};
+
+/* For spinlocks that are static; they're put on the list when first used */
+#define LOCKSTAT_INITIALIZER(name) \
+	{ name, false, 0, 0, 0, 0, 0, 0, NULL, NULL }
+
+void lockstat_bootstrap(void);
+void lockstat_init(struct lockstat *ls, const char *name);
+void lockstat_cleanup(struct lockstat *ls);
+uint64_t lockstat_now(void);
+void lockstat_acquired(struct lockstat *ls, bool contended, uint32_t spins,
+		       uint64_t waitstart);
+void lockstat_released(struct lockstat *ls);
+void lockstat_waited(struct lockstat *ls, uint64_t waitstart);
+bool lockstat_check(void);
+void lockstat_print(void);
+void lockstat_reset(void);
+
+#endif /* _LOCKSTAT_H_ */
@@ -0,0 +1,61 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page table for user address spaces.
+ *
+ * The top ten bits of a user address index the directory; the next
+ * ten bits index a second-level table, which is exactly one page
+ * long. Second-level tables are only allocated once something in the
+ * 4M of address space they cover is touched, so a typical process
+ * needs three of them (text, data, stack).
+ */
+
+#include <vm.h>
+
+typedef uint32_t pte_t;
+
+/* Fields in a page table entry */
+#define PTE_FRAME	0xfffff000	/* physical frame number */
+#define PTE_VALID	0x00000001	/* frame is resident */
+#define PTE_SWAPPED	0x00000002	/* page is in swap; no frame */
+
+/* A swapped-out page keeps its swap slot where the frame number goes. */
+#define PTE_SLOT(pte)	((pte) >> 12)
+#define PTE_MKSWAP(slot) (((pte_t)(slot) << 12) | PTE_SWAPPED)
+
+#define PT_L1SHIFT	22
+#define PT_L2SHIFT	12
+#define PT_L2ENTRIES	(PAGE_SIZE / sizeof(pte_t))
+#define PT_L1ENTRIES	(USERSPACETOP >> PT_L1SHIFT)
+
+#define PT_L1INDEX(va)	((va) >> PT_L1SHIFT)
+#define PT_L2INDEX(va)	(((va) >> PT_L2SHIFT) & (PT_L2ENTRIES - 1))
+
+struct pagetable {
+	pte_t *pt_dir[PT_L1ENTRIES];
+};
+
+/*
+ * pt_create - make an empty page table. Returns NULL if out of memory.
+ *
+ * pt_destroy - release a page table, every frame it maps, and every
+ *         swap slot it refers to.
+ *
+ * pt_lookup - return the entry for VADDR. If the second-level table
+ *         covering VADDR does not exist, it is allocated when CREATE
+ *         is set; otherwise NULL is returned. NULL is also returned
+ *         if the allocation fails.
+ *
+ * pt_copy - make the empty table DST map every page resident in SRC.
+ *         The frames are shared, not copied; vm_fault copies a shared
+ *         page when either side first writes to it. Pages that are
+ *         swapped out end up sharing the swap slot instead. The caller
+ *         must make sure no writeable TLB entries for SRC survive.
+ */
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+int pt_copy(struct pagetable *src, struct pagetable *dst);
+
+#endif /* _PAGETABLE_H_ */
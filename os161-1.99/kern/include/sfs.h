@@ -41,6 +41,7 @@
  */
 #include <fs.h>
 #include <vnode.h>
+#include <spinlock.h>
 
 /*
  * Get on-disk structures and constants that are made available to 
@@ -48,21 +49,128 @@
  */
 #include <kern/sfs.h>
 
+struct lock;
+struct cv;
+struct thread;
+struct buf;
+
+/*
+ * Locking:
+ *
+ * sv_lock protects the inode and the file's contents (for a
+ * directory, its entries). sfs_vnlock protects the table of loaded
+ * vnodes. sfs_dirtylock, a spinlock, protects the list of dirty
+ * inodes; vnodes are only taken off it with sfs_vnlock held too, so
+ * they can't be reclaimed meanwhile. sfs_freemaplock protects the free
+ * block bitmap, the group summaries and dirty flags, and the
+ * superblock.
+ *
+ * sfs_jlock protects the journal.
+ *
+ * The order is: sv_lock, directory before file, and before the
+ * directory's hash index; then sfs_vnlock;
+ * then sfs_freemaplock; then sfs_jlock; then the buffer cache's lock.
+ * An operation on a journaled volume calls sfs_jbegin before taking
+ * any of these.
+ */
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct lock *sv_lock;           /* lock for sv_i and contents */
+	uint32_t sv_goal;               /* where to put the next block */
+	uint32_t sv_nextread;           /* file block a sequential read
+					   would start in */
+	uint32_t sv_raend;              /* read-ahead started up to here */
+	struct sfs_vnode *sv_index;     /* directory's hash index, if loaded */
+	struct sfs_vnode *sv_hashnext;  /* next in sfs_vnhash chain */
+	bool sv_ondirtylist;            /* on sfs_dirtyinodes */
+	struct sfs_vnode *sv_dirtynext; /* next on sfs_dirtyinodes */
+};
+
+/*
+ * Blocks are allocated in groups of SFS_GROUPSIZE, the number covered
+ * by one block of the freemap. The number of free blocks in each
+ * group is kept so full groups can be skipped.
+ */
+#define SFS_GROUPSIZE   SFS_BLOCKBITS
+
+/*
+ * A directory gets a hash index once it has SFS_DIRINDEX_MIN slots,
+ * with at least SFS_DIRINDEX_MINBUCKETS buckets. The table is doubled
+ * whenever it would become more than half full.
+ */
+#define SFS_DIRINDEX_MIN        64
+#define SFS_DIRINDEX_MINBUCKETS 256
+
+/*
+ * Read-ahead: how many blocks past a sequential read to start
+ * reading, and the most to start at once.
+ */
+#define SFS_RAWINDOW    8
+#define SFS_RAMAX       32
+
+/*
+ * Journal credits: the most metadata blocks each kind of operation
+ * can add to a transaction. Writes are done SFS_JWRITECHUNK blocks at
+ * a time, each with its own handle.
+ */
+#define SFS_JCREDITS_WRITE   8
+#define SFS_JWRITECHUNK      16
+#define SFS_JCREDITS_TRUNC   12
+#define SFS_JCREDITS_DIROP   16
+#define SFS_JCREDITS_RENAME  24
+
+/*
+ * An operation in the running transaction (see sfs_journal.c). Lives
+ * on the operation's stack.
+ */
+struct sfs_jhandle {
+	struct thread *jh_thread;       /* thread doing the operation */
+	unsigned jh_depth;              /* sfs_jbegin calls not yet ended */
+	unsigned jh_credits;            /* blocks it may still add */
+	struct sfs_jhandle *jh_next;    /* next in sfs_jhandles */
 };
 
+/* Number of chains in the table of loaded vnodes */
+#define SFS_VNHASHSIZE  128
+#define SFS_VNHASH(ino) ((ino) % SFS_VNHASHSIZE)
+
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASHSIZE]; /* loaded vnodes */
+	unsigned sfs_nvnodes;           /* how many are loaded */
+	struct lock *sfs_vnlock;        /* lock for the vnode table */
+	struct spinlock sfs_dirtylock;  /* lock for the dirty inode list */
+	struct sfs_vnode *sfs_dirtyinodes; /* vnodes that may be dirty */
+	unsigned sfs_ndirty;            /* how many */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
-	bool sfs_freemapdirty;          /* true if freemap modified */
+	uint32_t *sfs_groupfree;        /* free blocks in each group */
+	bool *sfs_groupdirty;           /* group's freemap block modified */
+	uint32_t *sfs_dirtygroups;      /* groups with sfs_groupdirty set */
+	unsigned sfs_ndirtygroups;      /* how many */
+	unsigned sfs_ngroups;           /* number of groups */
+	struct lock *sfs_freemaplock;   /* lock for freemap and super */
+
+	/* Journal; sfs_jmax is 0 if the volume hasn't one */
+	unsigned sfs_jmax;              /* credits in a transaction */
+	struct lock *sfs_jlock;         /* lock for the journal */
+	struct cv *sfs_jcv;             /* signalled when ops or commits end */
+	struct sfs_jhandle *sfs_jhandles; /* operations under way */
+	unsigned sfs_jactive;           /* how many */
+	unsigned sfs_jreserved;         /* credits promised or used */
+	bool sfs_jcommitting;           /* a commit is waiting or running */
+	struct thread *sfs_jcommitter;  /* thread running it */
+	int sfs_jerror;                 /* how the last commit went */
+	uint32_t sfs_jseq;              /* running transaction's number */
+	uint32_t sfs_jblocks[SFS_JMAXBLOCKS]; /* blocks in it */
+	unsigned sfs_jnblocks;          /* how many */
+	struct bitmap *sfs_jfreed;      /* blocks it frees */
 };
 
 /*
@@ -75,15 +183,24 @@ int sfs_mount(const char *device);
  * Internal functions
  */
 
-/* Initialize uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
-
-/* Convenience functions for block I/O */
-int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
+/* Convenience functions for block I/O, through the buffer cache */
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
+/* Journal (sfs_journal.c) */
+int sfs_jreplay(struct sfs_fs *sfs);
+int sfs_jinit(struct sfs_fs *sfs);
+int sfs_jshutdown(struct sfs_fs *sfs);
+void sfs_jcleanup(struct sfs_fs *sfs);
+int sfs_jbegin(struct sfs_fs *sfs, struct sfs_jhandle *jh, unsigned credits);
+void sfs_jend(struct sfs_fs *sfs);
+int sfs_jextend(struct sfs_fs *sfs, unsigned credits);
+void sfs_jdirty(struct sfs_fs *sfs, struct buf *b, uint32_t block);
+int sfs_jcommit(struct sfs_fs *sfs);
+
+/* Take the first vnode off the dirty inode list (sfs_vnode.c) */
+struct sfs_vnode *sfs_dirtylist_pop(struct sfs_fs *sfs);
+
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
@@ -36,6 +36,10 @@
  */
 
 #include <cdefs.h>
+#include "opt-lockstat.h"
+#if OPT_LOCKSTAT
+#include <lockstat.h>
+#endif
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -48,6 +52,12 @@
 /*
  * Basic spinlock.
  *
+ * This is a ticket lock: each CPU that wants the lock takes the next
+ * number from lk_next and waits until lk_serving reaches it. CPUs
+ * therefore get the lock in the order they asked for it, and a CPU
+ * waits at most for the ones already in line ahead of it. Waiting
+ * CPUs only read lk_serving, which is written only on release.
+ *
  * Note that spinlocks are held by CPUs, not by threads.
  *
  * This structure is made public so spinlocks do not have to be
@@ -55,14 +65,26 @@
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
-	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
+	volatile spinlock_data_t lk_next; /* Next ticket to hand out. */
+	volatile spinlock_data_t lk_serving; /* Ticket holding the lock. */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+#if OPT_LOCKSTAT
+	struct lockstat lk_stat;	/* Contention statistics. */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
+ * (With lockstat, such locks go by the name of their source file.)
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#if OPT_LOCKSTAT
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, NULL, \
+				  LOCKSTAT_INITIALIZER(__FILE__) }
+#else
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, NULL }
+#endif
 
 /*
  * Spinlock functions.
@@ -70,13 +92,20 @@ struct spinlock {
  * init		Initialize the contents of a spinlock.
  * cleanup	Opposite of init. Lock must be unlocked.
  *
- * acquire	Get the lock, spinning as necessary. Also disables interrupts.
+ * acquire	Get the lock, spinning in turn as necessary. Also disables
+ *		interrupts.
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
  */
 
+#if OPT_LOCKSTAT
+/* Name the lock's statistics after the expression for it */
+void spinlock_initname(struct spinlock *lk, const char *name);
+#define spinlock_init(lk) spinlock_initname(lk, #lk)
+#else
 void spinlock_init(struct spinlock *lk);
+#endif
 void spinlock_cleanup(struct spinlock *lk);
 
 void spinlock_acquire(struct spinlock *lk);
@@ -0,0 +1,38 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * Pages are swapped to the raw second disk, one page per slot. A slot
+ * is reference counted like a frame, since fork shares swapped-out
+ * pages the same way it shares resident ones.
+ *
+ * swap_bootstrap - open the swap device. If it can't be opened, dirty
+ *         pages can't be evicted and running out of memory behaves
+ *         as it did before swapping existed.
+ *
+ * swap_out - write the frame at PADDR to a fresh slot, returned in
+ *         *SLOT with one reference. Fails with ENOSPC if swap is full
+ *         or missing.
+ *
+ * swap_in - read slot SLOT into the frame at PADDR and drop the
+ *         caller's reference to the slot.
+ *
+ * swap_incref - add a reference to a slot.
+ *
+ * swap_free - drop a reference to a slot, releasing it at zero.
+ */
+
+#include <vm.h>
+
+/* Where swap lives */
+#define SWAP_DEVICE	"lhd1raw:"
+
+void swap_bootstrap(void);
+int swap_out(paddr_t paddr, unsigned *slot);
+int swap_in(unsigned slot, paddr_t paddr);
+void swap_incref(unsigned slot);
+void swap_free(unsigned slot);
+
+#endif /* _SWAP_H_ */
@@ -37,6 +37,7 @@
 
 #include <spinlock.h>
 #include <wchan.h>
+#include "opt-lockstat.h"
 
 /*
  * Dijkstra-style semaphore.
@@ -72,13 +73,22 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * Locks are adaptive: a thread that finds the lock held spins while
+ * the owner is running on another cpu, and only sleeps if it isn't.
+ * Clearing lk_adaptive makes waiters always sleep (synchtest uses this
+ * to compare the two).
  */
 struct lock {
         char *lk_name;
-        bool held;
+        volatile bool held;
         struct thread* owner;
         struct wchan* lk_wchan;
         struct spinlock lk_lock;
+        bool lk_adaptive;               /* spin while the owner runs */
+#if OPT_LOCKSTAT
+        struct lockstat lk_stat;        /* contention statistics */
+#endif
         // add what you need here
         // (don't forget to mark things volatile as needed)
 };
@@ -119,6 +129,9 @@ void lock_destroy(struct lock *);
 struct cv {
         char *cv_name;
         struct wchan* cv_wchan;
+#if OPT_LOCKSTAT
+        struct lockstat cv_stat;        /* waits, and time spent in them */
+#endif
         // (don't forget to mark things volatile as needed)
 };
 
@@ -143,4 +156,51 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers can hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting, new readers wait
+ * too, so a stream of readers can't keep writers out. In turn, when
+ * a writer lets go, all the readers that were waiting get in before
+ * the next writer, so writers can't keep readers out either.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+struct rwlock {
+        char *rwlk_name;
+        struct spinlock rwlk_lock;      /* protects the fields below */
+        struct wchan *rwlk_rwchan;      /* readers wait here */
+        struct wchan *rwlk_wwchan;      /* writers wait here */
+        struct thread *rwlk_writer;     /* writer holding it, or NULL */
+        unsigned rwlk_readers;          /* readers holding it */
+        unsigned rwlk_waitingreaders;
+        unsigned rwlk_waitingwriters;
+        unsigned rwlk_readgen;          /* bumped when readers let in */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading.
+ *    rwlock_release_read  - Let go of it after reading.
+ *    rwlock_acquire_write - Get the lock for writing.
+ *    rwlock_release_write - Let go of it after writing.
+ *    rwlock_downgrade     - Turn the current thread's write lock into a
+ *                           read lock, without letting another writer
+ *                           in in between.
+ *    rwlock_do_i_hold_write - Return true if the current thread has the
+ *                           lock for writing.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
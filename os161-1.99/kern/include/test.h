@@ -59,7 +59,11 @@ int threadtest2(int, char **);
 int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
+int lockbench(int, char **);
 int cvtest(int, char **);
+int rwtest(int, char **);
+int rwbench(int, char **);
+int lockstattest(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
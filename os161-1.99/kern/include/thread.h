@@ -40,6 +40,8 @@
 #include <spinlock.h>
 #include <threadlist.h>
 
+#include "opt-mlfq.h"
+
 struct cpu;
 
 /* get machine-dependent defs */
@@ -83,6 +85,7 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	unsigned t_lastran;		/* t_cpu's c_hardclocks when last run */
 
 	/*
 	 * Interrupt state fields.
@@ -101,6 +104,15 @@ struct thread {
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
 
+#if OPT_MLFQ
+	/*
+	 * Scheduler fields. Protected by the runqueue lock of the
+	 * thread's cpu.
+	 */
+	unsigned t_mlfqlevel;		/* Priority level; 0 is highest */
+	unsigned t_mlfqticks;		/* Hardclocks used at that level */
+#endif
+
 	/*
 	 * Public fields
 	 */
@@ -162,6 +174,12 @@ void thread_yield(void);
  */
 void schedule(void);
 
+/*
+ * Charge a hardclock to the current thread, and return true if it
+ * should give up the processor. Called from the timer interrupt.
+ */
+bool thread_tick(void);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
@@ -36,7 +36,9 @@
 #define VMSTAT_ELF_FILE_READ          (7)
 #define VMSTAT_SWAP_FILE_READ         (8)
 #define VMSTAT_SWAP_FILE_WRITE        (9)
-#define VMSTAT_COUNT                 (10)
+#define VMSTAT_COW_SHARED            (10)
+#define VMSTAT_COW_COPY              (11)
+#define VMSTAT_COUNT                 (12)
 
 /* ----------------------------------------------------------------------- */
 
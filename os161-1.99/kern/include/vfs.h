@@ -185,8 +185,10 @@ DECLARRAY(vnode);
 DEFARRAY(vnode, VFSINLINE);
 
 /*
- * Global one-big-lock for all filesystem operations.
- * You must remove this for the filesystem assignment.
+ * Global lock for the list of devices and mounted filesystems, and
+ * for the current boot filesystem. emufs also still does everything
+ * under it. It's recursive. SFS does its own locking and doesn't use
+ * it.
  */
 void vfs_biglock_acquire(void);
 void vfs_biglock_release(void);
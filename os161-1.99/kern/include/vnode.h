@@ -30,8 +30,10 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
+#include <spinlock.h>
 
 struct uio;
+struct lock;
 struct stat;
 
 /*
@@ -50,10 +52,23 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * vn_openlock serializes opens and closes: VOP_CLOSE runs on the last
+ * close with it held, so nobody can reopen the vnode in between. It
+ * is a sleep lock, taken before vn_countlock, because VOP_CLOSE may
+ * sleep.
+ *
+ * vn_countlock protects both counts. When the last reference is
+ * dropped, VOP_RECLAIM is called with the refcount still at 1; the
+ * filesystem must check it again under vn_countlock, while holding
+ * whatever keeps its loadvnode from handing out new references, and
+ * if it is no longer 1 drop the extra reference and return EBUSY.
  */
 struct vnode {
 	int vn_refcount;                /* Reference count */
 	int vn_opencount;
+	struct spinlock vn_countlock;   /* Lock for the counts */
+	struct lock *vn_openlock;       /* Serializes opens and closes */
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
@@ -81,5 +81,13 @@ void wchan_sleep(struct wchan *wc);
 void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * Move one thread, or all threads, sleeping on FROM onto the end of
+ * TO without waking them; they stay asleep until TO is woken. Neither
+ * channel should already be locked.
+ */
+void wchan_moveone(struct wchan *from, struct wchan *to);
+void wchan_moveall(struct wchan *from, struct wchan *to);
+
 
 #endif /* _WCHAN_H_ */
@@ -47,6 +47,13 @@
 #define WORD_TYPE       unsigned char
 #define WORD_ALLBITS    (0xff)
 
+/*
+ * When searching, though, whole runs of set bits can be skipped a
+ * uint32_t at a time: "all ones" doesn't depend on byte order.
+ */
+#define BITS_PER_SCAN   (sizeof(uint32_t) * CHAR_BIT)
+#define SCAN_ALLBITS    (0xffffffff)
+
 struct bitmap {
         unsigned nbits;
         WORD_TYPE *v;
@@ -64,7 +71,9 @@ bitmap_create(unsigned nbits)
         if (b == NULL) {
                 return NULL;
         }
-        b->v = kmalloc(words*sizeof(WORD_TYPE));
+        /* Round up so the search can always read whole uint32_ts. */
+        b->v = kmalloc(DIVROUNDUP(words*sizeof(WORD_TYPE),
+                                  sizeof(uint32_t)) * sizeof(uint32_t));
         if (b->v == NULL) {
                 kfree(b);
                 return NULL;
@@ -96,30 +105,49 @@ bitmap_getdata(struct bitmap *b)
 }
 
 int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+bitmap_alloc_range(struct bitmap *b, unsigned start, unsigned end,
+                   unsigned *index)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        const uint32_t *scan;
+        unsigned bit, ix;
+        WORD_TYPE mask;
+
+        KASSERT(start <= end);
+        KASSERT(end <= b->nbits);
+
+        bit = start;
+        while (bit < end) {
+                ix = bit / BITS_PER_WORD;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
+                if (bit % BITS_PER_SCAN == 0 && bit + BITS_PER_SCAN <= end) {
+                        scan = (const uint32_t *)(b->v + ix);
+                        if (*scan == SCAN_ALLBITS) {
+                                bit += BITS_PER_SCAN;
+                                continue;
                         }
-                        KASSERT(0);
                 }
+                if (bit % BITS_PER_WORD == 0 && b->v[ix] == WORD_ALLBITS) {
+                        bit += BITS_PER_WORD;
+                        continue;
+                }
+
+                mask = ((WORD_TYPE)1) << (bit % BITS_PER_WORD);
+                if ((b->v[ix] & mask)==0) {
+                        b->v[ix] |= mask;
+                        *index = bit;
+                        return 0;
+                }
+                bit++;
         }
         return ENOSPC;
 }
 
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        return bitmap_alloc_range(b, 0, b->nbits, index);
+}
+
 static
 inline
 void
@@ -45,11 +45,16 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
+#include <buf.h>
+#include <dcache.h>
 #include <device.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <uw-vmstats.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A3.h"
+#include "opt-lockstat.h"
 
 
 /*
@@ -111,6 +116,8 @@ boot(void)
 	thread_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	buf_bootstrap();
+	dcache_bootstrap();
 
 	/* Probe and initialize devices. Interrupts should come on. */
 	kprintf("Device probe...\n");
@@ -120,6 +127,10 @@ boot(void)
 	/* Now do pseudo-devices. */
 	pseudoconfig();
 	kprintf("\n");
+#if OPT_LOCKSTAT
+	/* Needs the clock, which pseudoconfig attached */
+	lockstat_bootstrap();
+#endif
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
@@ -153,6 +164,10 @@ shutdown(void)
 
 	thread_shutdown();
 
+#if OPT_A3
+	vmstats_print();
+#endif
+
 	splhigh();
 }
 
@@ -45,6 +45,7 @@
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockstat.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -396,6 +397,30 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_LOCKSTAT
+/*
+ * Command for printing lock contention statistics, or with "reset",
+ * clearing them.
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	if (nargs > 2 || (nargs == 2 && strcmp(args[1], "reset"))) {
+		kprintf("Usage: lockstat [reset]\n");
+		return EINVAL;
+	}
+
+	if (nargs == 2) {
+		lockstat_reset();
+	}
+	else {
+		lockstat_print();
+	}
+	return 0;
+}
+#endif
+
 /*
  * Command for enable the output of debugging messages of type DB_THREADS.
  */
@@ -483,6 +508,12 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Lock benchmark                ",
+	"[sy5] Rwlock test                   ",
+	"[sy6] Rwlock benchmark              ",
+#if OPT_LOCKSTAT
+	"[sy7] Lockstat list test            ",
+#endif
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -523,6 +554,9 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+#if OPT_LOCKSTAT
+	"[lockstat] Lock contention stats    ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -580,6 +614,9 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if OPT_LOCKSTAT
+	{ "lockstat",	cmd_lockstat },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -597,6 +634,12 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	lockbench },
+	{ "sy5",	rwtest },
+	{ "sy6",	rwbench },
+#if OPT_LOCKSTAT
+	{ "sy7",	lockstattest },
+#endif
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -182,7 +182,7 @@ int sys_fork(struct trapframe* tf, int32_t *err) {
   }
 
   //attach address space
-  struct addrspace *pointer_p_addrspace = as_create();
+  struct addrspace *pointer_p_addrspace;
   int copy_fail = as_copy(curproc->p_addrspace, &pointer_p_addrspace);
   if (copy_fail) {
     *err = copy_fail;
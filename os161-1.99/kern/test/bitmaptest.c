@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -101,6 +102,25 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/* Free every 37th bit; a ranged search should find them in order. */
+	for (i=0; i<TESTSIZE; i+=37) {
+		bitmap_unmark(b, i);
+	}
+	i = DIVROUNDUP(TESTSIZE/3, 37) * 37;
+	while (bitmap_alloc_range(b, TESTSIZE/3, TESTSIZE, &x)==0) {
+		KASSERT(x == (uint32_t)i);
+		KASSERT(bitmap_isset(b, x));
+		i += 37;
+	}
+	KASSERT(i >= TESTSIZE);
+	i = 0;
+	while (bitmap_alloc_range(b, 0, TESTSIZE/3, &x)==0) {
+		KASSERT(x == (uint32_t)i);
+		i += 37;
+	}
+	KASSERT(i >= TESTSIZE/3);
+	KASSERT(bitmap_alloc(b, &x) == ENOSPC);
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
@@ -0,0 +1,73 @@
+/*
+ * Test for the lock statistics list. See lockstat.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <lockstat.h>
+#include <test.h>
+
+#define NREINIT 4
+
+static
+void
+lockstattest_check(const char *what)
+{
+	if (!lockstat_check()) {
+		panic("lockstattest: list is broken after %s\n", what);
+	}
+}
+
+int
+lockstattest(int nargs, char **args)
+{
+	struct spinlock *splk;
+	struct lock *lk;
+	int i;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting lockstat test...\n");
+	lockstattest_check("nothing");
+
+	/* Fresh kmalloc memory, so ls_registered starts out as junk */
+	splk = kmalloc(sizeof(*splk));
+	if (splk == NULL) {
+		panic("lockstattest: kmalloc failed\n");
+	}
+	spinlock_initname(splk, "lockstattest");
+	spinlock_acquire(splk);
+	spinlock_release(splk);
+	lockstattest_check("init");
+
+	/* Initialize it again without cleaning up, as vmstats_init does */
+	for (i=0; i<NREINIT; i++) {
+		spinlock_initname(splk, "lockstattest");
+		lockstattest_check("re-init");
+		spinlock_acquire(splk);
+		spinlock_release(splk);
+	}
+
+	spinlock_cleanup(splk);
+	lockstattest_check("cleanup");
+	spinlock_initname(splk, "lockstattest");
+	lockstattest_check("init after cleanup");
+	spinlock_cleanup(splk);
+	kfree(splk);
+
+	lk = lock_create("lockstattest");
+	if (lk == NULL) {
+		panic("lockstattest: lock_create failed\n");
+	}
+	lock_acquire(lk);
+	lock_release(lk);
+	lockstattest_check("lock_create");
+	lock_destroy(lk);
+	lockstattest_check("lock_destroy");
+
+	kprintf("Lockstat test done.\n");
+	return 0;
+}
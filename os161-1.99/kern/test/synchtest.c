@@ -33,6 +33,7 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spinlock.h>
 #include <clock.h>
 #include <thread.h>
 #include <synch.h>
@@ -42,6 +43,10 @@
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
 #define NTHREADS      32
+#define NBENCHLOOPS   2000
+#define NBENCHTHREADS 8
+#define NRWLOOPS      200
+#define NRWWORK       50
 
 static volatile unsigned long testval1;
 static volatile unsigned long testval2;
@@ -256,6 +261,336 @@ locktest(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Lock benchmark. NBENCHTHREADS threads take turns at a lock with a
+ * very short critical section, first with waiters always sleeping,
+ * as locks used to, and then with the adaptive lock. With one cpu the
+ * two should take about the same time; with more, the adaptive lock
+ * should be faster, since waiters don't have to switch out and back.
+ */
+
+static struct lock *benchlock;
+static volatile unsigned long benchcount;
+
+static
+void
+lockbenchthread(void *junk, unsigned long num)
+{
+	int i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<NBENCHLOOPS; i++) {
+		lock_acquire(benchlock);
+		benchcount++;
+		lock_release(benchlock);
+	}
+	V(donesem);
+}
+
+static
+void
+lockbenchrun(bool adaptive)
+{
+	int i, result;
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+
+	benchlock->lk_adaptive = adaptive;
+	benchcount = 0;
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<NBENCHTHREADS; i++) {
+		result = thread_fork("lockbench", NULL, lockbenchthread,
+				     NULL, i);
+		if (result) {
+			panic("lockbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NBENCHTHREADS; i++) {
+		P(donesem);
+	}
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+
+	if (benchcount != NBENCHTHREADS * NBENCHLOOPS) {
+		kprintf("Count is %lu, should be %d\n", benchcount,
+			NBENCHTHREADS * NBENCHLOOPS);
+		kprintf("Test failed\n");
+	}
+	kprintf("%s lock: %lu.%09lu seconds\n",
+		adaptive ? "Adaptive" : "Sleeping",
+		(unsigned long) secs, (unsigned long) nsecs);
+}
+
+int
+lockbench(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	benchlock = lock_create("benchlock");
+	if (benchlock == NULL) {
+		panic("lockbench: lock_create failed\n");
+	}
+	kprintf("Starting lock benchmark...\n");
+
+	lockbenchrun(false);
+	lockbenchrun(true);
+
+	lock_destroy(benchlock);
+	benchlock = NULL;
+#ifdef UW
+  cleanitems();
+#endif
+	kprintf("Lock benchmark done.\n");
+
+	return 0;
+}
+
+/*
+ * Reader-writer lock stress test. Each thread writes one time in
+ * four and reads otherwise; some of the writes are downgraded to
+ * reads. Everyone checks that nobody else is writing while they're
+ * in, and readers check that they see a complete write.
+ */
+
+static struct rwlock *testrw;
+static struct spinlock rwcountlock;
+static unsigned long rwreaders, rwwriters, rwfailures;
+
+static
+void
+rwcheck(unsigned long num, bool ok, const char *msg)
+{
+	if (!ok) {
+		kprintf("thread %lu: %s\n", num, msg);
+		spinlock_acquire(&rwcountlock);
+		rwfailures++;
+		spinlock_release(&rwcountlock);
+	}
+}
+
+static
+void
+rwenter(unsigned long num, bool write)
+{
+	bool ok;
+
+	spinlock_acquire(&rwcountlock);
+	ok = rwwriters == 0 && (!write || rwreaders == 0);
+	if (write) {
+		rwwriters++;
+	}
+	else {
+		rwreaders++;
+	}
+	spinlock_release(&rwcountlock);
+	rwcheck(num, ok, write ? "Writer not alone" : "Reader with writer");
+}
+
+static
+void
+rwleave(bool write)
+{
+	spinlock_acquire(&rwcountlock);
+	if (write) {
+		rwwriters--;
+	}
+	else {
+		rwreaders--;
+	}
+	spinlock_release(&rwcountlock);
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	unsigned long i;
+	unsigned long val;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (i % 4 != num % 4) {
+			rwlock_acquire_read(testrw);
+			rwenter(num, false);
+			val = testval1;
+			thread_yield();
+			rwcheck(num, testval1 == val, "Value changed under reader");
+			rwcheck(num, testval2 == val*val, "Saw a partial write");
+			rwcheck(num, testval3 == val%3, "Saw a partial write");
+			rwleave(false);
+			rwlock_release_read(testrw);
+			continue;
+		}
+
+		rwlock_acquire_write(testrw);
+		rwenter(num, true);
+		testval1 = num;
+		thread_yield();
+		testval2 = num*num;
+		testval3 = num%3;
+		if ((i / 4) % 2 == 0) {
+			rwleave(true);
+			rwlock_release_write(testrw);
+			continue;
+		}
+
+		/* Downgrade; nobody should write in between */
+		rwleave(true);
+		rwlock_downgrade(testrw);
+		rwenter(num, false);
+		thread_yield();
+		rwcheck(num, testval1 == num, "Write lost on downgrade");
+		rwleave(false);
+		rwlock_release_read(testrw);
+	}
+	V(donesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	testrw = rwlock_create("testrw");
+	if (testrw == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+	spinlock_init(&rwcountlock);
+	rwreaders = rwwriters = rwfailures = 0;
+	testval1 = testval2 = testval3 = 0;
+	kprintf("Starting rwlock test...\n");
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	if (rwfailures > 0) {
+		kprintf("Test failed\n");
+	}
+	spinlock_cleanup(&rwcountlock);
+	rwlock_destroy(testrw);
+	testrw = NULL;
+#ifdef UW
+  cleanitems();
+#endif
+	kprintf("Rwlock test done.\n");
+
+	return 0;
+}
+
+/*
+ * Reader-writer lock throughput. NBENCHTHREADS threads each read a
+ * little under the lock NBENCHLOOPS times, first with an ordinary
+ * lock and then with a rwlock for reading. With several cpus the
+ * readers should overlap under the rwlock and finish sooner.
+ */
+
+static
+void
+rwbenchthread(void *junk, unsigned long num)
+{
+	int i, j;
+	volatile unsigned long sum;
+	bool userw = num != 0;
+
+	(void)junk;
+
+	for (i=0; i<NBENCHLOOPS; i++) {
+		if (userw) {
+			rwlock_acquire_read(testrw);
+		}
+		else {
+			lock_acquire(benchlock);
+		}
+		sum = 0;
+		for (j=0; j<NRWWORK; j++) {
+			sum += testval1;
+		}
+		if (userw) {
+			rwlock_release_read(testrw);
+		}
+		else {
+			lock_release(benchlock);
+		}
+	}
+	V(donesem);
+}
+
+static
+void
+rwbenchrun(bool userw)
+{
+	int i, result;
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<NBENCHTHREADS; i++) {
+		result = thread_fork("rwbench", NULL, rwbenchthread,
+				     NULL, userw);
+		if (result) {
+			panic("rwbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NBENCHTHREADS; i++) {
+		P(donesem);
+	}
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+
+	kprintf("%s: %lu.%09lu seconds\n",
+		userw ? "Rwlock readers" : "Lock",
+		(unsigned long) secs, (unsigned long) nsecs);
+}
+
+int
+rwbench(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	benchlock = lock_create("benchlock");
+	testrw = rwlock_create("benchrw");
+	if (benchlock == NULL || testrw == NULL) {
+		panic("rwbench: out of memory\n");
+	}
+	kprintf("Starting rwlock benchmark...\n");
+
+	rwbenchrun(false);
+	rwbenchrun(true);
+
+	rwlock_destroy(testrw);
+	testrw = NULL;
+	lock_destroy(benchlock);
+	benchlock = NULL;
+#ifdef UW
+  cleanitems();
+#endif
+	kprintf("Rwlock benchmark done.\n");
+
+	return 0;
+}
+
 static
 void
 cvtestthread(void *junk, unsigned long num)
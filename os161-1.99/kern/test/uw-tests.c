@@ -243,6 +243,12 @@ vmstats_thread(void *junk, unsigned long num)
             }
             break;
 
+          /* Not part of any of the checks */
+          case VMSTAT_COW_SHARED:
+          case VMSTAT_COW_COPY:
+            vmstats_inc(j);
+            break;
+
           default:
             kprintf("Unknown stat %d\n", j);
             break;
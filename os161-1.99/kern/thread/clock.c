@@ -30,6 +30,7 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
@@ -55,23 +56,39 @@
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
- */
-static struct wchan *lbolt;
-/*
- * Once every LT_GRANULARITY usec, everything on minibolt is awakenened by CPU 0
+ * Timed sleeps.
+ *
+ * Threads waiting for a time go on a hierarchical timing wheel driven
+ * by timerclock(), which ticks every LT_GRANULARITY usec. The wheel
+ * has WHEEL_LEVELS levels of WHEEL_SIZE slots, each slot a wait
+ * channel. A level's slots each cover WHEEL_SIZE times as many ticks
+ * as those of the level below, so level 0 has a slot per tick.
+ *
+ * A thread whose deadline is DELTA ticks away sleeps in the lowest
+ * level whose span covers DELTA, in the slot its deadline falls in.
+ * That's O(1). On each tick, timerclock wakes the level 0 slot for the
+ * tick, whose threads are all due. Whenever the ticks reach a multiple
+ * of a level's slot size, it also wakes that level's current slot.
+ * The threads there are due within the next slot of the level below,
+ * and move down to it themselves. So a sleeping thread wakes up at
+ * most once per level, however long it sleeps, and on ticks with
+ * nobody due the cost is one wakeup of an empty channel.
+ *
+ * wheel_lock protects wheel_ticks, the number of ticks so far. A
+ * sleeper locks its slot before letting go of wheel_lock, so the
+ * tick that makes the slot due can't be missed.
  */
-static struct wchan *minibolt;
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1U << WHEEL_BITS)
+#define WHEEL_LEVELS	4
+#define WHEEL_MAXDELTA	((1U << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
 
-/* 
- * number of minibolts per second
- */
-#define MINI_PER_SECOND (1000000/LT_GRANULARITY);
+/* Timer ticks per second */
+#define TICKS_PER_SECOND	(1000000/LT_GRANULARITY)
 
-/*
- * minibolt countdown
- */
-static int minicount;
+static struct wchan *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static struct spinlock wheel_lock;
+static uint32_t wheel_ticks;
 
 /*
  * Setup.
@@ -79,17 +96,21 @@ static int minicount;
 void
 hardclock_bootstrap(void)
 {
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
-	}
-	minibolt = wchan_create("minibolt");
-	if (minibolt == NULL) {
-		panic("Couldn't create minibolt\n");
+	unsigned level, slot;
+
+	/* we assume TICKS_PER_SECOND > 0 */
+	KASSERT(TICKS_PER_SECOND > 0);
+
+	spinlock_init(&wheel_lock);
+	wheel_ticks = 0;
+	for (level=0; level<WHEEL_LEVELS; level++) {
+		for (slot=0; slot<WHEEL_SIZE; slot++) {
+			wheel[level][slot] = wchan_create("timer");
+			if (wheel[level][slot] == NULL) {
+				panic("Couldn't create timer wheel\n");
+			}
+		}
 	}
-	minicount = MINI_PER_SECOND;
-	/* we assume MINI_PER_SECOND > 0 */
-	KASSERT(minicount > 0);
 }
 
 /*
@@ -99,12 +120,65 @@ hardclock_bootstrap(void)
 void
 timerclock(void)
 {
-	/* Broadcast on minibolt */
-	wchan_wakeall(minibolt);
-	/* Broadcast on lbolt if a second has elapsed */
-	if (--minicount <= 0) {
-	  minicount = MINI_PER_SECOND;
-	  wchan_wakeall(lbolt);
+	uint32_t now;
+	unsigned level, shift;
+
+	spinlock_acquire(&wheel_lock);
+	now = ++wheel_ticks;
+	spinlock_release(&wheel_lock);
+
+	/* Move threads down from the levels whose slot just ended */
+	for (level=1; level<WHEEL_LEVELS; level++) {
+		shift = WHEEL_BITS * level;
+		if ((now & ((1U << shift) - 1)) != 0) {
+			break;
+		}
+		wchan_wakeall(wheel[level][(now >> shift) & (WHEEL_SIZE-1)]);
+	}
+
+	/* Wake up the threads that are due */
+	wchan_wakeall(wheel[0][now & (WHEEL_SIZE-1)]);
+}
+
+/*
+ * Sleep until timer tick DEADLINE.
+ */
+static
+void
+clock_waituntil(uint32_t deadline)
+{
+	uint32_t now, delta, target;
+	unsigned level, shift;
+	struct wchan *wc;
+
+	while (1) {
+		spinlock_acquire(&wheel_lock);
+		now = wheel_ticks;
+		/* (the subtraction takes care of the counter wrapping) */
+		delta = deadline - now;
+		if ((int32_t)delta <= 0) {
+			/* It's due */
+			spinlock_release(&wheel_lock);
+			return;
+		}
+
+		/* Too far off for the wheel: go as far as it reaches */
+		if (delta > WHEEL_MAXDELTA) {
+			delta = WHEEL_MAXDELTA;
+		}
+		target = now + delta;
+
+		for (level=0; level<WHEEL_LEVELS-1; level++) {
+			if (delta < (1U << (WHEEL_BITS * (level+1)))) {
+				break;
+			}
+		}
+		shift = WHEEL_BITS * level;
+		wc = wheel[level][(target >> shift) & (WHEEL_SIZE-1)];
+
+		wchan_lock(wc);
+		spinlock_release(&wheel_lock);
+		wchan_sleep(wc);
 	}
 }
 
@@ -126,7 +200,46 @@ hardclock(void)
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
-	thread_yield();
+	if (thread_tick()) {
+		thread_yield();
+	}
+}
+
+/*
+ * Suspend execution until the time of day, as gettime() reports it,
+ * reaches SECS and NSECS. The wheel only turns once a tick, so this
+ * wakes up at the first tick after the deadline; it never returns
+ * early.
+ */
+void
+thread_sleep_until(time_t secs, uint32_t nsecs)
+{
+	time_t nowsecs, leftsecs;
+	uint32_t nownsecs, leftnsecs, ticks;
+	uint32_t start;
+
+	while (1) {
+		gettime(&nowsecs, &nownsecs);
+		if (nowsecs > secs || (nowsecs == secs && nownsecs >= nsecs)) {
+			return;
+		}
+		getinterval(nowsecs, nownsecs, secs, nsecs,
+			    &leftsecs, &leftnsecs);
+
+		/* Round up; the loop catches the part of a tick left over */
+		if (leftsecs > WHEEL_MAXDELTA / TICKS_PER_SECOND) {
+			ticks = WHEEL_MAXDELTA;
+		}
+		else {
+			ticks = leftsecs * TICKS_PER_SECOND +
+				DIVROUNDUP(leftnsecs, LT_GRANULARITY * 1000);
+		}
+
+		spinlock_acquire(&wheel_lock);
+		start = wheel_ticks;
+		spinlock_release(&wheel_lock);
+		clock_waituntil(start + ticks);
+	}
 }
 
 /*
@@ -135,11 +248,14 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-  while (num_secs > 0) {
-    wchan_lock(lbolt);
-    wchan_sleep(lbolt);
-    num_secs--;
-  }
+	time_t secs;
+	uint32_t nsecs;
+
+	if (num_secs <= 0) {
+		return;
+	}
+	gettime(&secs, &nsecs);
+	thread_sleep_until(secs + num_secs, nsecs);
 }
 
 /*
@@ -149,9 +265,13 @@ clocksleep(int num_secs)
 void
 clocknap(int num_ticks)
 {
-  while (num_ticks > 0) {
-    wchan_lock(minibolt);
-    wchan_sleep(minibolt);
-    num_ticks--;
-  }
+	uint32_t start;
+
+	if (num_ticks <= 0) {
+		return;
+	}
+	spinlock_acquire(&wheel_lock);
+	start = wheel_ticks;
+	spinlock_release(&wheel_lock);
+	clock_waituntil(start + num_ticks);
 }
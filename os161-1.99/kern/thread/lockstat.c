@@ -0,0 +1,373 @@
+/*
+ * Lock contention statistics. See lockstat.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <lockstat.h>
+
+#define LOCKSTAT_NAMELEN	32
+#define LOCKSTAT_NRETIRED	128
+
+/*
+ * Totals by name, for destroyed locks and for printing. Names too long
+ * for lt_name are cut short; locks whose names only differ after that
+ * are counted together.
+ */
+struct lockstat_total {
+	char lt_name[LOCKSTAT_NAMELEN];
+	uint32_t lt_acquires;
+	uint32_t lt_contended;
+	uint64_t lt_spins;
+	uint64_t lt_waitns;
+	uint64_t lt_holdns;
+};
+
+/*
+ * lockstat_lock protects the list of locks and the totals for
+ * destroyed ones. It comes after every other spinlock. Its own
+ * statistics aren't kept, since keeping them would need it.
+ */
+static struct spinlock lockstat_lock = SPINLOCK_INITIALIZER;
+static struct lockstat *lockstat_all;
+static unsigned lockstat_nlocks;
+static struct lockstat_total lockstat_retired[LOCKSTAT_NRETIRED];
+static unsigned lockstat_nretired;
+
+/* Set once the clock can be read; never cleared */
+static bool lockstat_counting;
+
+/*
+ * Find the entry for NAME in TABLE, which has *NUM of MAX entries in
+ * use, adding it if need be. If the table is full, everything else
+ * goes in the last entry.
+ */
+static
+struct lockstat_total *
+lockstat_find(struct lockstat_total *table, unsigned *num, unsigned max,
+	      const char *name)
+{
+	char buf[LOCKSTAT_NAMELEN];
+	unsigned i;
+
+	snprintf(buf, sizeof(buf), "%s", name);
+	for (i=0; i<*num; i++) {
+		if (!strcmp(table[i].lt_name, buf)) {
+			return &table[i];
+		}
+	}
+	if (*num == max) {
+		snprintf(table[max-1].lt_name, LOCKSTAT_NAMELEN, "(others)");
+		return &table[max-1];
+	}
+	KASSERT(*num < max);
+	bzero(&table[*num], sizeof(table[*num]));
+	strcpy(table[*num].lt_name, buf);
+	return &table[(*num)++];
+}
+
+static
+void
+lockstat_add(struct lockstat_total *lt, const struct lockstat *ls)
+{
+	lt->lt_acquires += ls->ls_acquires;
+	lt->lt_contended += ls->ls_contended;
+	lt->lt_spins += ls->ls_spins;
+	lt->lt_waitns += ls->ls_waitns;
+	lt->lt_holdns += ls->ls_holdns;
+}
+
+/*
+ * Put LS on the list. Call with lockstat_lock held.
+ */
+static
+void
+lockstat_register(struct lockstat *ls)
+{
+	KASSERT(spinlock_do_i_hold(&lockstat_lock));
+
+	ls->ls_prev = NULL;
+	ls->ls_next = lockstat_all;
+	if (lockstat_all != NULL) {
+		lockstat_all->ls_prev = ls;
+	}
+	lockstat_all = ls;
+	lockstat_nlocks++;
+	ls->ls_registered = true;
+}
+
+/*
+ * Take LS off the list, keeping its counts under its name. Call with
+ * lockstat_lock held.
+ */
+static
+void
+lockstat_unregister(struct lockstat *ls)
+{
+	struct lockstat_total *lt;
+
+	KASSERT(spinlock_do_i_hold(&lockstat_lock));
+	KASSERT(ls->ls_registered);
+
+	if (ls->ls_prev != NULL) {
+		ls->ls_prev->ls_next = ls->ls_next;
+	}
+	else {
+		KASSERT(lockstat_all == ls);
+		lockstat_all = ls->ls_next;
+	}
+	if (ls->ls_next != NULL) {
+		ls->ls_next->ls_prev = ls->ls_prev;
+	}
+	lockstat_nlocks--;
+	ls->ls_registered = false;
+
+	if (ls->ls_acquires > 0) {
+		lt = lockstat_find(lockstat_retired, &lockstat_nretired,
+				   LOCKSTAT_NRETIRED, ls->ls_name);
+		lockstat_add(lt, ls);
+	}
+}
+
+/*
+ * Check whether LS is on the list. Call with lockstat_lock held.
+ */
+static
+bool
+lockstat_onlist(struct lockstat *ls)
+{
+	struct lockstat *l;
+
+	KASSERT(spinlock_do_i_hold(&lockstat_lock));
+
+	for (l = lockstat_all; l != NULL; l = l->ls_next) {
+		if (l == ls) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+lockstat_bootstrap(void)
+{
+	lockstat_counting = true;
+}
+
+void
+lockstat_init(struct lockstat *ls, const char *name)
+{
+	KASSERT(name != NULL);
+
+	spinlock_acquire(&lockstat_lock);
+
+	/*
+	 * A lock can be initialized again without being cleaned up
+	 * (vmstats_init does this to its spinlock). Treat that like a
+	 * cleanup first, or it goes on the list twice. Fresh memory can
+	 * have anything in ls_registered, so look before believing it.
+	 */
+	if (ls->ls_registered && lockstat_onlist(ls)) {
+		lockstat_unregister(ls);
+	}
+
+	ls->ls_name = name;
+	ls->ls_acquires = 0;
+	ls->ls_contended = 0;
+	ls->ls_spins = 0;
+	ls->ls_waitns = 0;
+	ls->ls_holdns = 0;
+	ls->ls_since = 0;
+
+	lockstat_register(ls);
+	spinlock_release(&lockstat_lock);
+}
+
+void
+lockstat_cleanup(struct lockstat *ls)
+{
+	if (!ls->ls_registered) {
+		return;
+	}
+
+	spinlock_acquire(&lockstat_lock);
+	lockstat_unregister(ls);
+	spinlock_release(&lockstat_lock);
+}
+
+bool
+lockstat_check(void)
+{
+	struct lockstat *ls, *prev;
+	unsigned n;
+	bool ok;
+
+	spinlock_acquire(&lockstat_lock);
+	prev = NULL;
+	n = 0;
+	ok = true;
+	for (ls = lockstat_all; ls != NULL; ls = ls->ls_next) {
+		/* More entries than locks means a loop */
+		if (n++ == lockstat_nlocks || ls->ls_prev != prev ||
+		    !ls->ls_registered) {
+			ok = false;
+			break;
+		}
+		prev = ls;
+	}
+	if (ok && n != lockstat_nlocks) {
+		ok = false;
+	}
+	spinlock_release(&lockstat_lock);
+	return ok;
+}
+
+uint64_t
+lockstat_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	if (!lockstat_counting) {
+		return 0;
+	}
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+void
+lockstat_acquired(struct lockstat *ls, bool contended, uint32_t spins,
+		  uint64_t waitstart)
+{
+	uint64_t now;
+
+	if (!lockstat_counting || ls == &lockstat_lock.lk_stat) {
+		return;
+	}
+
+	if (!ls->ls_registered) {
+		/* A static spinlock, used for the first time */
+		spinlock_acquire(&lockstat_lock);
+		if (!ls->ls_registered) {
+			lockstat_register(ls);
+		}
+		spinlock_release(&lockstat_lock);
+	}
+
+	now = lockstat_now();
+	ls->ls_acquires++;
+	if (contended) {
+		ls->ls_contended++;
+		ls->ls_spins += spins;
+		if (waitstart != 0) {
+			ls->ls_waitns += now - waitstart;
+		}
+	}
+	ls->ls_since = now;
+}
+
+void
+lockstat_released(struct lockstat *ls)
+{
+	if (ls->ls_since == 0) {
+		return;
+	}
+	ls->ls_holdns += lockstat_now() - ls->ls_since;
+	ls->ls_since = 0;
+}
+
+void
+lockstat_waited(struct lockstat *ls, uint64_t waitstart)
+{
+	if (!lockstat_counting) {
+		return;
+	}
+	ls->ls_acquires++;
+	ls->ls_contended++;
+	if (waitstart != 0) {
+		ls->ls_waitns += lockstat_now() - waitstart;
+	}
+}
+
+void
+lockstat_print(void)
+{
+	struct lockstat_total *table, *lt, tmp;
+	struct lockstat *ls;
+	unsigned max, num, i, j;
+
+	/*
+	 * Get room for everything; locks made meanwhile may end up in
+	 * "(others)".
+	 */
+	spinlock_acquire(&lockstat_lock);
+	max = lockstat_nlocks + lockstat_nretired + 16;
+	spinlock_release(&lockstat_lock);
+
+	table = kmalloc(max * sizeof(*table));
+	if (table == NULL) {
+		kprintf("lockstat: Out of memory\n");
+		return;
+	}
+
+	num = 0;
+	spinlock_acquire(&lockstat_lock);
+	for (i=0; i<lockstat_nretired; i++) {
+		lt = lockstat_find(table, &num, max,
+				   lockstat_retired[i].lt_name);
+		lt->lt_acquires += lockstat_retired[i].lt_acquires;
+		lt->lt_contended += lockstat_retired[i].lt_contended;
+		lt->lt_spins += lockstat_retired[i].lt_spins;
+		lt->lt_waitns += lockstat_retired[i].lt_waitns;
+		lt->lt_holdns += lockstat_retired[i].lt_holdns;
+	}
+	for (ls = lockstat_all; ls != NULL; ls = ls->ls_next) {
+		if (ls->ls_acquires > 0) {
+			lt = lockstat_find(table, &num, max, ls->ls_name);
+			lockstat_add(lt, ls);
+		}
+	}
+	spinlock_release(&lockstat_lock);
+
+	/* Most time spent waiting first */
+	for (i=1; i<num; i++) {
+		tmp = table[i];
+		for (j=i; j>0 && table[j-1].lt_waitns < tmp.lt_waitns; j--) {
+			table[j] = table[j-1];
+		}
+		table[j] = tmp;
+	}
+
+	kprintf("%-31s %9s %9s %10s %10s %10s\n", "lock", "acquires",
+		"contended", "spins", "wait us", "hold us");
+	for (i=0; i<num; i++) {
+		lt = &table[i];
+		kprintf("%-31s %9u %9u %10llu %10llu %10llu\n", lt->lt_name,
+			lt->lt_acquires, lt->lt_contended,
+			(unsigned long long) lt->lt_spins,
+			(unsigned long long) (lt->lt_waitns / 1000),
+			(unsigned long long) (lt->lt_holdns / 1000));
+	}
+
+	kfree(table);
+}
+
+void
+lockstat_reset(void)
+{
+	struct lockstat *ls;
+
+	/* Counts being updated right now may not be zeroed; no matter */
+	spinlock_acquire(&lockstat_lock);
+	for (ls = lockstat_all; ls != NULL; ls = ls->ls_next) {
+		ls->ls_acquires = 0;
+		ls->ls_contended = 0;
+		ls->ls_spins = 0;
+		ls->ls_waitns = 0;
+		ls->ls_holdns = 0;
+	}
+	lockstat_nretired = 0;
+	spinlock_release(&lockstat_lock);
+}
@@ -45,12 +45,24 @@
 /*
  * Initialize spinlock.
  */
+#if OPT_LOCKSTAT
+void
+spinlock_initname(struct spinlock *lk, const char *name)
+{
+	spinlock_data_set(&lk->lk_next, 0);
+	spinlock_data_set(&lk->lk_serving, 0);
+	lk->lk_holder = NULL;
+	lockstat_init(&lk->lk_stat, name);
+}
+#else
 void
 spinlock_init(struct spinlock *lk)
 {
-	spinlock_data_set(&lk->lk_lock, 0);
+	spinlock_data_set(&lk->lk_next, 0);
+	spinlock_data_set(&lk->lk_serving, 0);
 	lk->lk_holder = NULL;
 }
+#endif
 
 /*
  * Clean up spinlock.
@@ -59,20 +71,30 @@ void
 spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
-	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+	KASSERT(spinlock_data_get(&lk->lk_next) ==
+		spinlock_data_get(&lk->lk_serving));
+#if OPT_LOCKSTAT
+	lockstat_cleanup(&lk->lk_stat);
+#endif
 }
 
 /*
  * Get the lock.
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
- * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * might come back to this lock and deadlock, or keep everyone queued
+ * behind our ticket waiting), then use a machine-level atomic
+ * operation to take a ticket and wait for our turn.
  */
 void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
+#if OPT_LOCKSTAT
+	uint32_t spins = 0;
+	uint64_t waitstart = 0;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,27 +109,26 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&lk->lk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
-			continue;
+	/*
+	 * Take a ticket. Fetch-and-increment is a machine-level
+	 * atomic operation, so no two CPUs get the same number.
+	 * Then wait, only reading, until the holder hands the lock
+	 * on to our ticket. Tickets wrap around, which is fine as
+	 * long as there are fewer CPUs than numbers.
+	 */
+	ticket = spinlock_data_fetchinc(&lk->lk_next);
+	while (spinlock_data_get(&lk->lk_serving) != ticket) {
+#if OPT_LOCKSTAT
+		if (spins++ == 0) {
+			waitstart = lockstat_now();
 		}
-		break;
+#endif
 	}
 
 	lk->lk_holder = mycpu;
+#if OPT_LOCKSTAT
+	lockstat_acquired(&lk->lk_stat, spins > 0, spins, waitstart);
+#endif
 }
 
 /*
@@ -121,8 +142,13 @@ spinlock_release(struct spinlock *lk)
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+#if OPT_LOCKSTAT
+	lockstat_released(&lk->lk_stat);
+#endif
 	lk->lk_holder = NULL;
-	spinlock_data_set(&lk->lk_lock, 0);
+	/* Only the holder writes lk_serving, so no atomic op is needed */
+	spinlock_data_set(&lk->lk_serving,
+			  spinlock_data_get(&lk->lk_serving) + 1);
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -37,9 +37,16 @@
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
+#include <cpu.h>
 #include <current.h>
 #include <synch.h>
 
+/*
+ * How many times a thread waiting for an adaptive lock looks at it
+ * between checks that the owner is still running.
+ */
+#define LOCK_SPINCHECK 100
+
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
@@ -171,6 +178,10 @@ lock_create(const char *name)
         spinlock_init(&lock->lk_lock);
         lock->owner = NULL;
         lock->held = false;
+        lock->lk_adaptive = true;
+#if OPT_LOCKSTAT
+        lockstat_init(&lock->lk_stat, lock->lk_name);
+#endif
         return lock;
 }
 
@@ -179,6 +190,9 @@ lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
 
+#if OPT_LOCKSTAT
+        lockstat_cleanup(&lock->lk_stat);
+#endif
         spinlock_cleanup(&lock->lk_lock);
         wchan_destroy(lock->lk_wchan);
         lock->owner=NULL;
@@ -186,13 +200,63 @@ lock_destroy(struct lock *lock)
         kfree(lock);
 }
 
+/*
+ * Check if the lock's owner is running on another cpu. The owner
+ * can't let go of the lock, and so can't exit, while we hold
+ * lk_lock, so it's safe to look at. Its state may change as we
+ * look, but that only means guessing wrong once.
+ */
+static
+bool
+lock_owner_running(struct lock *lock)
+{
+        struct thread *owner;
+
+        KASSERT(spinlock_do_i_hold(&lock->lk_lock));
+
+        owner = lock->owner;
+        return owner != NULL && owner->t_state == S_RUN &&
+                owner->t_cpu != curcpu->c_self;
+}
+
 void
 lock_acquire(struct lock *lock)
 {
+        unsigned i;
+#if OPT_LOCKSTAT
+        bool contended;
+        uint32_t spins = 0;
+        uint64_t waitstart = 0;
+#endif
+
         KASSERT(lock != NULL);
         KASSERT(!lock_do_i_hold(lock));
         spinlock_acquire(&lock->lk_lock);
+#if OPT_LOCKSTAT
+        contended = lock->held;
+        if (contended) {
+                waitstart = lockstat_now();
+        }
+#endif
         while(lock->held) {
+                if (lock->lk_adaptive && lock_owner_running(lock)) {
+                        /*
+                         * The owner is in the middle of its critical
+                         * section on another cpu and will likely be
+                         * done before we could get through a context
+                         * switch. Spin, with interrupts on, until the
+                         * lock is free or the owner stops running.
+                         */
+                        spinlock_release(&lock->lk_lock);
+                        for (i=0; i<LOCK_SPINCHECK && lock->held; i++) {
+                                /* nothing */
+                        }
+#if OPT_LOCKSTAT
+                        spins += i;
+#endif
+                        spinlock_acquire(&lock->lk_lock);
+                        continue;
+                }
                 wchan_lock(lock->lk_wchan);
 		spinlock_release(&lock->lk_lock);
                 wchan_sleep(lock->lk_wchan);
@@ -200,6 +264,9 @@ lock_acquire(struct lock *lock)
         }
         lock->held = true;
         lock->owner = curthread;
+#if OPT_LOCKSTAT
+        lockstat_acquired(&lock->lk_stat, contended, spins, waitstart);
+#endif
         spinlock_release(&lock->lk_lock);
         //(void)lock;  // suppress warning until code gets written
 }
@@ -211,6 +278,9 @@ lock_release(struct lock *lock)
         KASSERT(lock_do_i_hold(lock));
         KASSERT(lock->held);
         spinlock_acquire(&lock->lk_lock);
+#if OPT_LOCKSTAT
+        lockstat_released(&lock->lk_stat);
+#endif
         lock->held = false;
         lock->owner = NULL;
         wchan_wakeone(lock->lk_wchan);
@@ -246,6 +316,9 @@ cv_create(const char *name)
         }
         
         cv->cv_wchan =  wchan_create(cv->cv_name);
+#if OPT_LOCKSTAT
+        lockstat_init(&cv->cv_stat, cv->cv_name);
+#endif
 
         return cv;
 }
@@ -255,6 +328,9 @@ cv_destroy(struct cv *cv)
 {
         KASSERT(cv != NULL);
 
+#if OPT_LOCKSTAT
+        lockstat_cleanup(&cv->cv_stat);
+#endif
         wchan_destroy(cv->cv_wchan);
         
         kfree(cv->cv_name);
@@ -264,27 +340,237 @@ cv_destroy(struct cv *cv)
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
+#if OPT_LOCKSTAT
+        uint64_t waitstart;
+#endif
+
         KASSERT(lock != NULL);
         KASSERT(cv != NULL);
         KASSERT(lock_do_i_hold(lock));
+#if OPT_LOCKSTAT
+        waitstart = lockstat_now();
+#endif
         wchan_lock(cv->cv_wchan);
         lock_release(lock);
         wchan_sleep(cv->cv_wchan);
         lock_acquire(lock);
+#if OPT_LOCKSTAT
+        /* The lock protects the counts */
+        lockstat_waited(&cv->cv_stat, waitstart);
+#endif
 }
 
+/*
+ * A thread woken from cv_wait goes straight to lock_acquire, and
+ * while we hold the lock that can only put it back to sleep, on the
+ * lock. So instead of waking it, move it onto the lock's wait channel
+ * ("wait morphing"); lock_release then wakes it once the lock is
+ * free. Each waiter costs one wakeup instead of two, and broadcast
+ * doesn't start a herd all fighting over the lock.
+ *
+ * If the caller doesn't hold the lock, nothing would be sure to
+ * release it after the move, so wake the waiters the usual way.
+ */
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
-        (void)lock;
-        wchan_wakeone(cv->cv_wchan);
-        
+        KASSERT(cv != NULL);
+        KASSERT(lock != NULL);
+
+        if (lock_do_i_hold(lock)) {
+                wchan_moveone(cv->cv_wchan, lock->lk_wchan);
+        }
+        else {
+                wchan_wakeone(cv->cv_wchan);
+        }
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
-	(void)lock;
-        wchan_wakeall(cv->cv_wchan);
-        
+        KASSERT(cv != NULL);
+        KASSERT(lock != NULL);
+
+        if (lock_do_i_hold(lock)) {
+                wchan_moveall(cv->cv_wchan, lock->lk_wchan);
+        }
+        else {
+                wchan_wakeall(cv->cv_wchan);
+        }
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+        struct rwlock *rw;
+
+        rw = kmalloc(sizeof(struct rwlock));
+        if (rw == NULL) {
+                return NULL;
+        }
+
+        rw->rwlk_name = kstrdup(name);
+        if (rw->rwlk_name == NULL) {
+                kfree(rw);
+                return NULL;
+        }
+
+        rw->rwlk_rwchan = wchan_create(rw->rwlk_name);
+        if (rw->rwlk_rwchan == NULL) {
+                kfree(rw->rwlk_name);
+                kfree(rw);
+                return NULL;
+        }
+        rw->rwlk_wwchan = wchan_create(rw->rwlk_name);
+        if (rw->rwlk_wwchan == NULL) {
+                wchan_destroy(rw->rwlk_rwchan);
+                kfree(rw->rwlk_name);
+                kfree(rw);
+                return NULL;
+        }
+
+        spinlock_init(&rw->rwlk_lock);
+        rw->rwlk_writer = NULL;
+        rw->rwlk_readers = 0;
+        rw->rwlk_waitingreaders = 0;
+        rw->rwlk_waitingwriters = 0;
+        rw->rwlk_readgen = 0;
+        return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(rw->rwlk_writer == NULL);
+        KASSERT(rw->rwlk_readers == 0);
+
+        spinlock_cleanup(&rw->rwlk_lock);
+        wchan_destroy(rw->rwlk_wwchan);
+        wchan_destroy(rw->rwlk_rwchan);
+        kfree(rw->rwlk_name);
+        kfree(rw);
+}
+
+/*
+ * Let in all the readers that are waiting. They've already been
+ * counted as holding the lock when they wake up.
+ */
+static
+void
+rwlock_admit_readers(struct rwlock *rw)
+{
+        KASSERT(spinlock_do_i_hold(&rw->rwlk_lock));
+
+        if (rw->rwlk_waitingreaders > 0) {
+                rw->rwlk_readers += rw->rwlk_waitingreaders;
+                rw->rwlk_waitingreaders = 0;
+                rw->rwlk_readgen++;
+                wchan_wakeall(rw->rwlk_rwchan);
+        }
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+        unsigned gen;
+
+        KASSERT(rw != NULL);
+        KASSERT(rw->rwlk_writer != curthread);
+
+        spinlock_acquire(&rw->rwlk_lock);
+        if (rw->rwlk_writer == NULL && rw->rwlk_waitingwriters == 0) {
+                rw->rwlk_readers++;
+        }
+        else {
+                /* Wait for a writer to let us in */
+                gen = rw->rwlk_readgen;
+                rw->rwlk_waitingreaders++;
+                do {
+                        wchan_lock(rw->rwlk_rwchan);
+                        spinlock_release(&rw->rwlk_lock);
+                        wchan_sleep(rw->rwlk_rwchan);
+                        spinlock_acquire(&rw->rwlk_lock);
+                } while (rw->rwlk_readgen == gen);
+        }
+        KASSERT(rw->rwlk_writer == NULL);
+        spinlock_release(&rw->rwlk_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+
+        spinlock_acquire(&rw->rwlk_lock);
+        KASSERT(rw->rwlk_readers > 0);
+        KASSERT(rw->rwlk_writer == NULL);
+        rw->rwlk_readers--;
+        if (rw->rwlk_readers == 0 && rw->rwlk_waitingwriters > 0) {
+                wchan_wakeone(rw->rwlk_wwchan);
+        }
+        spinlock_release(&rw->rwlk_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(rw->rwlk_writer != curthread);
+
+        spinlock_acquire(&rw->rwlk_lock);
+        while (rw->rwlk_writer != NULL || rw->rwlk_readers > 0) {
+                rw->rwlk_waitingwriters++;
+                wchan_lock(rw->rwlk_wwchan);
+                spinlock_release(&rw->rwlk_lock);
+                wchan_sleep(rw->rwlk_wwchan);
+                spinlock_acquire(&rw->rwlk_lock);
+                rw->rwlk_waitingwriters--;
+        }
+        rw->rwlk_writer = curthread;
+        spinlock_release(&rw->rwlk_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+
+        spinlock_acquire(&rw->rwlk_lock);
+        KASSERT(rw->rwlk_writer == curthread);
+        KASSERT(rw->rwlk_readers == 0);
+        rw->rwlk_writer = NULL;
+        if (rw->rwlk_waitingreaders > 0) {
+                /* Readers first; the next writer waits for them */
+                rwlock_admit_readers(rw);
+        }
+        else if (rw->rwlk_waitingwriters > 0) {
+                wchan_wakeone(rw->rwlk_wwchan);
+        }
+        spinlock_release(&rw->rwlk_lock);
+}
+
+void
+rwlock_downgrade(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+
+        spinlock_acquire(&rw->rwlk_lock);
+        KASSERT(rw->rwlk_writer == curthread);
+        KASSERT(rw->rwlk_readers == 0);
+        rw->rwlk_writer = NULL;
+        rw->rwlk_readers = 1;
+        rwlock_admit_readers(rw);
+        spinlock_release(&rw->rwlk_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        return rw->rwlk_writer == curthread;
 }
@@ -52,11 +52,28 @@
 #include <vnode.h>
 
 #include "opt-synchprobs.h"
+#include "opt-mlfq.h"
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+#if OPT_MLFQ
+/*
+ * Scheduler tuning (see schedule() below). The quantum is in
+ * hardclocks, and doubles at each level down. The boost period must
+ * be a multiple of SCHEDULE_HARDCLOCKS in clock.c.
+ */
+#define MLFQ_QUANTUM(level)	(2U << (level))
+#define MLFQ_BOOST_HARDCLOCKS	100	/* Once a second */
+#endif
+
+/*
+ * A thread that ran this recently (in hardclocks) probably still has
+ * its working set in that cpu's cache; see thread_steal().
+ */
+#define STEAL_HOT_HARDCLOCKS	2
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -149,6 +166,14 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	thread->t_lastran = 0;
+
+#if OPT_MLFQ
+	/* New threads start at the top */
+	thread->t_mlfqlevel = 0;
+	thread->t_mlfqticks = 0;
+#endif
+
 	/* If you add to struct thread, be sure to initialize here */
 
 	return thread;
@@ -168,6 +193,9 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+#if OPT_MLFQ
+	unsigned i;
+#endif
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -180,9 +208,19 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_npagecache = 0;
+	c->c_asid = 0;
+	c->c_asidgen = 0;
 
 	c->c_isidle = false;
+#if OPT_MLFQ
+	for (i=0; i<MLFQ_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
+#else
 	threadlist_init(&c->c_runqueue);
+#endif
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
@@ -303,9 +341,22 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
+#if OPT_MLFQ
+	{
+		unsigned i;
+
+		for (i=0; i<MLFQ_NLEVELS; i++) {
+			curcpu->c_runqueue[i].tl_count = 0;
+			curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+			curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+		}
+		curcpu->c_runcount = 0;
+	}
+#else
 	curcpu->c_runqueue.tl_count = 0;
 	curcpu->c_runqueue.tl_head.tln_next = NULL;
 	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+#endif
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -406,6 +457,23 @@ cpu_hatch(unsigned software_number)
 	thread_exit();
 }
 
+/*
+ * Count the free frames in every cpu's page cache, for the coremap.
+ * Each count is one word, so reading it unlocked is safe enough for
+ * a snapshot.
+ */
+unsigned
+cpu_pagecache_count(void)
+{
+	unsigned i, total;
+
+	total = 0;
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		total += cpuarray_get(&allcpus, i)->c_npagecache;
+	}
+	return total;
+}
+
 /*
  * Start up secondary cpus. Called from boot().
  */
@@ -426,6 +494,201 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue operations. The caller must hold the cpu's runqueue lock.
+ *
+ * With the mlfq option there is a queue for each priority level:
+ * runqueue_remhead takes the thread to run next, from the highest
+ * level that has one, and runqueue_remtail takes the least urgent
+ * one, for migration. Otherwise there is just the one queue.
+ */
+static
+unsigned
+runqueue_count(struct cpu *c)
+{
+#if OPT_MLFQ
+	return c->c_runcount;
+#else
+	return c->c_runqueue.tl_count;
+#endif
+}
+
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+#if OPT_MLFQ
+	KASSERT(t->t_mlfqlevel < MLFQ_NLEVELS);
+	threadlist_addtail(&c->c_runqueue[t->t_mlfqlevel], t);
+	c->c_runcount++;
+#else
+	threadlist_addtail(&c->c_runqueue, t);
+#endif
+}
+
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+#if OPT_MLFQ
+	struct thread *t;
+	unsigned level;
+
+	for (level=0; level<MLFQ_NLEVELS; level++) {
+		t = threadlist_remhead(&c->c_runqueue[level]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+#else
+	return threadlist_remhead(&c->c_runqueue);
+#endif
+}
+
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+#if OPT_MLFQ
+	struct thread *t;
+	unsigned level;
+
+	for (level=MLFQ_NLEVELS; level-- > 0; ) {
+		t = threadlist_remtail(&c->c_runqueue[level]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+#else
+	return threadlist_remtail(&c->c_runqueue);
+#endif
+}
+
+/*
+ * Move up to MAX threads from the front of C's queues to STOLEN.
+ * Unless TAKEHOT is set, threads that are probably still in C's
+ * cache are left alone. Returns the number moved.
+ *
+ * C's c_hardclocks belongs to C, but for guessing at what's in its
+ * cache a stale value is good enough.
+ */
+static
+unsigned
+runqueue_steal(struct cpu *c, struct threadlist *stolen, unsigned max,
+	       bool takehot)
+{
+	struct threadlist *tl;
+	struct threadlistnode *node;
+	struct thread *t;
+	unsigned level, nlevels, n;
+
+#if OPT_MLFQ
+	nlevels = MLFQ_NLEVELS;
+#else
+	nlevels = 1;
+#endif
+
+	n = 0;
+	for (level=0; level<nlevels && n<max; level++) {
+#if OPT_MLFQ
+		tl = &c->c_runqueue[level];
+#else
+		tl = &c->c_runqueue;
+#endif
+		node = tl->tl_head.tln_next;
+		while (node->tln_next != NULL && n < max) {
+			t = node->tln_self;
+			node = node->tln_next;
+
+			/* See the notes in thread_consider_migration */
+			if (t == c->c_curthread) {
+				continue;
+			}
+			if (!takehot &&
+			    c->c_hardclocks - t->t_lastran < STEAL_HOT_HARDCLOCKS) {
+				continue;
+			}
+
+			threadlist_remove(tl, t);
+#if OPT_MLFQ
+			c->c_runcount--;
+#endif
+			threadlist_addtail(stolen, t);
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * Work stealing. A cpu that has run out of threads calls this,
+ * without its own runqueue lock, before going idle. It takes up to
+ * half of the threads waiting on the cpu with the most, preferring
+ * ones that haven't run lately; if all of them have, an idle cpu is
+ * worse than cache misses, so it takes those. Returns true if it got
+ * any.
+ *
+ * Only one runqueue lock is held at a time, so there's no lock
+ * ordering to worry about.
+ */
+static
+bool
+thread_steal(void)
+{
+	unsigned i, numcpus, count, best, want, n;
+	struct cpu *c, *victim;
+	struct threadlist stolen;
+	struct thread *t;
+
+	victim = NULL;
+	best = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		spinlock_acquire(&c->c_runqueue_lock);
+		/* An idle cpu is about to run what it has itself */
+		count = c->c_isidle ? 0 : runqueue_count(c);
+		spinlock_release(&c->c_runqueue_lock);
+		if (count > best) {
+			best = count;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return false;
+	}
+
+	threadlist_init(&stolen);
+	spinlock_acquire(&victim->c_runqueue_lock);
+	want = DIVROUNDUP(runqueue_count(victim), 2);
+	n = runqueue_steal(victim, &stolen, want, false);
+	if (n == 0) {
+		n = runqueue_steal(victim, &stolen, want, true);
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (n > 0) {
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		while ((t = threadlist_remhead(&stolen)) != NULL) {
+			t->t_cpu = curcpu->c_self;
+			runqueue_add(curcpu, t);
+		}
+		spinlock_release(&curcpu->c_runqueue_lock);
+		DEBUG(DB_THREADS, "Stole %u threads: cpu %u -> %u",
+		      n, victim->c_number, curcpu->c_number);
+	}
+
+	threadlist_cleanup(&stolen);
+	return n > 0;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -450,7 +713,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -574,12 +837,15 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && runqueue_count(curcpu) == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	/* Remember when it ran, for thread_steal. */
+	cur->t_lastran = curcpu->c_hardclocks;
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -588,6 +854,17 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
+#if OPT_MLFQ
+		/*
+		 * Going to sleep early in the quantum is what
+		 * interactive threads do; move up a level.
+		 */
+		if (cur->t_mlfqlevel > 0 &&
+		    cur->t_mlfqticks <= MLFQ_QUANTUM(cur->t_mlfqlevel) / 2) {
+			cur->t_mlfqlevel--;
+			cur->t_mlfqticks = 0;
+		}
+#endif
 		cur->t_wchan_name = wc->wc_name;
 		/*
 		 * Add the thread to the list in the wait channel, and
@@ -613,7 +890,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call md_idle().
+	 * Get the next thread. While there isn't one, try to steal
+	 * some from another cpu, and if that fails call md_idle().
 	 * curcpu->c_isidle must be true when md_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
@@ -632,10 +910,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -822,17 +1102,100 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * With the mlfq option, each cpu runs a multi-level feedback queue.
+ * It always runs a thread from the highest priority level that has
+ * one. Threads start at the top, level 0. A thread that uses up its
+ * level's quantum drops a level, where the quantum is twice as long,
+ * so CPU hogs sink and get longer but rarer turns. A thread that goes
+ * to sleep having used no more than half of its quantum moves up a
+ * level, so interactive threads, which mostly wait for input, stay
+ * near the top and get the processor soon after they wake up. Time
+ * used only resets on changing level, so yielding or sleeping just
+ * before the quantum runs out doesn't keep a thread up.
+ *
+ * Without the option, threads run round-robin, a hardclock each.
  */
 
+/*
+ * This is called periodically from hardclock(). Every
+ * MLFQ_BOOST_HARDCLOCKS it moves all the current CPU's threads back
+ * to the top level, so that threads sunk to the bottom can't be
+ * starved by a stream of interactive ones.
+ */
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+#if OPT_MLFQ
+	struct thread *t;
+	unsigned level;
+
+	if ((curcpu->c_hardclocks % MLFQ_BOOST_HARDCLOCKS) != 0) {
+		return;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (level=1; level<MLFQ_NLEVELS; level++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[level]))
+		       != NULL) {
+			t->t_mlfqlevel = 0;
+			t->t_mlfqticks = 0;
+			threadlist_addtail(&curcpu->c_runqueue[0], t);
+		}
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_mlfqlevel = 0;
+		curthread->t_mlfqticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+#endif
+}
+
+/*
+ * This is called from hardclock() on every tick. Charge the tick to
+ * the current thread, and say whether it should be preempted: because
+ * its quantum is used up, in which case it also drops a level, or
+ * because a thread of higher priority is ready.
+ */
+bool
+thread_tick(void)
+{
+#if OPT_MLFQ
+	struct thread *cur;
+	unsigned level;
+	bool preempt;
+
+	cur = curthread;
+	preempt = false;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (curcpu->c_isidle) {
+		/* Nothing is running, and thread_yield does nothing */
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return false;
+	}
+
+	cur->t_mlfqticks++;
+	if (cur->t_mlfqticks >= MLFQ_QUANTUM(cur->t_mlfqlevel)) {
+		if (cur->t_mlfqlevel < MLFQ_NLEVELS - 1) {
+			cur->t_mlfqlevel++;
+		}
+		cur->t_mlfqticks = 0;
+		preempt = true;
+	}
+	else {
+		for (level=0; level<cur->t_mlfqlevel; level++) {
+			if (!threadlist_isempty(&curcpu->c_runqueue[level])) {
+				preempt = true;
+				break;
+			}
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	return preempt;
+#else
+	return true;
+#endif
 }
 
 /*
@@ -851,6 +1214,10 @@ schedule(void)
  * For here and now, because we know we're running on System/161 and
  * System/161 does not (yet) model such cache effects, we'll be very
  * aggressive.
+ *
+ * This only pushes threads away, every MIGRATE_HARDCLOCKS; a cpu that
+ * runs out of work doesn't wait for it, but pulls threads over
+ * itself with thread_steal().
  */
 void
 thread_consider_migration(void)
@@ -866,9 +1233,9 @@ thread_consider_migration(void)
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
 		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_count += runqueue_count(c);
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = runqueue_count(c);
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
@@ -882,7 +1249,7 @@ thread_consider_migration(void)
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+		t = runqueue_remtail(curcpu);
 		threadlist_addhead(&victims, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
@@ -893,7 +1260,7 @@ thread_consider_migration(void)
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
+		while (runqueue_count(c) < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
 			/*
 			 * Ordinarily, curthread will not appear on
@@ -924,7 +1291,7 @@ thread_consider_migration(void)
 			}
 
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			runqueue_add(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -948,7 +1315,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_add(curcpu, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -1090,6 +1457,49 @@ wchan_wakeall(struct wchan *wc)
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Move one thread sleeping on FROM over to TO, without waking it.
+ * Both channels are locked, always FROM first, so the thread can't be
+ * woken from either while it is between the two lists.
+ */
+void
+wchan_moveone(struct wchan *from, struct wchan *to)
+{
+	struct thread *target;
+
+	KASSERT(from != to);
+
+	spinlock_acquire(&from->wc_lock);
+	spinlock_acquire(&to->wc_lock);
+	target = threadlist_remhead(&from->wc_threads);
+	if (target != NULL) {
+		target->t_wchan_name = to->wc_name;
+		threadlist_addtail(&to->wc_threads, target);
+	}
+	spinlock_release(&to->wc_lock);
+	spinlock_release(&from->wc_lock);
+}
+
+/*
+ * Move all threads sleeping on FROM over to TO, without waking them.
+ */
+void
+wchan_moveall(struct wchan *from, struct wchan *to)
+{
+	struct thread *target;
+
+	KASSERT(from != to);
+
+	spinlock_acquire(&from->wc_lock);
+	spinlock_acquire(&to->wc_lock);
+	while ((target = threadlist_remhead(&from->wc_threads)) != NULL) {
+		target->t_wchan_name = to->wc_name;
+		threadlist_addtail(&to->wc_threads, target);
+	}
+	spinlock_release(&to->wc_lock);
+	spinlock_release(&from->wc_lock);
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -1162,6 +1572,23 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+unsigned
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i, n;
+	struct cpu *c;
+
+	n = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mapping);
+			n++;
+		}
+	}
+	return n;
+}
+
 void
 interprocessor_interrupt(void)
 {
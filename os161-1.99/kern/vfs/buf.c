@@ -0,0 +1,785 @@
+/*
+ * Buffer cache. See buf.h.
+ *
+ * There is a fixed pool of buffers. A buffer holding a block sits on
+ * the hash chain for its (device, block) pair. Every buffer is also on
+ * the LRU list, which runs from least to most recently released; when
+ * a block that isn't cached is asked for, the first buffer on the list
+ * that isn't busy is reused, after writing it out if it is dirty.
+ *
+ * buf_lock protects all of the bookkeeping. It is never held across
+ * I/O; the buffer is marked busy instead, and anybody else who wants
+ * it waits on buf_cv until it is released.
+ *
+ * I/O goes through dev_start, so buf_sync can hand the device all of
+ * its writes at once and let the driver put them in a good order.
+ * Likewise, when a dirty buffer has to be written to reuse it, the
+ * dirty blocks right after it go with it.
+ *
+ * buf_readahead starts a read and leaves the buffer not busy but with
+ * b_reading set. Whoever next marks it busy waits for the read to
+ * finish first (buf_claim).
+ *
+ * A pinned buffer is dirty but may not be written where it belongs
+ * yet, so buf_sync passes it over and it is never reused.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <clock.h>
+#include <thread.h>
+#include <vfs.h>
+#include <device.h>
+#include <buf.h>
+
+#define BUF_NBUFS	128	/* buffers in the cache */
+#define BUF_NHASH	64	/* hash chains */
+#define BUF_SYNCSECS	5	/* how often the syncer runs */
+#define BUF_CLUSTER	16	/* most blocks written together on reuse */
+
+struct buf {
+	struct device *b_dev;		/* NULL if holding nothing */
+	daddr_t b_block;
+	char *b_data;
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data is newer than the disk */
+	bool b_busy;			/* handed out, or doing I/O */
+	bool b_reading;			/* read-ahead not yet waited for */
+	bool b_pinned;			/* mustn't be written (buf_pin) */
+	int b_error;			/* last write-back failed with this */
+	struct devreq b_req;		/* I/O in progress */
+	struct semaphore *b_iosem;	/* V'd when b_req completes */
+	struct buf *b_hashnext;
+	struct buf *b_lruprev;
+	struct buf *b_lrunext;
+};
+
+static struct lock *buf_lock;
+static struct cv *buf_cv;
+
+static struct buf buf_pool[BUF_NBUFS];
+static struct buf *buf_hash[BUF_NHASH];
+static struct buf *buf_lruhead, *buf_lrutail;
+static unsigned buf_npinned;		/* buffers pinned */
+static unsigned buf_pinsreserved;	/* pins set aside */
+
+/* buf_sync's list, too big for the stack; one sync at a time uses it */
+static struct buf *buf_synclist[BUF_NBUFS];
+static bool buf_synclistbusy;
+
+#define BUF_HASH(dev, block) \
+	((((uintptr_t)(dev) >> 4) + (block)) % BUF_NHASH)
+
+////////////////////////////////////////////////////////////
+//
+// Lists
+
+static
+void
+buf_lruremove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buf_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buf_lrutail = b->b_lruprev;
+	}
+}
+
+static
+void
+buf_lruappend(struct buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = buf_lrutail;
+	if (buf_lrutail != NULL) {
+		buf_lrutail->b_lrunext = b;
+	}
+	else {
+		buf_lruhead = b;
+	}
+	buf_lrutail = b;
+}
+
+static
+void
+buf_hashadd(struct buf *b)
+{
+	unsigned h;
+
+	h = BUF_HASH(b->b_dev, b->b_block);
+	b->b_hashnext = buf_hash[h];
+	buf_hash[h] = b;
+}
+
+static
+void
+buf_hashremove(struct buf *b)
+{
+	struct buf **pp;
+
+	for (pp = &buf_hash[BUF_HASH(b->b_dev, b->b_block)];
+	     *pp != NULL; pp = &(*pp)->b_hashnext) {
+		if (*pp == b) {
+			*pp = b->b_hashnext;
+			return;
+		}
+	}
+	panic("buf: block %u not in hash table\n", b->b_block);
+}
+
+static
+struct buf *
+buf_lookup(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	for (b = buf_hash[BUF_HASH(dev, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// I/O
+
+/*
+ * Completion callback for buffer I/O.
+ */
+static
+void
+buf_iodone(struct devreq *dr, int result)
+{
+	struct buf *b = dr->dr_arg;
+
+	(void)result;
+	V(b->b_iosem);
+}
+
+/*
+ * Start reading or writing a buffer. The caller must have marked it
+ * busy and must wait for it with buf_iowait.
+ */
+static
+void
+buf_iostart(struct buf *b, enum uio_rw rw)
+{
+	int result;
+
+	KASSERT(b->b_busy || b->b_reading);
+
+	DEBUG(DB_SFS, "buf: %s %u\n", rw == UIO_READ ? "read" : "write",
+	      b->b_block);
+
+	b->b_req.dr_block = b->b_block;
+	b->b_req.dr_nblocks = 1;
+	b->b_req.dr_data = b->b_data;
+	b->b_req.dr_write = (rw == UIO_WRITE);
+	b->b_req.dr_done = buf_iodone;
+	b->b_req.dr_arg = b;
+	b->b_req.dr_result = 0;
+
+	result = dev_start(b->b_dev, &b->b_req);
+	if (result) {
+		/* It didn't start, so the callback won't happen. */
+		b->b_req.dr_result = result;
+		V(b->b_iosem);
+	}
+}
+
+/*
+ * Wait for I/O started by buf_iostart and return its result.
+ */
+static
+int
+buf_iowait(struct buf *b)
+{
+	int result;
+
+	P(b->b_iosem);
+	result = b->b_req.dr_result;
+	if (result == EINVAL) {
+		/*
+		 * This means the sector we requested was out of range,
+		 * or a couple of other things that are our fault.
+		 */
+		panic("buf: dev_start returned EINVAL\n");
+	}
+	return result;
+}
+
+/*
+ * Read or write a buffer. The caller must have marked it busy and
+ * must not hold buf_lock.
+ */
+static
+int
+buf_io(struct buf *b, enum uio_rw rw)
+{
+	int result;
+	int tries = 0;
+
+	KASSERT(b->b_busy);
+	KASSERT(!lock_do_i_hold(buf_lock));
+
+ retry:
+	buf_iostart(b, rw);
+	result = buf_iowait(b);
+	if (result == EIO) {
+		if (tries == 0) {
+			kprintf("buf: block %u I/O error, retrying\n",
+				b->b_block);
+		}
+		if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		kprintf("buf: block %u I/O error, giving up after "
+			"%d retries\n", b->b_block, tries);
+	}
+	return result;
+}
+
+/*
+ * Finish a read-ahead on a buffer the caller has just marked busy.
+ * Called with buf_lock held; returns true if it had to wait, in which
+ * case buf_lock was dropped in the meantime.
+ */
+static
+bool
+buf_claim(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_busy);
+
+	if (!b->b_reading) {
+		return false;
+	}
+
+	lock_release(buf_lock);
+	/* An error just leaves it invalid, to be read again if wanted */
+	if (buf_iowait(b) == 0) {
+		b->b_valid = true;
+	}
+	lock_acquire(buf_lock);
+	b->b_reading = false;
+	return true;
+}
+
+/*
+ * Write out LIST, N dirty buffers the caller has marked busy, all at
+ * once, and wait for them. Called with buf_lock held; drops it during
+ * the I/O. Unbusies the buffers when done and returns the first
+ * error.
+ */
+static
+int
+buf_writelist(struct buf **list, unsigned n)
+{
+	struct buf *b;
+	unsigned i;
+	int result, ret = 0;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	lock_release(buf_lock);
+	for (i=0; i<n; i++) {
+		KASSERT(list[i]->b_busy);
+		KASSERT(list[i]->b_dirty);
+		buf_iostart(list[i], UIO_WRITE);
+	}
+	for (i=0; i<n; i++) {
+		result = buf_iowait(list[i]);
+		if (result == EIO) {
+			/* Retry it the slow way */
+			result = buf_io(list[i], UIO_WRITE);
+		}
+		list[i]->b_req.dr_result = result;
+	}
+	lock_acquire(buf_lock);
+
+	for (i=0; i<n; i++) {
+		b = list[i];
+		result = b->b_req.dr_result;
+		if (result == 0) {
+			b->b_dirty = false;
+		}
+		else if (ret == 0) {
+			ret = result;
+		}
+		b->b_error = result;
+		b->b_busy = false;
+	}
+	cv_broadcast(buf_cv, buf_lock);
+
+	return ret;
+}
+
+/*
+ * Write out a dirty buffer so it can be reused, along with any dirty
+ * buffers for the blocks following it that aren't in use.
+ */
+static
+int
+buf_writecluster(struct buf *b)
+{
+	struct buf *list[BUF_CLUSTER];
+	struct buf *next;
+	unsigned n;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_dirty && !b->b_busy);
+
+	b->b_busy = true;
+	list[0] = b;
+	for (n=1; n<BUF_CLUSTER; n++) {
+		next = buf_lookup(b->b_dev, b->b_block + n);
+		if (next == NULL || !next->b_dirty || next->b_busy ||
+		    next->b_pinned) {
+			break;
+		}
+		next->b_busy = true;
+		list[n] = next;
+	}
+	return buf_writelist(list, n);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Getting and releasing buffers
+
+/*
+ * Find or make the buffer for BLOCK of DEV, and mark it busy. If it
+ * isn't cached, read it if DOREAD is set, and zero it otherwise.
+ */
+static
+int
+buf_find(struct device *dev, daddr_t block, bool doread, struct buf **ret)
+{
+	struct buf *b, *failed;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUF_SIZE);
+
+	lock_acquire(buf_lock);
+ again:
+	b = buf_lookup(dev, block);
+	if (b != NULL) {
+		if (b->b_busy) {
+			cv_wait(buf_cv, buf_lock);
+			goto again;
+		}
+		b->b_busy = true;
+		buf_claim(b);
+	}
+	else {
+		/*
+		 * Not cached; reuse the least recently used buffer.
+		 * Pass over ones we couldn't write back last time;
+		 * the error belongs to their blocks, and buf_sync
+		 * keeps trying them.
+		 */
+		failed = NULL;
+		for (b = buf_lruhead; b != NULL; b = b->b_lrunext) {
+			if (b->b_busy || b->b_pinned) {
+				continue;
+			}
+			if (b->b_error == 0) {
+				break;
+			}
+			if (failed == NULL) {
+				failed = b;
+			}
+		}
+		if (b == NULL && failed != NULL) {
+			/*
+			 * Nothing else to take. Try writing one of those
+			 * again, and only give up if that fails too.
+			 */
+			result = buf_writecluster(failed);
+			if (result) {
+				lock_release(buf_lock);
+				return result;
+			}
+			goto again;
+		}
+		if (b == NULL) {
+			cv_wait(buf_cv, buf_lock);
+			goto again;
+		}
+		if (b->b_dirty) {
+			/*
+			 * Write it out first. Since that sleeps, the
+			 * block we want might have shown up by the time
+			 * we're done, so start over. If the write fails,
+			 * the buffer is marked and we'll pick another.
+			 */
+			(void)buf_writecluster(b);
+			goto again;
+		}
+		b->b_busy = true;
+		if (buf_claim(b)) {
+			/* Same here */
+			b->b_busy = false;
+			cv_broadcast(buf_cv, buf_lock);
+			goto again;
+		}
+
+		if (b->b_dev != NULL) {
+			buf_hashremove(b);
+		}
+		b->b_dev = dev;
+		b->b_block = block;
+		b->b_valid = false;
+		buf_hashadd(b);
+	}
+
+	if (!b->b_valid) {
+		if (doread) {
+			lock_release(buf_lock);
+			result = buf_io(b, UIO_READ);
+			lock_acquire(buf_lock);
+			if (result) {
+				buf_hashremove(b);
+				b->b_dev = NULL;
+				b->b_busy = false;
+				cv_broadcast(buf_cv, buf_lock);
+				lock_release(buf_lock);
+				return result;
+			}
+		}
+		else {
+			bzero(b->b_data, BUF_SIZE);
+		}
+		b->b_valid = true;
+	}
+	lock_release(buf_lock);
+
+	*ret = b;
+	return 0;
+}
+
+int
+buf_read(struct device *dev, daddr_t block, struct buf **ret)
+{
+	return buf_find(dev, block, true, ret);
+}
+
+int
+buf_get(struct device *dev, daddr_t block, struct buf **ret)
+{
+	return buf_find(dev, block, false, ret);
+}
+
+void
+buf_readahead(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	KASSERT(dev->d_blocksize == BUF_SIZE);
+
+	lock_acquire(buf_lock);
+	if (buf_lookup(dev, block) != NULL) {
+		/* Already have it, or it's on its way */
+		lock_release(buf_lock);
+		return;
+	}
+
+	/*
+	 * Take the least recently used buffer that can be reused
+	 * without waiting; if there isn't one, don't bother.
+	 */
+	for (b = buf_lruhead; b != NULL; b = b->b_lrunext) {
+		if (!b->b_busy && !b->b_dirty && !b->b_reading) {
+			break;
+		}
+	}
+	if (b == NULL) {
+		lock_release(buf_lock);
+		return;
+	}
+
+	if (b->b_dev != NULL) {
+		buf_hashremove(b);
+	}
+	b->b_dev = dev;
+	b->b_block = block;
+	b->b_valid = false;
+	b->b_reading = true;
+	buf_hashadd(b);
+
+	/* It's about to be used; don't let more read-ahead take it */
+	buf_lruremove(b);
+	buf_lruappend(b);
+	lock_release(buf_lock);
+
+	buf_iostart(b, UIO_READ);
+}
+
+void *
+buf_data(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+void
+buf_markdirty(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_dirty = true;
+}
+
+bool
+buf_pin(struct buf *b)
+{
+	bool ret;
+
+	lock_acquire(buf_lock);
+	KASSERT(b->b_busy);
+	ret = !b->b_pinned;
+	if (ret) {
+		KASSERT(buf_npinned < buf_pinsreserved);
+		buf_npinned++;
+		b->b_pinned = true;
+	}
+	b->b_dirty = true;
+	lock_release(buf_lock);
+	return ret;
+}
+
+void
+buf_unpin(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_busy);
+	KASSERT(b->b_pinned);
+	b->b_pinned = false;
+	buf_npinned--;
+	lock_release(buf_lock);
+}
+
+int
+buf_reservepins(unsigned n)
+{
+	int result = 0;
+
+	lock_acquire(buf_lock);
+	if (buf_pinsreserved + n > BUF_MAXPINNED) {
+		result = ENOSPC;
+	}
+	else {
+		buf_pinsreserved += n;
+	}
+	lock_release(buf_lock);
+	return result;
+}
+
+void
+buf_unreservepins(unsigned n)
+{
+	lock_acquire(buf_lock);
+	KASSERT(buf_pinsreserved >= n);
+	buf_pinsreserved -= n;
+	KASSERT(buf_npinned <= buf_pinsreserved);
+	lock_release(buf_lock);
+}
+
+void
+buf_release(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	buf_lruremove(b);
+	buf_lruappend(b);
+	cv_broadcast(buf_cv, buf_lock);
+	lock_release(buf_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Syncing
+
+int
+buf_sync(struct device *dev)
+{
+	struct buf *b;
+	unsigned i, n;
+	int result, ret;
+
+	lock_acquire(buf_lock);
+
+	/*
+	 * First write everything that isn't in use, all at once, and
+	 * wait for it. This only ever waits for its own I/O, so
+	 * another sync waiting for the list can't deadlock with it.
+	 */
+	while (buf_synclistbusy) {
+		cv_wait(buf_cv, buf_lock);
+	}
+	buf_synclistbusy = true;
+	n = 0;
+	for (i=0; i<BUF_NBUFS; i++) {
+		b = &buf_pool[i];
+		if (b->b_dev == NULL || !b->b_dirty || b->b_busy ||
+		    b->b_pinned || (dev != NULL && b->b_dev != dev)) {
+			continue;
+		}
+		b->b_busy = true;
+		buf_synclist[n++] = b;
+	}
+	ret = buf_writelist(buf_synclist, n);
+	buf_synclistbusy = false;
+	cv_broadcast(buf_cv, buf_lock);
+
+	/* Now the ones that were busy; wait for each of them. */
+	for (i=0; i<BUF_NBUFS; i++) {
+		b = &buf_pool[i];
+		for (;;) {
+			if (b->b_dev == NULL || !b->b_dirty || b->b_pinned ||
+			    (dev != NULL && b->b_dev != dev)) {
+				break;
+			}
+			if (b->b_busy) {
+				cv_wait(buf_cv, buf_lock);
+				continue;
+			}
+			b->b_busy = true;
+			result = buf_writelist(&b, 1);
+			if (result && ret == 0) {
+				ret = result;
+			}
+			break;
+		}
+	}
+	lock_release(buf_lock);
+
+	return ret;
+}
+
+void
+buf_discard(struct device *dev)
+{
+	struct buf *b;
+	unsigned i;
+
+	lock_acquire(buf_lock);
+	for (i=0; i<BUF_NBUFS; i++) {
+		b = &buf_pool[i];
+		if (b->b_dev != dev) {
+			continue;
+		}
+		KASSERT(!b->b_busy);
+		KASSERT(!b->b_pinned);
+		b->b_dirty = false;
+		b->b_error = 0;
+	}
+	lock_release(buf_lock);
+}
+
+void
+buf_purge(struct device *dev)
+{
+	struct buf *b;
+	unsigned i;
+
+	lock_acquire(buf_lock);
+	for (i=0; i<BUF_NBUFS; i++) {
+		b = &buf_pool[i];
+		if (b->b_dev != dev) {
+			continue;
+		}
+		KASSERT(!b->b_busy);
+		KASSERT(!b->b_dirty);
+		KASSERT(!b->b_pinned);
+		if (b->b_reading) {
+			b->b_busy = true;
+			buf_claim(b);
+			b->b_busy = false;
+		}
+		buf_hashremove(b);
+		b->b_dev = NULL;
+		b->b_valid = false;
+	}
+	lock_release(buf_lock);
+}
+
+/*
+ * The syncer: push everything to disk every so often, so that
+ * write-back doesn't mean a crash can lose everything.
+ */
+static
+void
+buf_syncer(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	for (;;) {
+		clocksleep(BUF_SYNCSECS);
+		vfs_sync();
+	}
+}
+
+void
+buf_bootstrap(void)
+{
+	struct buf *b;
+	unsigned i;
+	int result;
+
+	buf_lock = lock_create("buf");
+	buf_cv = cv_create("buf");
+	if (buf_lock == NULL || buf_cv == NULL) {
+		panic("buf: out of memory\n");
+	}
+
+	for (i=0; i<BUF_NHASH; i++) {
+		buf_hash[i] = NULL;
+	}
+	buf_lruhead = buf_lrutail = NULL;
+	buf_npinned = 0;
+	buf_pinsreserved = 0;
+	buf_synclistbusy = false;
+
+	for (i=0; i<BUF_NBUFS; i++) {
+		b = &buf_pool[i];
+		b->b_data = kmalloc(BUF_SIZE);
+		if (b->b_data == NULL) {
+			panic("buf: out of memory\n");
+		}
+		b->b_dev = NULL;
+		b->b_block = 0;
+		b->b_valid = false;
+		b->b_dirty = false;
+		b->b_busy = false;
+		b->b_reading = false;
+		b->b_pinned = false;
+		b->b_error = 0;
+		b->b_iosem = sem_create("buf", 0);
+		if (b->b_iosem == NULL) {
+			panic("buf: out of memory\n");
+		}
+		b->b_hashnext = NULL;
+		buf_lruappend(b);
+	}
+
+	result = thread_fork("syncer", NULL, buf_syncer, NULL, 0);
+	if (result) {
+		panic("buf: cannot start syncer: %s\n", strerror(result));
+	}
+}
@@ -0,0 +1,305 @@
+/*
+ * Name cache. See dcache.h.
+ *
+ * There is a fixed pool of entries. An entry in use sits on the hash
+ * chain for its (directory, name) pair. Every entry is also on the LRU
+ * list, which runs from least to most recently used, with unused
+ * entries at the front; dcache_enter takes the first entry on the
+ * list.
+ *
+ * dcache_lock protects everything. It's a spinlock, so references
+ * can be added under it but never dropped: VOP_DECREF can reclaim the
+ * vnode, which sleeps. Entries are taken off the lists under the lock
+ * and their references released after it's dropped.
+ *
+ * The cache can't tell whether what it holds is still true; callers
+ * must hold whatever lock keeps the directory from changing between
+ * searching it and entering the result.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vnode.h>
+#include <dcache.h>
+
+#define DCACHE_NENTRIES	256	/* entries in the cache */
+#define DCACHE_NHASH	128	/* hash chains */
+#define DCACHE_NAMELEN	32	/* longest name cached, plus one */
+
+struct dcentry {
+	struct vnode *dc_dir;		/* NULL if unused */
+	struct vnode *dc_vn;		/* NULL for a negative entry */
+	char dc_name[DCACHE_NAMELEN];
+	struct dcentry *dc_hashnext;
+	struct dcentry *dc_lruprev;
+	struct dcentry *dc_lrunext;
+};
+
+static struct spinlock dcache_lock = SPINLOCK_INITIALIZER;
+
+static struct dcentry dcache_pool[DCACHE_NENTRIES];
+static struct dcentry *dcache_hash[DCACHE_NHASH];
+static struct dcentry *dcache_lruhead, *dcache_lrutail;
+
+static
+unsigned
+dcache_hashfunc(struct vnode *dir, const char *name)
+{
+	unsigned h = (uintptr_t)dir >> 4;
+
+	while (*name) {
+		h = h * 33 + (unsigned char)*name++;
+	}
+	return h % DCACHE_NHASH;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Lists
+
+static
+void
+dcache_lruremove(struct dcentry *dc)
+{
+	if (dc->dc_lruprev != NULL) {
+		dc->dc_lruprev->dc_lrunext = dc->dc_lrunext;
+	}
+	else {
+		dcache_lruhead = dc->dc_lrunext;
+	}
+	if (dc->dc_lrunext != NULL) {
+		dc->dc_lrunext->dc_lruprev = dc->dc_lruprev;
+	}
+	else {
+		dcache_lrutail = dc->dc_lruprev;
+	}
+}
+
+static
+void
+dcache_lruappend(struct dcentry *dc)
+{
+	dc->dc_lrunext = NULL;
+	dc->dc_lruprev = dcache_lrutail;
+	if (dcache_lrutail != NULL) {
+		dcache_lrutail->dc_lrunext = dc;
+	}
+	else {
+		dcache_lruhead = dc;
+	}
+	dcache_lrutail = dc;
+}
+
+static
+void
+dcache_lruprepend(struct dcentry *dc)
+{
+	dc->dc_lruprev = NULL;
+	dc->dc_lrunext = dcache_lruhead;
+	if (dcache_lruhead != NULL) {
+		dcache_lruhead->dc_lruprev = dc;
+	}
+	else {
+		dcache_lrutail = dc;
+	}
+	dcache_lruhead = dc;
+}
+
+static
+struct dcentry *
+dcache_find(struct vnode *dir, const char *name)
+{
+	struct dcentry *dc;
+
+	for (dc = dcache_hash[dcache_hashfunc(dir, name)]; dc != NULL;
+	     dc = dc->dc_hashnext) {
+		if (dc->dc_dir == dir && !strcmp(dc->dc_name, name)) {
+			return dc;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take an entry out of use. Its references are handed back in *DIR
+ * and *VN for the caller to drop once dcache_lock is released.
+ */
+static
+void
+dcache_kill(struct dcentry *dc, struct vnode **dir, struct vnode **vn)
+{
+	struct dcentry **pp;
+
+	KASSERT(spinlock_do_i_hold(&dcache_lock));
+	KASSERT(dc->dc_dir != NULL);
+
+	for (pp = &dcache_hash[dcache_hashfunc(dc->dc_dir, dc->dc_name)];
+	     *pp != dc; pp = &(*pp)->dc_hashnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = dc->dc_hashnext;
+
+	*dir = dc->dc_dir;
+	*vn = dc->dc_vn;
+	dc->dc_dir = NULL;
+	dc->dc_vn = NULL;
+	dc->dc_hashnext = NULL;
+
+	/* reuse it first */
+	dcache_lruremove(dc);
+	dcache_lruprepend(dc);
+}
+
+/*
+ * Drop the references dcache_kill handed back.
+ */
+static
+void
+dcache_release(struct vnode *dir, struct vnode *vn)
+{
+	KASSERT(!spinlock_do_i_hold(&dcache_lock));
+
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+bool
+dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct dcentry *dc;
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return false;
+	}
+
+	spinlock_acquire(&dcache_lock);
+	dc = dcache_find(dir, name);
+	if (dc == NULL) {
+		spinlock_release(&dcache_lock);
+		return false;
+	}
+	if (dc->dc_vn != NULL) {
+		VOP_INCREF(dc->dc_vn);
+	}
+	*ret = dc->dc_vn;
+	dcache_lruremove(dc);
+	dcache_lruappend(dc);
+	spinlock_release(&dcache_lock);
+
+	return true;
+}
+
+void
+dcache_enter(struct vnode *dir, const char *name, struct vnode *vn)
+{
+	struct dcentry *dc;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+	unsigned h;
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return;
+	}
+
+	spinlock_acquire(&dcache_lock);
+	dc = dcache_find(dir, name);
+	if (dc == NULL) {
+		dc = dcache_lruhead;
+		KASSERT(dc != NULL);
+	}
+	if (dc->dc_dir != NULL) {
+		dcache_kill(dc, &olddir, &oldvn);
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	dc->dc_dir = dir;
+	dc->dc_vn = vn;
+	strcpy(dc->dc_name, name);
+
+	h = dcache_hashfunc(dir, name);
+	dc->dc_hashnext = dcache_hash[h];
+	dcache_hash[h] = dc;
+
+	dcache_lruremove(dc);
+	dcache_lruappend(dc);
+	spinlock_release(&dcache_lock);
+
+	dcache_release(olddir, oldvn);
+}
+
+void
+dcache_remove(struct vnode *dir, const char *name)
+{
+	struct dcentry *dc;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return;
+	}
+
+	spinlock_acquire(&dcache_lock);
+	dc = dcache_find(dir, name);
+	if (dc != NULL) {
+		dcache_kill(dc, &olddir, &oldvn);
+	}
+	spinlock_release(&dcache_lock);
+
+	dcache_release(olddir, oldvn);
+}
+
+void
+dcache_purgefs(struct fs *fs)
+{
+	struct dcentry *dc;
+	struct vnode *olddir, *oldvn;
+	unsigned i;
+
+	/*
+	 * Dropping references can't be done under the lock, so take
+	 * the entries one at a time.
+	 */
+	for (i=0; i<DCACHE_NENTRIES; i++) {
+		dc = &dcache_pool[i];
+		olddir = oldvn = NULL;
+
+		spinlock_acquire(&dcache_lock);
+		if (dc->dc_dir != NULL && dc->dc_dir->vn_fs == fs) {
+			dcache_kill(dc, &olddir, &oldvn);
+		}
+		spinlock_release(&dcache_lock);
+
+		dcache_release(olddir, oldvn);
+	}
+}
+
+void
+dcache_bootstrap(void)
+{
+	struct dcentry *dc;
+	unsigned i;
+
+	for (i=0; i<DCACHE_NHASH; i++) {
+		dcache_hash[i] = NULL;
+	}
+	dcache_lruhead = dcache_lrutail = NULL;
+
+	for (i=0; i<DCACHE_NENTRIES; i++) {
+		dc = &dcache_pool[i];
+		dc->dc_dir = NULL;
+		dc->dc_vn = NULL;
+		dc->dc_name[0] = 0;
+		dc->dc_hashnext = NULL;
+		dcache_lruappend(dc);
+	}
+}
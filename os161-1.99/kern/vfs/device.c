@@ -463,3 +463,29 @@ dev_create_vnode(struct device *dev)
 
 	return v;
 }
+
+/*
+ * Start a transfer on a device (see device.h). Devices that can't
+ * queue requests get them done right away through d_io.
+ */
+int
+dev_start(struct device *d, struct devreq *dr)
+{
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	KASSERT(dr->dr_nblocks > 0);
+
+	if (d->d_start != NULL) {
+		return d->d_start(d, dr);
+	}
+
+	uio_kinit(&iov, &u, dr->dr_data, dr->dr_nblocks * d->d_blocksize,
+		  (off_t)dr->dr_block * d->d_blocksize,
+		  dr->dr_write ? UIO_WRITE : UIO_READ);
+	result = d->d_io(d, &u);
+	dr->dr_result = result;
+	dr->dr_done(dr, result);
+	return 0;
+}
@@ -0,0 +1,279 @@
+/*
+ * Address spaces for the paging VM system.
+ *
+ * An address space is a handful of regions defined by the executable,
+ * a fixed-size stack at the top of user memory, and a page table of
+ * the pages that are actually resident or swapped out. Nothing is read from the
+ * executable at load time: load_elf only tells us where each region
+ * lives in the file (as_map_segment) and vm_fault brings pages in as
+ * they are touched. The TLB side of things (as_activate and friends)
+ * is in vm.c.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vnode.h>
+#include <copyinout.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <vm.h>
+
+static
+void
+as_initsegment(struct segment *seg, vaddr_t vbase, size_t npages,
+	       bool writeable)
+{
+	seg->seg_vbase = vbase;
+	seg->seg_npages = npages;
+	seg->seg_writeable = writeable;
+	seg->seg_filevaddr = vbase;
+	seg->seg_fileoffset = 0;
+	seg->seg_filesize = 0;
+}
+
+struct addrspace *
+as_create(void)
+{
+	struct addrspace *as;
+
+	as = kmalloc(sizeof(struct addrspace));
+	if (as == NULL) {
+		return NULL;
+	}
+
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+
+	as->as_lock = lock_create("addrspace");
+	if (as->as_lock == NULL) {
+		pt_destroy(as->as_pt);
+		kfree(as);
+		return NULL;
+	}
+
+	as->as_nregions = 0;
+	as_initsegment(&as->as_stack, USERSTACK - VM_STACKPAGES * PAGE_SIZE,
+		       VM_STACKPAGES, true);
+	as->as_vnode = NULL;
+	as->as_asid = 0;
+	as->as_asidgen = 0;
+
+	return as;
+}
+
+void
+as_destroy(struct addrspace *as)
+{
+	lock_acquire(vm_evictlock);
+	pt_destroy(as->as_pt);
+	lock_release(vm_evictlock);
+	if (as->as_vnode != NULL) {
+		VOP_DECREF(as->as_vnode);
+	}
+	lock_destroy(as->as_lock);
+	kfree(as);
+}
+
+int
+as_copy(struct addrspace *old, struct addrspace **ret)
+{
+	struct addrspace *new;
+	unsigned i;
+	int result;
+
+	new = as_create();
+	if (new == NULL) {
+		return ENOMEM;
+	}
+
+	for (i=0; i<old->as_nregions; i++) {
+		new->as_regions[i] = old->as_regions[i];
+	}
+	new->as_nregions = old->as_nregions;
+	new->as_stack = old->as_stack;
+
+	if (old->as_vnode != NULL) {
+		VOP_INCREF(old->as_vnode);
+		new->as_vnode = old->as_vnode;
+	}
+
+	lock_acquire(old->as_lock);
+	result = pt_copy(old->as_pt, new->as_pt);
+	/*
+	 * Every page is now shared copy-on-write, so the writeable
+	 * translations the old address space has loaded must go.
+	 */
+	as_flushtlb(old);
+	lock_release(old->as_lock);
+	if (result) {
+		as_destroy(new);
+		return result;
+	}
+
+	*ret = new;
+	return 0;
+}
+
+struct segment *
+as_findsegment(struct addrspace *as, vaddr_t vaddr)
+{
+	struct segment *seg;
+	unsigned i;
+
+	for (i=0; i<as->as_nregions; i++) {
+		seg = &as->as_regions[i];
+		if (vaddr >= seg->seg_vbase &&
+		    vaddr < seg->seg_vbase + seg->seg_npages * PAGE_SIZE) {
+			return seg;
+		}
+	}
+
+	seg = &as->as_stack;
+	if (vaddr >= seg->seg_vbase &&
+	    vaddr < seg->seg_vbase + seg->seg_npages * PAGE_SIZE) {
+		return seg;
+	}
+
+	return NULL;
+}
+
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable)
+{
+	size_t npages;
+
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	npages = sz / PAGE_SIZE;
+
+	/* Everything mapped is readable; only writeability matters. */
+	(void)readable;
+	(void)executable;
+
+	if (vaddr + sz > as->as_stack.seg_vbase) {
+		return EFAULT;
+	}
+
+	if (as->as_nregions == AS_MAXREGIONS) {
+		kprintf("vm: Warning: too many regions\n");
+		return EUNIMP;
+	}
+
+	as_initsegment(&as->as_regions[as->as_nregions], vaddr, npages,
+		       writeable != 0);
+	as->as_nregions++;
+	return 0;
+}
+
+int
+as_map_segment(struct addrspace *as, struct vnode *v, off_t offset,
+	       vaddr_t vaddr, size_t filesize)
+{
+	struct segment *seg;
+
+	seg = as_findsegment(as, vaddr);
+	if (seg == NULL || seg == &as->as_stack) {
+		return EFAULT;
+	}
+	if (vaddr + filesize > seg->seg_vbase + seg->seg_npages * PAGE_SIZE) {
+		return EFAULT;
+	}
+
+	if (as->as_vnode == NULL) {
+		VOP_INCREF(v);
+		as->as_vnode = v;
+	}
+	KASSERT(as->as_vnode == v);
+
+	seg->seg_filevaddr = vaddr;
+	seg->seg_fileoffset = offset;
+	seg->seg_filesize = filesize;
+	return 0;
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+	/* Nothing to allocate; pages show up in vm_fault. */
+	(void)as;
+	return 0;
+}
+
+int
+as_complete_load(struct addrspace *as)
+{
+	(void)as;
+	return 0;
+}
+
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr, char** args, unsigned argc)
+{
+	(void)as;
+
+	*stackptr = USERSTACK - 128;
+
+	uint32_t args_start = USERSTACK - 128 + 4*(argc+1); // 1 for NULL after args pointers
+	uint32_t null_bytes = 0;
+	int fatal = copyout((void*)&null_bytes, (userptr_t)args_start-4, 4);
+	if (fatal) {
+		return fatal;
+	}
+	for (unsigned i = 0; i<argc; i++) {
+		size_t actual;
+		fatal = copyoutstr(args[i], (userptr_t)args_start, 128, &actual);
+		if (fatal) {
+			return fatal;
+		}
+		fatal = copyout((void*)(&args_start), (userptr_t)(*stackptr+i*4), 4);
+		if (fatal) {
+			return fatal;
+		}
+
+		args_start+=actual;
+	}
+
+	return 0;
+}
+
+int
+as_build_stack(struct addrspace *as, vaddr_t *stackptr, char* args, size_t argc)
+{
+	(void)as;
+
+	*stackptr = USERSTACK;
+
+	size_t actual = 0;
+	uint32_t args_start = USERSTACK - 128 + 4*(argc+1); // 1 for NULL after args pointers
+	uint32_t null_bytes = 0;
+	int fatal = copyout((void*)&null_bytes, (userptr_t)args_start-4, 4);
+	if (fatal) {
+		return fatal;
+	}
+	size_t total_len = 0;
+	for (size_t i = 0; i<argc; i++) {
+		fatal = copyout((void*)(&args_start), (userptr_t)USERSTACK-128+(i)*4, 4);
+		if (fatal) {
+			return fatal;
+		}
+		fatal = copyoutstr(args+total_len, (userptr_t)args_start, 128, &actual);
+		if (fatal) {
+			return fatal;
+		}
+		args_start+=actual;
+		total_len+=actual;
+	}
+
+	return 0;
+}
@@ -0,0 +1,583 @@
+/*
+ * The coremap: one entry per physical frame it manages, which is all
+ * of the memory ram_getsize reports except the first few frames. Those
+ * hold the entries themselves and have none; entry 0 is the frame
+ * after them.
+ * Free frames are managed by a binary buddy allocator: free blocks of
+ * 2^k frames (aligned on 2^k, counting from the first managed frame)
+ * sit on one doubly-linked free list per order, threaded through the
+ * coremap entries of their first frames. Allocating or freeing is
+ * O(log n) and never scans the map.
+ *
+ * Callers ask for exact page counts. A request is carved out of the
+ * smallest block that fits and the unused tail is handed straight
+ * back, so a 3-page allocation costs 3 frames. The first entry of an
+ * allocation records its length so that freeppages knows how much to
+ * give back.
+ *
+ * Single-frame allocations, which are nearly all of them (user pages,
+ * kmalloc's subpage pools, page tables), are served from a small
+ * per-cpu cache of free frames that is refilled and drained in
+ * batches. Such allocations only take coremap_lock once per batch.
+ * Frames sitting in a cache look allocated to the buddy allocator.
+ *
+ * User pages are reference counted so that fork can share them
+ * copy-on-write; the frame is released when the last address space
+ * mapping it lets go.
+ *
+ * For the pager, a user page also remembers which address space maps
+ * it and where, plus referenced and dirty bits that vm_fault keeps up
+ * to date. The hardware has no referenced bit, so "referenced" means
+ * "took a TLB miss since the clock hand last went by". Only a page
+ * with exactly one mapping and a known owner can be evicted; shared
+ * pages stay put until the sharing ends and the survivor touches them.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <coremap.h>
+
+/* Largest block the buddy allocator manages: 2^10 frames = 4M */
+#define CM_MAXORDER	10
+#define CM_NORDERS	(CM_MAXORDER + 1)
+
+/* End-of-list marker and "not a free block head" marker */
+#define CM_NIL		((unsigned)-1)
+#define CM_NOTHEAD	(-1)
+
+/*
+ * Frames user pages can't have, so that the kernel can still allocate
+ * (thread stacks, page tables) once user pages have filled memory.
+ * Past this point user pages come from evicting other user pages.
+ */
+#define CM_KRESERVE	32
+
+/* How many frames move between a cpu cache and the coremap at once */
+#define CM_CACHEBATCH	(CPU_PAGECACHE_MAX / 2)
+
+struct coremap_entry {
+	bool cme_used;			/* frame is allocated */
+	int cme_order;			/* order if head of a free block */
+	unsigned cme_next;		/* free list links; free heads only */
+	unsigned cme_prev;
+	unsigned cme_npages;		/* run length; first frame only */
+	unsigned cme_refcount;		/* page tables mapping a user page */
+	struct addrspace *cme_as;	/* sole mapping, or NULL if unknown */
+	vaddr_t cme_vaddr;
+	bool cme_referenced;		/* faulted on since last clock sweep */
+	bool cme_dirty;			/* differs from its backing store */
+};
+
+/* Protects everything below. */
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+static struct coremap_entry *coremap;
+static paddr_t coremap_base;		/* paddr of the frame for coremap[0] */
+static unsigned long coremap_npages;	/* number of entries */
+static bool coremap_ready = false;
+
+static unsigned coremap_freelist[CM_NORDERS];
+static unsigned long coremap_nfree;	/* frames on the free lists */
+static unsigned coremap_hand;		/* clock hand for eviction */
+
+#define CM_PADDR(i)	(coremap_base + (paddr_t)(i) * PAGE_SIZE)
+#define CM_INDEX(pa)	(((pa) - coremap_base) / PAGE_SIZE)
+
+static
+void
+coremap_listadd(unsigned i, int order)
+{
+	unsigned head;
+
+	head = coremap_freelist[order];
+	coremap[i].cme_order = order;
+	coremap[i].cme_prev = CM_NIL;
+	coremap[i].cme_next = head;
+	if (head != CM_NIL) {
+		coremap[head].cme_prev = i;
+	}
+	coremap_freelist[order] = i;
+}
+
+static
+void
+coremap_listremove(unsigned i)
+{
+	struct coremap_entry *cme;
+
+	cme = &coremap[i];
+	KASSERT(cme->cme_order != CM_NOTHEAD);
+	if (cme->cme_prev == CM_NIL) {
+		coremap_freelist[cme->cme_order] = cme->cme_next;
+	}
+	else {
+		coremap[cme->cme_prev].cme_next = cme->cme_next;
+	}
+	if (cme->cme_next != CM_NIL) {
+		coremap[cme->cme_next].cme_prev = cme->cme_prev;
+	}
+	cme->cme_order = CM_NOTHEAD;
+}
+
+/*
+ * Free the block of 2^ORDER frames starting at I, merging it with its
+ * buddy for as long as the buddy is free too.
+ */
+static
+void
+coremap_freeblock(unsigned i, int order)
+{
+	unsigned buddy, j;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	for (j=i; j<i+(1U << order); j++) {
+		KASSERT(coremap[j].cme_used);
+		coremap[j].cme_used = false;
+		coremap[j].cme_npages = 0;
+		coremap[j].cme_refcount = 0;
+	}
+	coremap_nfree += 1UL << order;
+
+	while (order < CM_MAXORDER) {
+		buddy = i ^ (1U << order);
+		if (buddy + (1U << order) > coremap_npages ||
+		    coremap[buddy].cme_used ||
+		    coremap[buddy].cme_order != order) {
+			break;
+		}
+		coremap_listremove(buddy);
+		if (buddy < i) {
+			i = buddy;
+		}
+		order++;
+	}
+	coremap_listadd(i, order);
+}
+
+/*
+ * Free an arbitrary run of frames [START, END) by splitting it into
+ * the largest aligned blocks it contains.
+ */
+static
+void
+coremap_freerange(unsigned start, unsigned end)
+{
+	int order;
+
+	while (start < end) {
+		order = 0;
+		while (order < CM_MAXORDER &&
+		       (start & ((2U << order) - 1)) == 0 &&
+		       start + (2U << order) <= end) {
+			order++;
+		}
+		coremap_freeblock(start, order);
+		start += 1U << order;
+	}
+}
+
+/*
+ * Allocate NPAGES frames in a row. Returns the index of the first
+ * one, or CM_NIL.
+ */
+static
+unsigned
+coremap_allocrun(unsigned long npages)
+{
+	int order, k;
+	unsigned i, j;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	order = 0;
+	while ((1UL << order) < npages) {
+		order++;
+	}
+	if (order > CM_MAXORDER) {
+		return CM_NIL;
+	}
+
+	for (k=order; k<CM_NORDERS; k++) {
+		if (coremap_freelist[k] != CM_NIL) {
+			break;
+		}
+	}
+	if (k == CM_NORDERS) {
+		return CM_NIL;
+	}
+
+	i = coremap_freelist[k];
+	coremap_listremove(i);
+	coremap_nfree -= 1UL << k;
+	for (j=i; j<i+(1U << k); j++) {
+		coremap[j].cme_used = true;
+	}
+
+	/* Give back everything past what was asked for. */
+	coremap_freerange(i + npages, i + (1U << k));
+
+	coremap[i].cme_npages = npages;
+	return i;
+}
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t lo, hi;
+	unsigned long npages, cmpages, i;
+	int k;
+
+	ram_getsize(&lo, &hi);
+	npages = (hi - lo) / PAGE_SIZE;
+
+	/*
+	 * The entries take the first frames of the range, and the map
+	 * starts after them, at coremap_base; it doesn't describe its
+	 * own frames, which are never freed. Sizing it for the whole
+	 * range is simpler and leaves only a few entries unused.
+	 */
+	cmpages = (npages * sizeof(struct coremap_entry) + PAGE_SIZE - 1)
+		/ PAGE_SIZE;
+	KASSERT(cmpages < npages);
+
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(lo);
+	coremap_base = lo + cmpages * PAGE_SIZE;
+	coremap_npages = npages - cmpages;
+
+	for (k=0; k<CM_NORDERS; k++) {
+		coremap_freelist[k] = CM_NIL;
+	}
+	for (i=0; i<coremap_npages; i++) {
+		coremap[i].cme_used = true;
+		coremap[i].cme_order = CM_NOTHEAD;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_as = NULL;
+	}
+	coremap_hand = 0;
+	coremap_nfree = 0;
+
+	spinlock_acquire(&coremap_lock);
+	coremap_freerange(0, coremap_npages);
+	coremap_ready = true;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Take a frame from this cpu's cache. Returns 0 if it is empty.
+ * Interrupts are kept off so we can't migrate halfway through.
+ */
+static
+paddr_t
+coremap_cacheget(void)
+{
+	struct cpu *c;
+	paddr_t pa;
+	int spl;
+
+	pa = 0;
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_npagecache > 0) {
+		pa = c->c_pagecache[--c->c_npagecache];
+	}
+	splx(spl);
+	return pa;
+}
+
+/*
+ * Put a free frame in this cpu's cache, returning half the cache to
+ * the coremap first if it is full.
+ */
+static
+void
+coremap_cacheput(paddr_t pa)
+{
+	struct cpu *c;
+	paddr_t oldpa;
+	unsigned i;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_npagecache == CPU_PAGECACHE_MAX) {
+		spinlock_acquire(&coremap_lock);
+		for (i=0; i<CM_CACHEBATCH; i++) {
+			oldpa = c->c_pagecache[--c->c_npagecache];
+			coremap_freeblock(CM_INDEX(oldpa), 0);
+		}
+		spinlock_release(&coremap_lock);
+	}
+	c->c_pagecache[c->c_npagecache++] = pa;
+	splx(spl);
+}
+
+paddr_t
+getppages(unsigned long npages)
+{
+	struct cpu *c;
+	unsigned i;
+	paddr_t pa;
+
+	KASSERT(npages > 0);
+
+	if (npages == 1) {
+		pa = coremap_cacheget();
+		if (pa != 0) {
+			return pa;
+		}
+	}
+
+	spinlock_acquire(&coremap_lock);
+	if (!coremap_ready) {
+		pa = ram_stealmem(npages);
+		spinlock_release(&coremap_lock);
+		return pa;
+	}
+
+	i = coremap_allocrun(npages);
+	if (i == CM_NIL) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+	pa = CM_PADDR(i);
+
+	if (npages == 1) {
+		/*
+		 * The cache was empty; refill it while we have the
+		 * lock. Holding a spinlock keeps us on this cpu.
+		 */
+		c = curcpu->c_self;
+		while (c->c_npagecache < CM_CACHEBATCH) {
+			i = coremap_allocrun(1);
+			if (i == CM_NIL) {
+				break;
+			}
+			c->c_pagecache[c->c_npagecache++] = CM_PADDR(i);
+		}
+	}
+	spinlock_release(&coremap_lock);
+
+	return pa;
+}
+
+void
+freeppages(paddr_t paddr)
+{
+	unsigned long start;
+	unsigned npages;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	if (!coremap_ready || paddr < coremap_base) {
+		/* Stolen before the coremap existed; we can't take it back. */
+		return;
+	}
+
+	start = CM_INDEX(paddr);
+	KASSERT(start < coremap_npages);
+	KASSERT(coremap[start].cme_used);
+	npages = coremap[start].cme_npages;
+	KASSERT(npages > 0);
+
+	if (npages == 1) {
+		coremap[start].cme_refcount = 0;
+		coremap_cacheput(paddr);
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	coremap_freerange(start, start + npages);
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Set up a frame to hold a freshly allocated user page. Needs
+ * coremap_lock unless nobody else can see the frame yet.
+ */
+static
+void
+coremap_initupage(struct coremap_entry *cme)
+{
+	cme->cme_refcount = 1;
+	cme->cme_as = NULL;
+	cme->cme_vaddr = 0;
+	cme->cme_referenced = true;
+	cme->cme_dirty = false;
+}
+
+paddr_t
+alloc_upage(void)
+{
+	paddr_t pa;
+	bool low;
+
+	/*
+	 * Frames in the cpus' caches are free too. The counts are
+	 * single words, so read them without the lock; being off by a
+	 * frame or two only moves the reserve a little.
+	 */
+	low = coremap_ready &&
+		coremap_nfree + cpu_pagecache_count() < CM_KRESERVE;
+	if (low) {
+		return 0;
+	}
+
+	pa = getppages(1);
+	if (pa == 0) {
+		return 0;
+	}
+
+	/*
+	 * The frame is ours alone until we hand it back, and the pager
+	 * passes over it while it has no owner, so no lock is needed.
+	 */
+	coremap_initupage(&coremap[CM_INDEX(pa)]);
+
+	return pa;
+}
+
+void
+free_upage(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+	bool last;
+
+	spinlock_acquire(&coremap_lock);
+	cme = &coremap[CM_INDEX(paddr)];
+	KASSERT(cme->cme_used);
+	KASSERT(cme->cme_refcount > 0);
+	cme->cme_refcount--;
+	last = (cme->cme_refcount == 0);
+	if (last) {
+		cme->cme_as = NULL;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (last) {
+		freeppages(paddr);
+	}
+}
+
+void
+upage_incref(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+
+	spinlock_acquire(&coremap_lock);
+	cme = &coremap[CM_INDEX(paddr)];
+	KASSERT(cme->cme_used);
+	KASSERT(cme->cme_refcount > 0);
+	cme->cme_refcount++;
+	/* Shared now; nobody in particular owns it. */
+	cme->cme_as = NULL;
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+upage_refcount(paddr_t paddr)
+{
+	/* One word; the answer can be stale as soon as we return anyway */
+	return coremap[CM_INDEX(paddr)].cme_refcount;
+}
+
+bool
+upage_access(paddr_t paddr, struct addrspace *as, vaddr_t vaddr, bool write)
+{
+	struct coremap_entry *cme;
+	bool dirty;
+
+	spinlock_acquire(&coremap_lock);
+	cme = &coremap[CM_INDEX(paddr)];
+	KASSERT(cme->cme_used);
+	KASSERT(cme->cme_refcount > 0);
+	cme->cme_referenced = true;
+	if (write) {
+		cme->cme_dirty = true;
+	}
+	if (cme->cme_refcount == 1 && cme->cme_as == NULL) {
+		cme->cme_as = as;
+		cme->cme_vaddr = vaddr;
+	}
+	dirty = cme->cme_dirty;
+	spinlock_release(&coremap_lock);
+
+	return dirty;
+}
+
+bool
+upage_isdirty(paddr_t paddr)
+{
+	return coremap[CM_INDEX(paddr)].cme_dirty;
+}
+
+paddr_t
+coremap_pickvictim(struct addrspace **as, vaddr_t *vaddr, bool cleanonly)
+{
+	struct coremap_entry *cme;
+	unsigned long n;
+	unsigned i;
+
+	spinlock_acquire(&coremap_lock);
+	/* Two sweeps: the first may only clear referenced bits. */
+	for (n=0; n<2*coremap_npages; n++) {
+		i = coremap_hand;
+		coremap_hand = (coremap_hand + 1) % coremap_npages;
+
+		cme = &coremap[i];
+		if (!cme->cme_used || cme->cme_refcount != 1 ||
+		    cme->cme_as == NULL || (cleanonly && cme->cme_dirty)) {
+			continue;
+		}
+		if (cme->cme_referenced) {
+			/* Second chance. */
+			cme->cme_referenced = false;
+			continue;
+		}
+
+		*as = cme->cme_as;
+		*vaddr = cme->cme_vaddr;
+		spinlock_release(&coremap_lock);
+		return CM_PADDR(i);
+	}
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+void
+upage_reuse(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+
+	spinlock_acquire(&coremap_lock);
+	cme = &coremap[CM_INDEX(paddr)];
+	KASSERT(cme->cme_refcount == 1);
+	coremap_initupage(cme);
+	spinlock_release(&coremap_lock);
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+
+	pa = getppages(npages);
+	if (pa == 0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	KASSERT(addr != 0);
+	freeppages(KVADDR_TO_PADDR(addr));
+}
@@ -0,0 +1,115 @@
+/*
+ * Two-level user page tables. See pagetable.h.
+ *
+ * Callers serialize access to a given table with the owning address
+ * space's as_lock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <uw-vmstats.h>
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(struct pagetable));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_L1ENTRIES; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i, j;
+	pte_t *l2;
+
+	for (i=0; i<PT_L1ENTRIES; i++) {
+		l2 = pt->pt_dir[i];
+		if (l2 == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_L2ENTRIES; j++) {
+			if (l2[j] & PTE_VALID) {
+				free_upage(l2[j] & PTE_FRAME);
+			}
+			else if (l2[j] & PTE_SWAPPED) {
+				swap_free(PTE_SLOT(l2[j]));
+			}
+		}
+		kfree(l2);
+	}
+	kfree(pt);
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	pte_t *l2;
+	unsigned i;
+
+	KASSERT(vaddr < USERSPACETOP);
+
+	l2 = pt->pt_dir[PT_L1INDEX(vaddr)];
+	if (l2 == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		l2 = kmalloc(PT_L2ENTRIES * sizeof(pte_t));
+		if (l2 == NULL) {
+			return NULL;
+		}
+		for (i=0; i<PT_L2ENTRIES; i++) {
+			l2[i] = 0;
+		}
+		pt->pt_dir[PT_L1INDEX(vaddr)] = l2;
+	}
+	return &l2[PT_L2INDEX(vaddr)];
+}
+
+int
+pt_copy(struct pagetable *src, struct pagetable *dst)
+{
+	unsigned i, j;
+	vaddr_t va;
+	pte_t *l2, *newpte;
+
+	for (i=0; i<PT_L1ENTRIES; i++) {
+		l2 = src->pt_dir[i];
+		if (l2 == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_L2ENTRIES; j++) {
+			if ((l2[j] & (PTE_VALID | PTE_SWAPPED)) == 0) {
+				continue;
+			}
+			va = ((vaddr_t)i << PT_L1SHIFT) |
+				((vaddr_t)j << PT_L2SHIFT);
+			newpte = pt_lookup(dst, va, true);
+			if (newpte == NULL) {
+				return ENOMEM;
+			}
+			if (l2[j] & PTE_VALID) {
+				upage_incref(l2[j] & PTE_FRAME);
+				vmstats_inc(VMSTAT_COW_SHARED);
+			}
+			else {
+				swap_incref(PTE_SLOT(l2[j]));
+			}
+			*newpte = l2[j];
+		}
+	}
+	return 0;
+}
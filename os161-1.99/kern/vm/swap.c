@@ -0,0 +1,177 @@
+/*
+ * Swap space on a raw disk. See swap.h.
+ *
+ * The device is carved into page-sized slots. Each slot has a
+ * reference count; a slot with no references is free. Allocation
+ * resumes scanning where the last one left off, so in the usual case
+ * it finds a free slot right away.
+ *
+ * The slot table is protected by swap_lock. I/O is done without it:
+ * nobody else touches a slot that one of our references pins.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+#include <uw-vmstats.h>
+
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+static struct vnode *swap_vnode;
+static uint16_t *swap_refcount;		/* one per slot */
+static unsigned swap_nslots;
+static unsigned swap_hint;		/* where to start looking */
+
+void
+swap_bootstrap(void)
+{
+	struct stat st;
+	char *path;
+	unsigned i;
+	int result;
+
+	/* vfs_open destroys the string it's passed */
+	path = kstrdup(SWAP_DEVICE);
+	if (path == NULL) {
+		panic("swap: out of memory\n");
+	}
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	kfree(path);
+	if (result) {
+		kprintf("swap: %s: %s; not swapping\n", SWAP_DEVICE,
+			strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: %s: stat: %s\n", SWAP_DEVICE, strerror(result));
+	}
+	swap_nslots = st.st_size / PAGE_SIZE;
+
+	swap_refcount = kmalloc(swap_nslots * sizeof(uint16_t));
+	if (swap_refcount == NULL) {
+		panic("swap: out of memory\n");
+	}
+	for (i=0; i<swap_nslots; i++) {
+		swap_refcount[i] = 0;
+	}
+	swap_hint = 0;
+
+	kprintf("swap: %uk on %s\n", swap_nslots * (PAGE_SIZE / 1024),
+		SWAP_DEVICE);
+}
+
+/*
+ * Do one page of I/O on slot SLOT.
+ */
+static
+int
+swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_out(paddr_t paddr, unsigned *slot)
+{
+	unsigned i, n;
+	int result;
+
+	if (swap_vnode == NULL) {
+		return ENOSPC;
+	}
+
+	spinlock_acquire(&swap_lock);
+	i = swap_hint;
+	for (n=0; n<swap_nslots; n++) {
+		if (swap_refcount[i] == 0) {
+			break;
+		}
+		i = (i + 1) % swap_nslots;
+	}
+	if (n == swap_nslots) {
+		spinlock_release(&swap_lock);
+		return ENOSPC;
+	}
+	swap_refcount[i] = 1;
+	swap_hint = (i + 1) % swap_nslots;
+	spinlock_release(&swap_lock);
+
+	result = swap_io(i, paddr, UIO_WRITE);
+	if (result) {
+		swap_free(i);
+		return result;
+	}
+
+	vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	*slot = i;
+	return 0;
+}
+
+int
+swap_in(unsigned slot, paddr_t paddr)
+{
+	int result;
+
+	result = swap_io(slot, paddr, UIO_READ);
+	if (result) {
+		return result;
+	}
+
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	vmstats_inc(VMSTAT_SWAP_FILE_READ);
+	swap_free(slot);
+	return 0;
+}
+
+void
+swap_incref(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refcount[slot] > 0 && swap_refcount[slot] < 0xffff);
+	swap_refcount[slot]++;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refcount[slot] > 0);
+	swap_refcount[slot]--;
+	spinlock_release(&swap_lock);
+}
@@ -33,6 +33,8 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "Pages Shared on Fork",
+ /* 11 */ "Copy-on-Write Copies",
 };
 
 
@@ -0,0 +1,531 @@
+/*
+ * Paging VM system: bootstrap, page fault handling, and the TLB.
+ *
+ * A TLB miss on a page that is already resident just reloads the
+ * translation from the page table. Otherwise a frame is allocated and
+ * filled, either from the executable (for the file-backed part of a
+ * region) or with zeros (bss, stack), before the translation is loaded.
+ *
+ * After fork, parent and child share every frame (see pt_copy). A
+ * shared page is mapped read-only even in a writeable region; the
+ * first write to it gets a private copy, unless by then every other
+ * sharer has let go, in which case the page is simply made writeable.
+ *
+ * When memory runs out, a page is evicted to make room (vm_evict).
+ * Clean pages are simply dropped, since they can be brought back from
+ * the executable or zero-filled again; dirty ones go to swap. To know
+ * which is which, a page is mapped read-only until the first write to
+ * it, even in a writeable region, and that write marks it dirty.
+ *
+ * A page fault does not hold as_lock while it allocates memory or
+ * does I/O: allocating may evict a page from another address space,
+ * whose lock we then need, and reading the executable may need
+ * locks held by a process that is itself evicting. Instead, the fault
+ * looks at the page table, drops the lock to do the slow part, and
+ * checks again afterwards. Since user processes are single-threaded,
+ * the only other party changing our page table is the evictor.
+ *
+ * TLB entries are tagged with the address space's ASID, so switching
+ * address spaces doesn't flush the TLB. There are only 63 ASIDs to go
+ * around (0 is the kernel's), so they are handed out in generations:
+ * when they run out, a new generation starts and each CPU flushes its
+ * TLB the next time it activates an address space. An address space
+ * whose ASID is from an old generation gets a new one when activated.
+ * An ASID is never reused within a generation, so retiring one (see
+ * as_flushtlb) makes every entry made under it unreachable on every CPU.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <proc.h>
+#include <current.h>
+#include <cpu.h>
+#include <mips/tlb.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <swap.h>
+#include <vm.h>
+#include <uw-vmstats.h>
+
+/* Serializes eviction against itself and address space teardown */
+struct lock *vm_evictlock;
+
+/* Remote CPUs signal this when they have done an eviction shootdown */
+static struct semaphore *vm_shootdown_sem;
+
+/* ASID allocation; see as_activate */
+static struct spinlock vm_asidlock = SPINLOCK_INITIALIZER;
+static uint32_t vm_asidgen = 1;		/* current generation */
+static uint32_t vm_nextasid = 1;	/* next free ASID in it */
+
+void
+vm_bootstrap(void)
+{
+	coremap_bootstrap();
+	vmstats_init();
+
+	vm_evictlock = lock_create("evict");
+	if (vm_evictlock == NULL) {
+		panic("vm: lock_create failed\n");
+	}
+	vm_shootdown_sem = sem_create("shootdown", 0);
+	if (vm_shootdown_sem == NULL) {
+		panic("vm: sem_create failed\n");
+	}
+
+	swap_bootstrap();
+}
+
+/*
+ * Fill the frame at PADDR with the contents of the page at VADDR in
+ * segment SEG.
+ */
+static
+int
+vm_loadpage(struct addrspace *as, struct segment *seg, vaddr_t vaddr,
+	    paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t kva, filetop, start, end;
+	int result;
+
+	kva = PADDR_TO_KVADDR(paddr);
+	bzero((void *)kva, PAGE_SIZE);
+
+	/* Clip the page against the file-backed part of the segment. */
+	filetop = seg->seg_filevaddr + seg->seg_filesize;
+	start = vaddr > seg->seg_filevaddr ? vaddr : seg->seg_filevaddr;
+	end = vaddr + PAGE_SIZE < filetop ? vaddr + PAGE_SIZE : filetop;
+
+	if (start >= end) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		return 0;
+	}
+
+	KASSERT(as->as_vnode != NULL);
+	uio_kinit(&iov, &ku, (void *)(kva + (start - vaddr)), end - start,
+		  seg->seg_fileoffset + (start - seg->seg_filevaddr),
+		  UIO_READ);
+	result = VOP_READ(as->as_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		kprintf("vm: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	vmstats_inc(VMSTAT_ELF_FILE_READ);
+	return 0;
+}
+
+/*
+ * Load a translation for VADDR into the TLB, replacing any existing
+ * entry for the same page.
+ */
+static
+void
+vm_tlbload(vaddr_t vaddr, paddr_t paddr, bool writeable)
+{
+	uint32_t ehi, elo;
+	int i, spl;
+
+	elo = paddr | TLBLO_VALID;
+	if (writeable) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	/* Ending with a write of EHI leaves entryhi's ASID as it was. */
+	ehi = vaddr | (curcpu->c_asid << TLBHI_PIDSHIFT);
+
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+		splx(spl);
+		return;
+	}
+
+	vmstats_inc(VMSTAT_TLB_FAULT);
+
+	for (i=0; i<NUM_TLB; i++) {
+		uint32_t oldhi, oldlo;
+
+		tlb_read(&oldhi, &oldlo, i);
+		if (oldlo & TLBLO_VALID) {
+			continue;
+		}
+		tlb_write(ehi, elo, i);
+		splx(spl);
+		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+		return;
+	}
+
+	tlb_random(ehi, elo);
+	splx(spl);
+	vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+}
+
+/*
+ * Remove any translation for VADDR under ASID from this CPU's TLB.
+ */
+static
+void
+vm_tlbinvalidate(uint32_t asid, vaddr_t vaddr)
+{
+	int i, spl;
+
+	spl = splhigh();
+	i = tlb_probe((vaddr & PAGE_FRAME) | (asid << TLBHI_PIDSHIFT), 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setasid(curcpu->c_asid);
+	splx(spl);
+}
+
+/*
+ * Remove any translation for VADDR in AS from every CPU's TLB, and
+ * wait until that is done. Only the evictor does this; since it
+ * holds vm_evictlock, each CPU has at most one of these pending and
+ * its shootdown queue never overflows into a full flush (which would
+ * not signal us).
+ */
+static
+void
+vm_shootdown(struct addrspace *as, vaddr_t vaddr)
+{
+	struct tlbshootdown ts;
+	unsigned n;
+
+	KASSERT(lock_do_i_hold(vm_evictlock));
+
+	vm_tlbinvalidate(as->as_asid, vaddr);
+
+	ts.ts_addrspace = as;
+	ts.ts_vaddr = vaddr;
+	ts.ts_done = vm_shootdown_sem;
+	n = ipi_tlbshootdown_broadcast(&ts);
+	while (n-- > 0) {
+		P(vm_shootdown_sem);
+	}
+}
+
+/*
+ * Throw a page out of memory and return its frame, which now belongs
+ * to the caller. Returns 0 if nothing can be evicted.
+ */
+static
+paddr_t
+vm_evict(void)
+{
+	struct addrspace *as;
+	vaddr_t vaddr;
+	paddr_t paddr;
+	pte_t *pte;
+	unsigned slot;
+	bool cleanonly = false;
+	int result;
+
+	lock_acquire(vm_evictlock);
+ again:
+	for (;;) {
+		paddr = coremap_pickvictim(&as, &vaddr, cleanonly);
+		if (paddr == 0) {
+			lock_release(vm_evictlock);
+			return 0;
+		}
+
+		lock_acquire(as->as_lock);
+		pte = pt_lookup(as->as_pt, vaddr, false);
+		if (pte != NULL && (*pte & PTE_VALID) &&
+		    (*pte & PTE_FRAME) == paddr &&
+		    upage_refcount(paddr) == 1) {
+			break;
+		}
+		/* It moved while we weren't looking; pick another. */
+		lock_release(as->as_lock);
+	}
+
+	vm_shootdown(as, vaddr);
+
+	if (upage_isdirty(paddr)) {
+		result = swap_out(paddr, &slot);
+		if (result) {
+			/*
+			 * Leave it be, and look for a clean page, which
+			 * doesn't need swap. The TLB entry we shot down
+			 * comes back on the next access.
+			 */
+			lock_release(as->as_lock);
+			cleanonly = true;
+			goto again;
+		}
+		*pte = PTE_MKSWAP(slot);
+	}
+	else {
+		/* vm_fault will bring it back from where it came from. */
+		*pte = 0;
+	}
+	lock_release(as->as_lock);
+	lock_release(vm_evictlock);
+
+	upage_reuse(paddr);
+	return paddr;
+}
+
+/*
+ * Allocate a frame for a user page, evicting something if necessary.
+ * The caller must not hold any address space's lock.
+ */
+static
+paddr_t
+vm_getupage(void)
+{
+	paddr_t paddr;
+
+	paddr = alloc_upage();
+	if (paddr == 0) {
+		paddr = vm_evict();
+	}
+	return paddr;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct segment *seg;
+	pte_t *pte, oldpte;
+	paddr_t paddr, newpa;
+	bool write, writeable;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	seg = as_findsegment(as, faultaddress);
+	if (seg == NULL) {
+		return EFAULT;
+	}
+	write = (faulttype != VM_FAULT_READ);
+	if (write && !seg->seg_writeable) {
+		return EFAULT;
+	}
+
+	lock_acquire(as->as_lock);
+
+	/* Second-level tables are never freed, so PTE stays good. */
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL) {
+		lock_release(as->as_lock);
+		return ENOMEM;
+	}
+
+	if ((*pte & PTE_VALID) == 0) {
+		/* Not resident: fill a new frame, then install it. */
+		oldpte = *pte;
+		lock_release(as->as_lock);
+
+		newpa = vm_getupage();
+		if (newpa == 0) {
+			return ENOMEM;
+		}
+		if (oldpte & PTE_SWAPPED) {
+			result = swap_in(PTE_SLOT(oldpte), newpa);
+			/* The swap copy is gone, so this one is dirty. */
+			write = true;
+		}
+		else {
+			result = vm_loadpage(as, seg, faultaddress, newpa);
+		}
+		if (result) {
+			free_upage(newpa);
+			return result;
+		}
+
+		lock_acquire(as->as_lock);
+		KASSERT(*pte == oldpte);
+		*pte = newpa | PTE_VALID;
+	}
+	else if (write && upage_refcount(*pte & PTE_FRAME) > 1) {
+		/* Shared: make a private copy. */
+		oldpte = *pte;
+		lock_release(as->as_lock);
+
+		newpa = vm_getupage();
+		if (newpa == 0) {
+			return ENOMEM;
+		}
+
+		lock_acquire(as->as_lock);
+		if (*pte != oldpte || upage_refcount(*pte & PTE_FRAME) == 1) {
+			/*
+			 * The page was evicted, or the other sharers
+			 * went away. Let the access fault again and
+			 * sort it out then.
+			 */
+			lock_release(as->as_lock);
+			free_upage(newpa);
+			return 0;
+		}
+		paddr = oldpte & PTE_FRAME;
+		memmove((void *)PADDR_TO_KVADDR(newpa),
+			(const void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+		*pte = newpa | PTE_VALID;
+		free_upage(paddr);
+		vmstats_inc(VMSTAT_COW_COPY);
+		if (faulttype != VM_FAULT_READONLY) {
+			/*
+			 * It was also a TLB miss, on a page that was
+			 * resident; count it as a reload like any other.
+			 */
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+		}
+	}
+	else if (faulttype != VM_FAULT_READONLY) {
+		/* Resident, just not in the TLB. */
+		vmstats_inc(VMSTAT_TLB_RELOAD);
+	}
+	paddr = *pte & PTE_FRAME;
+
+	/*
+	 * Only a dirty page that nobody else shares may be written
+	 * without faulting.
+	 */
+	writeable = upage_access(paddr, as, faultaddress, write) &&
+		seg->seg_writeable && upage_refcount(paddr) == 1;
+
+	/*
+	 * Load the TLB before letting go of the lock, so that an evictor
+	 * can't shoot the translation down before it is even there.
+	 */
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	vm_tlbload(faultaddress, paddr, writeable);
+
+	lock_release(as->as_lock);
+	return 0;
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	int i, spl;
+
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setasid(curcpu->c_asid);
+	splx(spl);
+
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	vm_tlbinvalidate(ts->ts_addrspace->as_asid, ts->ts_vaddr);
+	if (ts->ts_done != NULL) {
+		V(ts->ts_done);
+	}
+}
+
+void
+as_activate(void)
+{
+	struct addrspace *as;
+	bool flush;
+	int spl;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/* Kernel threads don't have an address spaces to activate */
+		return;
+	}
+
+	/* Stay on this cpu until entryhi is set. */
+	spl = splhigh();
+
+	spinlock_acquire(&vm_asidlock);
+	if (as->as_asidgen != vm_asidgen) {
+		if (vm_nextasid == TLBHI_NPIDS) {
+			/* Out of ASIDs; start over. */
+			vm_asidgen++;
+			vm_nextasid = 1;
+		}
+		as->as_asid = vm_nextasid++;
+		as->as_asidgen = vm_asidgen;
+	}
+	flush = (curcpu->c_asidgen != vm_asidgen);
+	curcpu->c_asidgen = vm_asidgen;
+	curcpu->c_asid = as->as_asid;
+	spinlock_release(&vm_asidlock);
+
+	if (flush) {
+		/* Entries from the last generation may alias ours. */
+		vm_tlbshootdown_all();
+	}
+	else {
+		tlb_setasid(curcpu->c_asid);
+	}
+
+	splx(spl);
+}
+
+void
+as_flushtlb(struct addrspace *as)
+{
+	spinlock_acquire(&vm_asidlock);
+	as->as_asidgen = 0;
+	spinlock_release(&vm_asidlock);
+
+	if (as == curproc_getas()) {
+		as_activate();
+	}
+}
+
+void
+as_deactivate(void)
+{
+	/* nothing */
+}
@@ -56,6 +56,30 @@
 
 #include "disk.h"
 
+static
+void
+dumpjournal(uint32_t start, uint32_t jblocks)
+{
+	struct sfs_jdesc jd;
+	uint32_t i, n;
+
+	printf("Journal: %u blocks at %u\n", jblocks, start);
+
+	diskread(&jd, start);
+	if (SWAPL(jd.sjd_magic) != SFS_JDESC_MAGIC) {
+		printf("    [no descriptor]\n");
+		return;
+	}
+	n = SWAPL(jd.sjd_nblocks);
+	printf("    Transaction %u: %u blocks\n", SWAPL(jd.sjd_seq), n);
+	if (n > SFS_JMAXBLOCKS) {
+		n = SFS_JMAXBLOCKS;
+	}
+	for (i=0; i<n; i++) {
+		printf("        %u\n", SWAPL(jd.sjd_blocks[i]));
+	}
+}
+
 static
 uint32_t
 dumpsb(void)
@@ -68,6 +92,23 @@ dumpsb(void)
 	sp.sp_volname[sizeof(sp.sp_volname)-1] = 0;
 	printf("Volume name: %-40s  %u blocks\n", sp.sp_volname, 
 	       SWAPL(sp.sp_nblocks));
+	if (SWAPL(sp.sp_version) != SFS_VERSION) {
+		warnx("Warning: sfs version %u (expected %u)",
+		      SWAPL(sp.sp_version), SFS_VERSION);
+	}
+	if (SWAPL(sp.sp_features) != 0) {
+		printf("Features: 0x%x%s%s%s\n", SWAPL(sp.sp_features),
+		       (SWAPL(sp.sp_features) & SFS_FEATURE_DIRHASH) ?
+		       " (directory hashing)" : "",
+		       (SWAPL(sp.sp_features) & SFS_FEATURE_JOURNAL) ?
+		       " (journal)" : "",
+		       (SWAPL(sp.sp_features) & SFS_FEATURE_INLINE) ?
+		       " (inline files)" : "");
+	}
+	if (SWAPL(sp.sp_features) & SFS_FEATURE_JOURNAL) {
+		dumpjournal(SWAPL(sp.sp_journalstart),
+			    SWAPL(sp.sp_journalblocks));
+	}
 
 	return SWAPL(sp.sp_nblocks);
 }
@@ -95,12 +136,45 @@ dodirblock(uint32_t block)
 	}
 }
 
+/*
+ * Dump the directory blocks under an indirect block with HEIGHT
+ * levels of indirect blocks below it (0 for one that points straight
+ * at data blocks). Returns the number of directory blocks.
+ */
+static
+uint32_t
+dodirindirect(uint32_t iblock, int height)
+{
+	uint32_t ib[SFS_DBPERIDB];
+	uint32_t block, nblocks=0;
+	int i;
+
+	if (iblock == 0) {
+		return 0;
+	}
+
+	diskread(&ib, iblock);
+	for (i=0; i<SFS_DBPERIDB; i++) {
+		block = SWAPL(ib[i]);
+		if (block == 0) {
+			continue;
+		}
+		if (height > 0) {
+			nblocks += dodirindirect(block, height-1);
+		}
+		else {
+			dodirblock(block);
+			nblocks++;
+		}
+	}
+	return nblocks;
+}
+
 static
 void
 dumpdir(uint32_t ino)
 {
 	struct sfs_inode sfi;
-	uint32_t ib[SFS_DBPERIDB];
 	int nentries, i;
 	uint32_t block, nblocks=0;
 
@@ -119,16 +193,9 @@ dumpdir(uint32_t ino)
 			nblocks++;
 		}
 	}
-	if (SWAPL(sfi.sfi_indirect)) {
-		diskread(&ib, SWAPL(sfi.sfi_indirect));
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			block = SWAPL(ib[i]);
-			if (block) {
-				dodirblock(block);
-				nblocks++;
-			}
-		}
-	}
+	nblocks += dodirindirect(SWAPL(sfi.sfi_indirect), 0);
+	nblocks += dodirindirect(SWAPL(sfi.sfi_dindirect), 1);
+	nblocks += dodirindirect(SWAPL(sfi.sfi_tindirect), 2);
 	printf("    %u blocks in directory\n", nblocks);
 }
 
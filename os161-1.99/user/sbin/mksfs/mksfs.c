@@ -64,11 +64,32 @@ check(void)
 	assert(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	assert(sizeof(struct sfs_jdesc)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jcommit)==SFS_BLOCKSIZE);
 }
 
+/*
+ * Where the journal goes, if there is one: right after the freemap,
+ * big enough for the largest transaction, but no more than an eighth
+ * of the volume.
+ */
 static
 void
-writesuper(const char *volname, uint32_t nblocks)
+journalsize(uint32_t nblocks, uint32_t *start, uint32_t *jblocks)
+{
+	*start = SFS_MAP_LOCATION + SFS_BITBLOCKS(nblocks);
+	*jblocks = SFS_JMAXBLOCKS + 2;
+	if (*jblocks > nblocks / 8) {
+		*jblocks = nblocks / 8;
+	}
+	if (*jblocks < 3) {
+		errx(1, "Volume too small for a journal");
+	}
+}
+
+static
+void
+writesuper(const char *volname, uint32_t nblocks, uint32_t features)
 {
 	struct sfs_super sp;
 
@@ -80,6 +101,15 @@ writesuper(const char *volname, uint32_t nblocks)
 
 	sp.sp_magic = SWAPL(SFS_MAGIC);
 	sp.sp_nblocks = SWAPL(nblocks);
+	sp.sp_version = SWAPL(SFS_VERSION);
+	sp.sp_features = SWAPL(features);
+	if (features & SFS_FEATURE_JOURNAL) {
+		uint32_t start, jblocks;
+
+		journalsize(nblocks, &start, &jblocks);
+		sp.sp_journalstart = SWAPL(start);
+		sp.sp_journalblocks = SWAPL(jblocks);
+	}
 	strcpy(sp.sp_volname, volname);
 
 	diskwrite(&sp, SFS_SB_LOCATION);
@@ -113,9 +143,29 @@ doallocbit(uint32_t bit)
 	bitbuf[byte] |= mask;
 }
 
+/*
+ * Start the journal off empty.
+ */
+static
+void
+writejournal(uint32_t fsblocks)
+{
+	struct sfs_jdesc jd;
+	uint32_t start, jblocks;
+
+	journalsize(fsblocks, &start, &jblocks);
+
+	bzero((void *)&jd, sizeof(jd));
+	jd.sjd_magic = SWAPL(SFS_JDESC_MAGIC);
+	jd.sjd_seq = SWAPL(0);
+	jd.sjd_nblocks = SWAPL(0);
+
+	diskwrite(&jd, start);
+}
+
 static
 void
-writebitmap(uint32_t fsblocks)
+writebitmap(uint32_t fsblocks, uint32_t features)
 {
 
 	uint32_t nbits = SFS_BITMAPSIZE(fsblocks);
@@ -136,6 +186,14 @@ writebitmap(uint32_t fsblocks)
 	for (i=fsblocks; i<nbits; i++) {
 		doallocbit(i);
 	}
+	if (features & SFS_FEATURE_JOURNAL) {
+		uint32_t start, jblocks;
+
+		journalsize(fsblocks, &start, &jblocks);
+		for (i=0; i<jblocks; i++) {
+			doallocbit(start+i);
+		}
+	}
 
 	for (i=0; i<nblocks; i++) {
 		ptr = bitbuf + i*SFS_BLOCKSIZE;
@@ -147,14 +205,36 @@ int
 main(int argc, char **argv)
 {
 	uint32_t size, blocksize;
+	uint32_t features = 0;
 	char *volname, *s;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	/*
+	 * -H: index big directories; -J: journal metadata;
+	 * -I: keep small files in their inodes
+	 */
+	while (argc > 3 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-H")) {
+			features |= SFS_FEATURE_DIRHASH;
+		}
+		else if (!strcmp(argv[1], "-J")) {
+			features |= SFS_FEATURE_JOURNAL;
+		}
+		else if (!strcmp(argv[1], "-I")) {
+			features |= SFS_FEATURE_INLINE;
+		}
+		else {
+			break;
+		}
+		argc--;
+		argv++;
+	}
+
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-H] [-I] [-J] device/diskfile volume-name");
 	}
 
 	check();
@@ -185,9 +265,12 @@ main(int argc, char **argv)
 	}
 	size = diskblocks();
 
-	writesuper(volname, size);
+	writesuper(volname, size, features);
 	writerootdir();
-	writebitmap(size);
+	writebitmap(size, features);
+	if (features & SFS_FEATURE_JOURNAL) {
+		writejournal(size);
+	}
 
 	closedisk();
 
@@ -83,6 +83,10 @@ swapsb(struct sfs_super *sp)
 {
 	sp->sp_magic = SWAPL(sp->sp_magic);
 	sp->sp_nblocks = SWAPL(sp->sp_nblocks);
+	sp->sp_version = SWAPL(sp->sp_version);
+	sp->sp_features = SWAPL(sp->sp_features);
+	sp->sp_journalstart = SWAPL(sp->sp_journalstart);
+	sp->sp_journalblocks = SWAPL(sp->sp_journalblocks);
 }
 
 static
@@ -126,6 +130,9 @@ swapinode(struct sfs_inode *sfi)
 	sfi->sfi_tindirect = SWAPL(sfi->sfi_tindirect);
 #endif
 #endif
+
+	sfi->sfi_dirindex = SWAPL(sfi->sfi_dirindex);
+	sfi->sfi_flags = SWAPL(sfi->sfi_flags);
 }
 
 static
@@ -172,6 +179,7 @@ domalloc(size_t len)
 typedef enum {
 	B_SUPERBLOCK,	/* Block that is the superblock */
 	B_BITBLOCK,	/* Block used by free-block bitmap */
+	B_JOURNAL,	/* Block of the journal */
 	B_INODE,	/* Block that is an inode */
 	B_IBLOCK,	/* Indirect (or doubly-indirect etc.) block */
 	B_DIRDATA,	/* Data block of a directory */
@@ -180,7 +188,7 @@ typedef enum {
 	B_PASTEND,	/* Block off the end of the fs */
 } blockusage_t;
 
-static uint32_t nblocks, bitblocks;
+static uint32_t nblocks, bitblocks, features;
 static uint32_t uniquecounter = 1;
 
 static unsigned long count_blocks=0, count_dirs=0, count_files=0;
@@ -210,6 +218,7 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 	switch (how) {
 	    case B_SUPERBLOCK: return "superblock";
 	    case B_BITBLOCK: return "bitmap block";
+	    case B_JOURNAL: return "journal block";
 	    case B_INODE: return "inode";
 	    case B_IBLOCK: 
 		snprintf(rv, sizeof(rv), "indirect block of inode %lu", 
@@ -521,6 +530,15 @@ check_sb(void)
 	if (sp.sp_magic != SFS_MAGIC) {
 		errx(EXIT_UNRECOV, "Not an sfs filesystem");
 	}
+	if (sp.sp_version != SFS_VERSION) {
+		errx(EXIT_UNRECOV, "Unsupported sfs version %lu (expected %d)",
+		     (unsigned long) sp.sp_version, SFS_VERSION);
+	}
+	if (sp.sp_features & ~SFS_FEATURES_KNOWN) {
+		errx(EXIT_UNRECOV, "Unsupported sfs features 0x%lx",
+		     (unsigned long) (sp.sp_features & ~SFS_FEATURES_KNOWN));
+	}
+	features = sp.sp_features;
 
 	assert(nblocks==0);
 	assert(bitblocks==0);
@@ -554,6 +572,118 @@ check_sb(void)
 	for (i=0; i<bitblocks; i++) {
 		bitmap_mark(SFS_MAP_LOCATION+i, B_BITBLOCK, i);
 	}
+	if (features & SFS_FEATURE_JOURNAL) {
+		/* replay_journal checked where it is */
+		for (i=0; i<sp.sp_journalblocks; i++) {
+			bitmap_mark(sp.sp_journalstart+i, B_JOURNAL, i);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * 32-bit FNV-1a, continued from SUM; must match sfs_jsum in the
+ * kernel. It's over the bytes as they are on disk.
+ */
+static
+uint32_t
+jsum(uint32_t sum, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		sum ^= p[i];
+		sum *= 16777619U;
+	}
+	return sum;
+}
+
+/*
+ * If the journal holds a complete transaction, finish it, as the
+ * kernel would at mount. This comes before anything else is checked,
+ * since the transaction can change anything.
+ */
+static
+void
+replay_journal(void)
+{
+	struct sfs_super sp;
+	struct sfs_jdesc jd, sjd;
+	struct sfs_jcommit jc;
+	char data[SFS_BLOCKSIZE];
+	uint32_t start, jblocks, n, i, block, sum;
+
+	diskread(&sp, SFS_SB_LOCATION);
+	swapsb(&sp);
+	if (sp.sp_magic != SFS_MAGIC ||
+	    (sp.sp_features & SFS_FEATURE_JOURNAL) == 0) {
+		/* check_sb will complain if need be */
+		return;
+	}
+
+	start = sp.sp_journalstart;
+	jblocks = sp.sp_journalblocks;
+	if (jblocks < 3 ||
+	    start < SFS_MAP_LOCATION + SFS_BITBLOCKS(sp.sp_nblocks) ||
+	    start + jblocks > sp.sp_nblocks) {
+		errx(EXIT_UNRECOV, "Invalid journal location");
+	}
+
+	diskread(&jd, start);
+	sjd = jd;
+	sjd.sjd_magic = SWAPL(jd.sjd_magic);
+	sjd.sjd_seq = SWAPL(jd.sjd_seq);
+	sjd.sjd_nblocks = SWAPL(jd.sjd_nblocks);
+	n = sjd.sjd_nblocks;
+	if (sjd.sjd_magic != SFS_JDESC_MAGIC || n == 0) {
+		return;
+	}
+	if (n > SFS_JMAXBLOCKS || n + 2 > jblocks) {
+		warnx("Invalid journal descriptor (discarded)");
+		setbadness(EXIT_RECOV);
+		n = 0;
+	}
+	else {
+		/* An incomplete transaction never happened */
+		sum = jsum(2166136261U, &jd, sizeof(jd));
+		for (i=0; i<n; i++) {
+			diskread(data, start+1+i);
+			sum = jsum(sum, data, sizeof(data));
+		}
+		diskread(&jc, start+1+n);
+		if (SWAPL(jc.sjc_magic) != SFS_JCOMMIT_MAGIC ||
+		    SWAPL(jc.sjc_seq) != sjd.sjd_seq ||
+		    SWAPL(jc.sjc_nblocks) != n || SWAPL(jc.sjc_sum) != sum) {
+			n = 0;
+		}
+	}
+
+	for (i=0; i<n; i++) {
+		block = SWAPL(jd.sjd_blocks[i]);
+		if (block >= sp.sp_nblocks ||
+		    (block >= start && block < start + jblocks)) {
+			errx(EXIT_UNRECOV, "Journal has invalid block %lu",
+			     (unsigned long) block);
+		}
+	}
+	for (i=0; i<n; i++) {
+		diskread(data, start+1+i);
+		diskwrite(data, SWAPL(jd.sjd_blocks[i]));
+	}
+	if (n > 0) {
+		warnx("Replayed transaction %lu (%lu blocks) from the journal",
+		      (unsigned long) sjd.sjd_seq, (unsigned long) n);
+		setbadness(EXIT_RECOV);
+	}
+
+	/* Leave it empty */
+	bzero(&jd, sizeof(jd));
+	jd.sjd_magic = SWAPL(SFS_JDESC_MAGIC);
+	jd.sjd_seq = SWAPL(sjd.sjd_seq);
+	jd.sjd_nblocks = SWAPL(0);
+	diskwrite(&jd, start);
 }
 
 ////////////////////////////////////////////////////////////
@@ -565,19 +695,21 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 		     int isdir, int indirection)
 {
 	uint32_t entries[SFS_DBPERIDB];
-	uint32_t i, ct;
+	uint32_t i, ct, span;
 
-	if (*ientry !=0) {
-		diskread(entries, *ientry);
-		swapindir(entries);
-		bitmap_mark(*ientry, B_IBLOCK, ino);
-	}
-	else {
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			entries[i] = 0;
+	if (*ientry == 0) {
+		/* Nothing to check; just skip the blocks it would map */
+		for (span=1, i=0; i<(uint32_t)indirection; i++) {
+			span *= SFS_DBPERIDB;
 		}
+		*blockp += span;
+		return;
 	}
 
+	diskread(entries, *ientry);
+	swapindir(entries);
+	bitmap_mark(*ientry, B_IBLOCK, ino);
+
 	if (indirection > 1) {
 		for (i=0; i<SFS_DBPERIDB; i++) {
 			check_indirect_block(ino, &entries[i], 
@@ -631,12 +763,93 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 	}
 }
 
+static void free_tree(uint32_t block, int indirection);
+
+/*
+ * Check an inode that keeps its file's contents in sfi_inline. It
+ * should have no blocks, and nothing in sfi_inline past EOF. Returns
+ * nonzero if the inode was modified.
+ */
+static
+int
+check_inline(uint32_t ino, struct sfs_inode *sfi)
+{
+	uint32_t i, badcount = 0;
+	int changed = 0;
+
+	if (sfi->sfi_size > SFS_INLINESIZE) {
+		warnx("Inode %lu: inline file is %lu bytes (truncated)",
+		      (unsigned long) ino, (unsigned long) sfi->sfi_size);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_size = SFS_INLINESIZE;
+		changed = 1;
+	}
+
+	for (i=0; i<SFS_NDIRECT; i++) {
+		if (sfi->sfi_direct[i] != 0) {
+			bitmap_mark(sfi->sfi_direct[i], B_TOFREE, 0);
+			sfi->sfi_direct[i] = 0;
+			badcount++;
+		}
+	}
+	if (sfi->sfi_indirect != 0) {
+		free_tree(sfi->sfi_indirect, 1);
+		sfi->sfi_indirect = 0;
+		badcount++;
+	}
+	if (sfi->sfi_dindirect != 0) {
+		free_tree(sfi->sfi_dindirect, 2);
+		sfi->sfi_dindirect = 0;
+		badcount++;
+	}
+	if (sfi->sfi_tindirect != 0) {
+		free_tree(sfi->sfi_tindirect, 3);
+		sfi->sfi_tindirect = 0;
+		badcount++;
+	}
+	if (badcount > 0) {
+		warnx("Inode %lu: inline file has blocks (freed)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+
+	for (i=sfi->sfi_size; i<SFS_INLINESIZE; i++) {
+		if (sfi->sfi_inline[i] != 0) {
+			warnx("Inode %lu: garbage after EOF of inline file "
+			      "(cleared)", (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			bzero(sfi->sfi_inline + sfi->sfi_size,
+			      SFS_INLINESIZE - sfi->sfi_size);
+			changed = 1;
+			break;
+		}
+	}
+
+	return changed;
+}
+
 /* returns nonzero if inode modified */
 static
 int
 check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
 {
 	uint32_t size, block, nblocks, badcount;
+	int changed = 0;
+
+	if (sfi->sfi_flags & SFS_IFLAG_INLINE) {
+		if (!isdir && (features & SFS_FEATURE_INLINE)) {
+			return check_inline(ino, sfi);
+		}
+		/* Its contents are lost; treat it as empty */
+		warnx("Inode %lu: bad inline flag (cleared, contents lost)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= ~SFS_IFLAG_INLINE;
+		sfi->sfi_size = 0;
+		bzero(sfi->sfi_inline, SFS_INLINESIZE);
+		changed = 1;
+	}
 
 	badcount = 0;
 
@@ -700,7 +913,7 @@ check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
 		return 1;
 	}
 
-	return 0;
+	return changed;
 }
 
 ////////////////////////////////////////////////////////////
@@ -966,6 +1179,259 @@ check_dir_entry(const char *pathsofar, uint32_t index, struct sfs_dir *sfd)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Directory hash indexes.
+ *
+ * An index is only a shortcut for the kernel, which rebuilds it when
+ * it's missing, so rather than repair one we throw it away.
+ */
+
+/* Same hash the kernel uses: 32-bit FNV-1a */
+static
+uint32_t
+dirhash(const char *name)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* Mark BLOCK, and everything under it if it's an indirect block, to free */
+static
+void
+free_tree(uint32_t block, int indirection)
+{
+	uint32_t entries[SFS_DBPERIDB];
+	int i;
+
+	if (block == 0 || block >= nblocks) {
+		return;
+	}
+	if (indirection > 0) {
+		diskread(entries, block);
+		swapindir(entries);
+		for (i=0; i<SFS_DBPERIDB; i++) {
+			free_tree(entries[i], indirection-1);
+		}
+	}
+	bitmap_mark(block, B_TOFREE, 0);
+}
+
+/* Mark the index inode IDX and all its blocks to free */
+static
+void
+free_dirindex(uint32_t idx)
+{
+	struct sfs_inode isfi;
+	int i;
+
+	if (idx >= nblocks) {
+		return;
+	}
+	diskread(&isfi, idx);
+	swapinode(&isfi);
+	if (isfi.sfi_type != SFS_TYPE_DIRINDEX) {
+		/* not ours to free */
+		return;
+	}
+	for (i=0; i<SFS_NDIRECT; i++) {
+		free_tree(isfi.sfi_direct[i], 0);
+	}
+	free_tree(isfi.sfi_indirect, 1);
+#ifdef HAS_DIDIRECT
+	free_tree(isfi.sfi_dindirect, 2);
+#endif
+#ifdef HAS_TIDIRECT
+	free_tree(isfi.sfi_tindirect, 3);
+#endif
+	bitmap_mark(idx, B_TOFREE, 0);
+}
+
+/*
+ * Check index inode IDX against the ND directory entries D. Returns
+ * what's wrong with it, or NULL if nothing is.
+ */
+static
+const char *
+dirindex_problem(uint32_t idx, const struct sfs_dir *d, uint32_t nd)
+{
+	const uint32_t perblock = SFS_BLOCKSIZE/sizeof(struct sfs_dirindex_entry);
+	struct sfs_inode isfi;
+	struct sfs_dirindex_header hdr;
+	struct sfs_dirindex_entry *table;
+	uint8_t *seen;
+	uint32_t nb, mask, i, b, block, nused, nlive, slot;
+	const char *problem = NULL;
+
+	if (idx >= nblocks) {
+		return "inode out of range";
+	}
+	diskread(&isfi, idx);
+	swapinode(&isfi);
+	if (isfi.sfi_type != SFS_TYPE_DIRINDEX) {
+		return "not an index";
+	}
+	if (isfi.sfi_linkcount != 1) {
+		return "bad link count";
+	}
+
+	block = dobmap(&isfi, 0);
+	if (isfi.sfi_size < SFS_BLOCKSIZE || block == 0 || block >= nblocks) {
+		return "no header";
+	}
+	diskread(&hdr, block);
+	nb = SWAPL(hdr.sdh_nbuckets);
+	hdr.sdh_nused = SWAPL(hdr.sdh_nused);
+	hdr.sdh_nfree = SWAPL(hdr.sdh_nfree);
+	if (nb == 0 || (nb & (nb-1)) != 0) {
+		return "bad bucket count";
+	}
+	if (isfi.sfi_size != SFS_BLOCKSIZE + nb*sizeof(*table)) {
+		return "wrong size";
+	}
+	if (hdr.sdh_nfree > SFS_DIRINDEX_NFREE) {
+		return "bad free list";
+	}
+
+	table = domalloc(SFS_ROUNDUP(nb, perblock) * sizeof(*table));
+	seen = domalloc(nd + 1);
+	bzero(seen, nd + 1);
+	for (i=0; i*perblock < nb; i++) {
+		block = dobmap(&isfi, i+1);
+		if (block == 0) {
+			bzero(table + i*perblock, SFS_BLOCKSIZE);
+		}
+		else if (block >= nblocks) {
+			problem = "block out of range";
+			goto out;
+		}
+		else {
+			diskread(table + i*perblock, block);
+		}
+	}
+
+	/* Every bucket must point at a live entry with that hash... */
+	mask = nb - 1;
+	nused = 0;
+	for (b=0; b<nb; b++) {
+		slot = SWAPL(table[b].sde_slot);
+		table[b].sde_hash = SWAPL(table[b].sde_hash);
+		table[b].sde_slot = slot;
+		if (slot == 0) {
+			continue;
+		}
+		nused++;
+		if (slot > nd || d[slot-1].sfd_ino == SFS_NOINO ||
+		    seen[slot-1]) {
+			problem = "bad slot";
+			goto out;
+		}
+		seen[slot-1] = 1;
+		if (dirhash(d[slot-1].sfd_name) != table[b].sde_hash) {
+			problem = "wrong hash";
+			goto out;
+		}
+	}
+	if (nused != hdr.sdh_nused) {
+		problem = "wrong count";
+		goto out;
+	}
+
+	/* ...that a probe from its home bucket reaches... */
+	for (b=0; b<nb; b++) {
+		if (table[b].sde_slot == 0) {
+			continue;
+		}
+		for (i = table[b].sde_hash & mask; i != b; i = (i+1) & mask) {
+			if (table[i].sde_slot == 0) {
+				problem = "entry out of place";
+				goto out;
+			}
+		}
+	}
+
+	/* ...and every live entry must have a bucket. */
+	for (i=nlive=0; i<nd; i++) {
+		if (d[i].sfd_ino != SFS_NOINO) {
+			nlive++;
+		}
+	}
+	if (nlive != nused) {
+		problem = "entries missing";
+		goto out;
+	}
+
+	/* The free list may only hold empty slots, once each. */
+	for (i=0; i<hdr.sdh_nfree; i++) {
+		slot = SWAPL(hdr.sdh_free[i]);
+		if (slot >= nd || d[slot].sfd_ino != SFS_NOINO || seen[slot]) {
+			problem = "bad free list";
+			goto out;
+		}
+		seen[slot] = 1;
+	}
+
+ out:
+	free(table);
+	free(seen);
+	return problem;
+}
+
+/*
+ * Check the hash index of directory INO, whose inode is SFI and
+ * whose entries are D[0..ND-1]. DCHANGED says the entries have been
+ * changed, which leaves the index out of date. Returns nonzero if
+ * SFI was changed.
+ */
+static
+int
+check_dirindex(uint32_t ino, struct sfs_inode *sfi,
+	       const struct sfs_dir *d, uint32_t nd, int dchanged,
+	       const char *pathsofar)
+{
+	struct sfs_inode isfi;
+	uint32_t idx = sfi->sfi_dirindex;
+	const char *problem;
+
+	if (idx == 0) {
+		return 0;
+	}
+
+	if ((features & SFS_FEATURE_DIRHASH) == 0) {
+		problem = "volume doesn't use them";
+	}
+	else if (dchanged) {
+		problem = "directory changed";
+	}
+	else {
+		problem = dirindex_problem(idx, d, nd);
+	}
+
+	if (problem == NULL) {
+		diskread(&isfi, idx);
+		swapinode(&isfi);
+		bitmap_mark(idx, B_INODE, ino);
+		if (check_inode_blocks(idx, &isfi, 0)) {
+			swapinode(&isfi);
+			diskwrite(&isfi, idx);
+		}
+		return 0;
+	}
+
+	setbadness(EXIT_RECOV);
+	warnx("Directory /%s: Bad hash index: %s (removed)",
+	      pathsofar, problem);
+	free_dirindex(idx);
+	sfi->sfi_dirindex = 0;
+	return 1;
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
@@ -1194,6 +1660,11 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		ichanged = 1;
 	}
 
+	if (check_dirindex(ino, &sfi, direntries, ndirentries, dchanged,
+			   pathsofar)) {
+		ichanged = 1;
+	}
+
 	if (dchanged) {
 		dirwrite(&sfi, direntries, ndirentries);
 	}
@@ -1254,9 +1725,12 @@ main(int argc, char **argv)
 	assert(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	assert(sizeof(struct sfs_jdesc)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jcommit)==SFS_BLOCKSIZE);
 
 	opendisk(argv[1]);
 
+	replay_journal();
 	check_sb();
 	check_root_dir();
 	check_bitmap();